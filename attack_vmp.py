@@ -8,47 +8,65 @@ import argparse
 import sys
 
 from triton import *
+from vmp_solver import QueryLog, SolverCache, get_model
+from vmp_trace import read_trace
 
 
 V_JMP = list()
+QUERIES = QueryLog()
+CACHE = SolverCache()
+
+
+def gpr_registers(ctx):
+    # Same order as the registers of a VMP trace
+    return [
+        ctx.registers.rax, ctx.registers.rbx, ctx.registers.rcx, ctx.registers.rdx,
+        ctx.registers.rdi, ctx.registers.rsi, ctx.registers.rbp, ctx.registers.rsp,
+        ctx.registers.r8,  ctx.registers.r9,  ctx.registers.r10, ctx.registers.r11,
+        ctx.registers.r12, ctx.registers.r13, ctx.registers.r14, ctx.registers.r15,
+    ]
+
+
+def sync_reg(ctx, regs, pin_regs, dirty):
+    # Only registers changed by Pin or written by Triton since the last
+    # synchronization may differ, the others are already in sync.
+    for index in dirty:
+        tt_reg = regs[index]
+        if ctx.getConcreteRegisterValue(tt_reg) != pin_regs[index]:
+            ctx.setConcreteRegisterValue(tt_reg, pin_regs[index])
+    dirty.clear()
+    return
 
 
-def sync_reg(ctx, regs):
-    mapping = {
-        ctx.registers.rax : regs[0],
-        ctx.registers.rbx : regs[1],
-        ctx.registers.rcx : regs[2],
-        ctx.registers.rdx : regs[3],
-        ctx.registers.rdi : regs[4],
-        ctx.registers.rsi : regs[5],
-        ctx.registers.rbp : regs[6],
-        ctx.registers.rsp : regs[7],
-        ctx.registers.r8  : regs[8],
-        ctx.registers.r9  : regs[9],
-        ctx.registers.r10 : regs[10],
-        ctx.registers.r11 : regs[11],
-        ctx.registers.r12 : regs[12],
-        ctx.registers.r13 : regs[13],
-        ctx.registers.r14 : regs[14],
-        ctx.registers.r15 : regs[15],
-    }
-
-    for tt_reg, pin_value in mapping.items():
-        tt_value = ctx.getConcreteRegisterValue(tt_reg)
-        if tt_value != int(pin_value, 16):
-            ctx.setConcreteRegisterValue(tt_reg, int(pin_value, 16))
-    return
+def written_gpr(ctx, inst, index):
+    # Indexes of the GPRs written by the instruction
+    dirty = set()
+    for reg, _ in inst.getWrittenRegisters():
+        i = index.get(ctx.getParentRegister(reg).getId())
+        if i is not None:
+            dirty.add(i)
+    return dirty
 
 
-def sync_memory(ctx, args):
-    _, addr, size, data = args
-    memory = MemoryAccess(int(addr, 16), int(size))
+def sync_memory(ctx, record):
+    _, addr, size, data = record
+    memory = MemoryAccess(addr, size)
     synch  = ctx.getConcreteMemoryValue(memory)
-    if synch != int(data, 16):
-        ctx.setConcreteMemoryValue(memory, int(data, 16))
+    if synch != data:
+        ctx.setConcreteMemoryValue(memory, data)
     return
 
 
+def check_memory(ctx, record):
+    # A write replayed by Triton must give the value seen by Pin
+    _, addr, size, data = record
+    memory = MemoryAccess(addr, size)
+    if ctx.getConcreteMemoryValue(memory) == data:
+        return True
+    ctx.setConcreteMemoryValue(memory, data)
+    return False
+
+
 def detecting_vjmp(execid, ctx, inst, vbraddr, vbrflag):
     global V_JMP
     ast = ctx.getAstContext()
@@ -57,7 +75,6 @@ def detecting_vjmp(execid, ctx, inst, vbraddr, vbrflag):
         if inst.isSymbolized() and inst.getAddress() == vbraddr:
             flag = ctx.getRegisterAst(ctx.getRegister(vbrflag))
             if len(ast.search(flag, AST_NODE.VARIABLE)) == 2:
-                model, status, _ = ctx.getModel(flag == flag.evaluate(), status=True)
                 V_JMP.append(flag == flag.evaluate())
                 return
 
@@ -66,7 +83,7 @@ def detecting_vjmp(execid, ctx, inst, vbraddr, vbrflag):
         if inst.isSymbolized() and inst.getType() == OPCODE.X86.POPFQ:
             cf = ctx.getRegisterAst(ctx.registers.cf)
             if len(ast.search(cf, AST_NODE.VARIABLE)) == 2:
-                model, status, _ = ctx.getModel(cf != cf.evaluate(), status=True)
+                model, status = get_model(ctx, cf != cf.evaluate(), QUERIES, f'{hex(inst.getAddress())} cf', cache=CACHE)
                 if status == SOLVER_STATE.SAT:
                     print(f'[+] A potential symbolic jump found on CF flag: {inst} - Model: {model}')
 
@@ -77,7 +94,7 @@ def detecting_vjmp(execid, ctx, inst, vbraddr, vbrflag):
             if op1.getType() == OPERAND.REG and op2.getType() == OPERAND.REG:
                 af  = ctx.getRegisterAst(ctx.registers.af)
                 if len(ast.search(af, AST_NODE.VARIABLE)) == 2:
-                    model, status, _ = ctx.getModel(af != af.evaluate(), status=True)
+                    model, status = get_model(ctx, af != af.evaluate(), QUERIES, f'{hex(inst.getAddress())} af', cache=CACHE)
                     if status == SOLVER_STATE.SAT:
                         print(f'[+] A potential symbolic jump found of AF flag: {inst} - Model: {model}')
 
@@ -109,8 +126,8 @@ def update_sym_var(ctx):
     return
 
 
-def exec_instruction(execid, ctx, symsize, args, fuse, vbraddr, vbrflag):
-    _, addr, size, data = args
+def exec_instruction(execid, ctx, symsize, record, fuse, vbraddr, vbrflag):
+    _, addr, size, data, _ = record
 
     # This fuse is burned after the first instruction
     if fuse:
@@ -130,36 +147,54 @@ def exec_instruction(execid, ctx, symsize, args, fuse, vbraddr, vbrflag):
             # If symbolic variables already exist, assign them to registers
             update_sym_var(ctx)
 
-    inst = Instruction(int(addr, 16), bytes.fromhex(data))
+    inst = Instruction(addr, data)
     ctx.processing(inst)
     detecting_vjmp(execid, ctx, inst, vbraddr, vbrflag)
 
-    return False
+    return inst
 
 
-def emulate(execid, ctx, symsize, file, vbraddr, vbrflag):
+def emulate(execid, ctx, symsize, file, vbraddr, vbrflag, check=0):
     count = 0
     fuse = True
+    writes = 0
+    mismatch = 0
 
-    with open(file, 'r') as fd:
-      for line in fd:
-        args = line.split(':')
-        kind = args[0]
+    regs     = gpr_registers(ctx)
+    index    = {reg.getId(): i for i, reg in enumerate(regs)}
+    pin_regs = [0] * len(regs)
+    dirty    = set()
+
+    for record in read_trace(file):
+        kind = record[0]
 
         # Synch memory read
         if kind == 'mr':
-            sync_memory(ctx, args)
+            sync_memory(ctx, record)
 
         # Synch registers
         if kind == 'r':
-            sync_reg(ctx, args[1:])
+            for i, value in record[1]:
+                pin_regs[i] = value
+                dirty.add(i)
+            sync_reg(ctx, regs, pin_regs, dirty)
 
         # Execute instruction
         if kind == 'i':
-            fuse = exec_instruction(execid, ctx, symsize, args, fuse, vbraddr, vbrflag)
+            inst  = exec_instruction(execid, ctx, symsize, record, fuse, vbraddr, vbrflag)
+            fuse  = False
+            dirty = written_gpr(ctx, inst, index)
             count += 1
 
+        # Check the memory model against the writes seen by Pin (-mw traces)
+        if kind == 'mw' and check:
+            writes += 1
+            if writes % check == 0 and not check_memory(ctx, record):
+                mismatch += 1
+
     print(f'[+] Instruction executed: {count}')
+    if mismatch:
+        print(f'[!] Memory writes which differ from the trace: {mismatch}')
     return
 
 
@@ -171,9 +206,9 @@ def setMode(ctx):
     return
 
 
-def one_path(execid, ctx, trace, symsize, vbraddr, vbrflag):
+def one_path(execid, ctx, trace, symsize, vbraddr, vbrflag, check=0):
     print('[+] Replaying the VMP trace')
-    emulate(execid, ctx, symsize, trace, vbraddr, vbrflag)
+    emulate(execid, ctx, symsize, trace, vbraddr, vbrflag, check)
     print('[+] Emulation done')
     eax = ctx.getRegisterAst(ctx.registers.eax)
     return eax
@@ -195,20 +230,33 @@ def result(ctx, ret_expr):
     return 0
 
 
+def queries(path):
+    if QUERIES.total():
+        QUERIES.summary()
+    if path:
+        QUERIES.write(path)
+    CACHE.save()
+    return
+
+
 def analysis(argv):
+    global CACHE
     ctx = TritonContext(ARCH.X86_64)
     setMode(ctx)
+    CACHE = SolverCache(argv.solver_cache)
 
-    ret_expr1 = one_path(1, ctx, argv.trace1, argv.symsize, argv.vbraddr, argv.vbrflag)
+    ret_expr1 = one_path(1, ctx, argv.trace1, argv.symsize, argv.vbraddr, argv.vbrflag, argv.check_writes)
     if argv.trace2:
         print(f'[+] A second trace has been provided')
-        ret_expr2 = one_path(2, ctx, argv.trace2, argv.symsize, argv.vbraddr, argv.vbrflag)
+        ret_expr2 = one_path(2, ctx, argv.trace2, argv.symsize, argv.vbraddr, argv.vbrflag, argv.check_writes)
+        queries(argv.solver_log)
         ast = ctx.getAstContext()
         print(f'[+] Merging expressions from trace1 and trace2')
         e1 = V_JMP[0]
         ret_expr2 = ast.ite(e1, ret_expr2, ret_expr1)
         result(ctx, ret_expr2)
     else:
+        queries(argv.solver_log)
         result(ctx, ret_expr1)
     return 0
 
@@ -220,6 +268,9 @@ def main():
     parser.add_argument("--symsize", type=int,                  metavar="<symsize>", help="Specify the size of symbolic variables")
     parser.add_argument("--vbraddr", type=lambda x: int(x,0),   metavar="<vbraddr>", help="Virtual branch address")
     parser.add_argument("--vbrflag", type=str,                  metavar="<vbrflag>", help="Virtual branch flag")
+    parser.add_argument("--check-writes", type=int, default=0,  metavar="<n>",       help="Check one memory write out of n against the trace (traces recorded with -mw)")
+    parser.add_argument("--solver-log", type=str,               metavar="<file>",    help="Log every solver query and how it was answered")
+    parser.add_argument("--solver-cache", type=str,             metavar="<file>",    help="Load and save the solver results in this file")
     argv = parser.parse_args(sys.argv[1:])
 
     if argv.trace1 is None:
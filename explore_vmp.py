@@ -0,0 +1,404 @@
+#!/usr/bin/env python
+## -*- coding: utf-8 -*-
+##
+## Working with Triton from commit 05b05cfbe8697a4a93d6ba674062f97465270412
+##
+## Automated path exploration of a VMP function. Every trace is replayed, the
+## virtual branches it took (the hits of --vbraddr) are negated one by one to
+## get inputs taking new paths, those inputs are traced by a Pin session in
+## -forkserver mode which stays up for the whole exploration, and the paths
+## are finally merged into a tree of ite nodes. Paths are told apart by the
+## control flow of their traces.
+##
+##   $ ./explore_vmp.py --pin ./pin/pin --tool ./pin/source/tools/VMP_Trace/obj-intel64/VMP_Trace.so \
+##         --start 4198848 --end 4198928 --symsize 4 --vbraddr 0x80d905 --vbrflag af \
+##         -- ./vmp_binaries/binaries/sample5.vmp.bin 1 2
+##
+
+import argparse
+import errno
+import fcntl
+import hashlib
+import multiprocessing
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+from collections import OrderedDict
+from triton import *
+
+import attack_vmp
+from vmp_solver import QueryLog, SolverCache, get_model
+from vmp_trace import read_trace
+
+
+# Solver results of a replay process, loaded once
+CACHE = None
+
+
+
+class Tracer(object):
+    # Pin session in -forkserver mode: every input tuple written to the FIFO
+    # is traced by a child, whose trace appears as <out>.input<n> once complete
+
+    def __init__(self, argv, workdir):
+        self.fifo  = os.path.join(workdir, 'inputs.fifo')
+        self.out   = os.path.join(workdir, 'vmp.trace')
+        self.count = 0
+        os.mkfifo(self.fifo)
+
+        cmd = [argv.pin, '-t', argv.tool, '-start', str(argv.start), '-end', str(argv.end),
+               '-forkserver', self.fifo, '-jobs', str(argv.jobs), '-o', self.out, '-format', 'binary',
+               '--'] + argv.command
+        self.log  = open(os.path.join(workdir, 'pin.log'), 'w')
+        self.proc = subprocess.Popen(cmd, stdout=self.log, stderr=subprocess.STDOUT)
+
+        # Pin opens the FIFO before starting the application, a blocking open
+        # would never return if it failed to start
+        while True:
+            try:
+                fd = os.open(self.fifo, os.O_WRONLY | os.O_NONBLOCK)
+                break
+            except OSError as e:
+                if e.errno != errno.ENXIO:
+                    raise
+                if self.proc.poll() is not None:
+                    raise RuntimeError(f'Pin exited with {self.proc.returncode}, see {self.log.name}')
+                time.sleep(0.05)
+        fcntl.fcntl(fd, fcntl.F_SETFL, fcntl.fcntl(fd, fcntl.F_GETFL) & ~os.O_NONBLOCK)
+        self.server = os.fdopen(fd, 'w', buffering=1)
+        return
+
+
+    def trace(self, inputs):
+        # Returns the path of the trace to come
+        self.server.write(' '.join(hex(value) for value in inputs) + '\n')
+        path = f'{self.out}.input{self.count}'
+        self.count += 1
+        return path
+
+
+    def alive(self):
+        return self.proc.poll() is None
+
+
+    def close(self):
+        # End of the inputs, the original call resumes and Pin exits
+        self.server.close()
+        self.proc.wait()
+        self.log.close()
+        return
+
+
+def symbolize_inputs(ctx, symsize):
+    map_size = {
+        1: (ctx.registers.dil, ctx.registers.sil),
+        2: (ctx.registers.di, ctx.registers.si),
+        4: (ctx.registers.edi, ctx.registers.esi),
+        8: (ctx.registers.rdi, ctx.registers.rsi),
+    }
+    # Paths replayed in the same context share their variables
+    if len(ctx.getSymbolicVariables()) == 0:
+        ctx.symbolizeRegister(map_size[symsize][0], 'x')
+        ctx.symbolizeRegister(map_size[symsize][1], 'y')
+    else:
+        attack_vmp.update_sym_var(ctx)
+    return
+
+
+def replay(ctx, trace, symsize, vbraddr, vbrflag):
+    # Returns the return value, the virtual branches taken, as
+    # ((addr, flag, value), constraint, flag) triples, and the control flow
+    # of the trace: a digest of the addresses of its instructions. The
+    # markers of attack_vmp.py are not used, most of them are data flags which
+    # do not change the control flow.
+    ast      = ctx.getAstContext()
+    branches = list()
+    fuse     = True
+    flow     = hashlib.blake2b(digest_size=16)
+
+    regs     = attack_vmp.gpr_registers(ctx)
+    index    = {reg.getId(): i for i, reg in enumerate(regs)}
+    pin_regs = [0] * len(regs)
+    dirty    = set()
+
+    ctx.concretizeAllRegister()
+    ctx.concretizeAllMemory()
+
+    for record in read_trace(trace):
+        kind = record[0]
+
+        if kind == 'mr':
+            attack_vmp.sync_memory(ctx, record)
+
+        if kind == 'r':
+            for i, value in record[1]:
+                pin_regs[i] = value
+                dirty.add(i)
+            attack_vmp.sync_reg(ctx, regs, pin_regs, dirty)
+
+        if kind == 'i':
+            _, addr, size, data, _ = record
+            if fuse:
+                symbolize_inputs(ctx, symsize)
+            fuse = False
+
+            inst = Instruction(addr, data)
+            ctx.processing(inst)
+            dirty = attack_vmp.written_gpr(ctx, inst, index)
+            flow.update(addr.to_bytes(8, 'little'))
+
+            if addr == vbraddr and inst.isSymbolized():
+                flag = ctx.getRegisterAst(ctx.getRegister(vbrflag))
+                if len(ast.search(flag, AST_NODE.VARIABLE)) == 2:
+                    value = flag.evaluate()
+                    branches.append(((addr, vbrflag, value), flag == value, flag))
+
+    return ctx.getRegisterAst(ctx.registers.eax), branches, flow.hexdigest()
+
+
+def format_input(inputs):
+    return '(' + ', '.join(hex(value) for value in inputs) + ')'
+
+
+def conjunction(ast, nodes):
+    return nodes[0] if len(nodes) == 1 else ast.land(nodes)
+
+
+def value_with(ctx, node, model):
+    # Value of the node with the inputs of a model, the concrete values of the
+    # variables are restored
+    saved = list()
+    for m in model.values():
+        var = m.getVariable()
+        saved.append((var, ctx.getConcreteVariableValue(var)))
+        ctx.setConcreteVariableValue(var, m.getValue())
+    value = node.evaluate()
+    for var, v in saved:
+        ctx.setConcreteVariableValue(var, v)
+    return value
+
+
+def explore(trace, symsize, vbraddr, vbrflag, claimed, cache):
+    # Worker: replays a trace in its own context and negates its branches.
+    # Returns the control flow and the branches of the path, the (prefix,
+    # inputs) pairs of the new paths, a prefix being the branches up to the
+    # negated one, the log of its queries and the new solver results.
+    # Prefixes already claimed by the scheduler are not queried.
+    global CACHE
+    if CACHE is None:
+        CACHE = SolverCache(cache)
+
+    ctx = TritonContext(ARCH.X86_64)
+    attack_vmp.setMode(ctx)
+    ast = ctx.getAstContext()
+    log = QueryLog()
+
+    _, branches, flow = replay(ctx, trace, symsize, vbraddr, vbrflag)
+    path = tuple(site for site, _, _ in branches)
+
+    current = dict()
+    for var in ctx.getSymbolicVariables().values():
+        current[var.getAlias()] = ctx.getConcreteVariableValue(var)
+
+    found = list()
+    for k, ((addr, name, value), _, flag) in enumerate(branches):
+        # Same query as vmp_replay. The register of the branch may be wider
+        # than a flag, the other branch is the value it takes with the model:
+        # only the prefix of a flag is known before the query.
+        if flag.getBitvectorSize() == 1 and path[:k] + ((addr, name, value ^ 1),) in claimed:
+            continue
+        query = [c for _, c, _ in branches[:k]] + [ast.distinct(flag, ast.bv(value, flag.getBitvectorSize()))]
+        model, status = get_model(ctx, conjunction(ast, query), log, f'{os.path.basename(trace)} {hex(addr)} {name}', cache=CACHE)
+        if status != SOLVER_STATE.SAT:
+            continue
+        prefix = path[:k] + ((addr, name, value_with(ctx, flag, model)),)
+        if prefix in claimed:
+            continue
+        inputs = dict(current)
+        for m in model.values():
+            inputs[m.getVariable().getAlias()] = m.getValue()
+        found.append((prefix, (inputs['x'], inputs['y'])))
+
+    added, CACHE.added = CACHE.added, dict()
+    return flow, path, found, log, added
+
+
+def merge(ast, paths, depth=0):
+    # Decision tree over the branches of the paths, (path, branches, ret)
+    # triples replayed in the same context. Paths are grouped on their branch
+    # at this depth, the one which has no branch left is the default.
+    if len(paths) == 1:
+        return paths[0][2]
+
+    groups = OrderedDict()
+    done   = list()
+    for p in paths:
+        if depth >= len(p[0]):
+            done.append(p)
+        else:
+            groups.setdefault(p[0][depth], list()).append(p)
+
+    if not groups:
+        return done[0][2]
+
+    branches = list(groups.values())
+    if not done and len(branches) == 1:
+        return merge(ast, branches[0], depth + 1)
+
+    node = done[0][2] if done else merge(ast, branches[0], depth + 1)
+    for group in (branches if done else branches[1:]):
+        node = ast.ite(group[0][1][depth][1], merge(ast, group, depth + 1), node)
+    return node
+
+
+def exploration(argv, workdir):
+    # The workers are forked first, they must not inherit the FIFO: Pin only
+    # sees the end of the inputs once every writer closed it
+    pool    = multiprocessing.Pool(argv.workers or None)
+    tracer  = Tracer(argv, workdir)
+    site    = (argv.vbraddr, argv.vbrflag)
+
+    claimed = set()             # Path prefixes explored or being explored
+    paths   = OrderedDict()     # Control flow -> trace
+    tracing = list()            # (trace, inputs, time)
+    running = list()            # (trace, inputs, async result)
+    queries = QueryLog()
+    cache   = SolverCache(argv.solver_cache)
+
+    tracing.append((tracer.trace(argv.input), tuple(argv.input), time.time()))
+    print(f'[+] Tracing {format_input(argv.input)}')
+
+    while tracing or running:
+        busy = False
+
+        for item in list(tracing):
+            trace, inputs, started = item
+            if os.path.exists(trace):
+                tracing.remove(item)
+                running.append((trace, inputs, pool.apply_async(explore, (trace, argv.symsize) + site + (frozenset(claimed), argv.solver_cache))))
+                busy = True
+            elif not tracer.alive() or time.time() - started > argv.timeout:
+                tracing.remove(item)
+                print(f'[-] No trace for {format_input(inputs)}')
+
+        for item in list(running):
+            trace, inputs, result = item
+            if not result.ready():
+                continue
+            running.remove(item)
+            busy = True
+
+            flow, path, found, log, added = result.get()
+            queries.update(log)
+            cache.update(added)
+            for k in range(1, len(path) + 1):
+                claimed.add(path[:k])
+            if flow in paths:
+                print(f'[+] {os.path.basename(trace)}: same path as {os.path.basename(paths[flow])}')
+            else:
+                paths[flow] = trace
+                print(f'[+] {os.path.basename(trace)}: new path with {len(path)} virtual branches')
+
+            for prefix, new in found:
+                if prefix in claimed or len(paths) + len(tracing) + len(running) >= argv.max_paths:
+                    continue
+                claimed.add(prefix)
+                tracing.append((tracer.trace(new), new, time.time()))
+                print(f'[+] Tracing {format_input(new)}')
+
+        if not busy:
+            time.sleep(0.05)
+
+    pool.close()
+    pool.join()
+    tracer.close()
+
+    if queries.total():
+        queries.summary()
+    if argv.solver_log:
+        queries.write(argv.solver_log)
+    cache.save()
+    return paths
+
+
+def analysis(argv):
+    workdir = argv.workdir or tempfile.mkdtemp(prefix='vmp_explore.')
+    os.makedirs(workdir, exist_ok=True)
+    print(f'[+] Traces in {workdir}')
+
+    paths = exploration(argv, workdir)
+    if not paths:
+        print('[-] No path has been traced')
+        return -1
+    print(f'[+] No new feasible path, {len(paths)} paths found')
+
+    # Variables are created by the first replay and shared by the others
+    ctx = TritonContext(ARCH.X86_64)
+    attack_vmp.setMode(ctx)
+    merged = list()
+    for trace in paths.values():
+        ret, branches, _ = replay(ctx, trace, argv.symsize, argv.vbraddr, argv.vbrflag)
+        merged.append((tuple(site for site, _, _ in branches), branches, ret))
+
+    print(f'[+] Merging expressions from {len(merged)} traces')
+    return attack_vmp.result(ctx, merge(ctx.getAstContext(), merged))
+
+
+def main():
+    parser = argparse.ArgumentParser(formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--pin",       type=str, default="./pin/pin", metavar="<pin>",     help="Pin launcher")
+    parser.add_argument("--tool",      type=str, default="./pin/source/tools/VMP_Trace/obj-intel64/VMP_Trace.so", metavar="<tool>", help="VMP_Trace Pintool")
+    parser.add_argument("--start",     type=lambda x: int(x,0), metavar="<start>",   help="Start address of the traced function")
+    parser.add_argument("--end",       type=lambda x: int(x,0), metavar="<end>",     help="End address of the traced function")
+    parser.add_argument("--symsize",   type=int,                metavar="<symsize>", help="Specify the size of symbolic variables")
+    parser.add_argument("--input",     type=lambda x: int(x,0), nargs=2, metavar="<x>", help="First input to trace. Default: the arguments of the binary")
+    parser.add_argument("--vbraddr",   type=lambda x: int(x,0), metavar="<vbraddr>", help="Address of the virtual branch to negate")
+    parser.add_argument("--vbrflag",   type=str,                metavar="<vbrflag>", help="Flag of the virtual branch (e.g: cf, af, zf)")
+    parser.add_argument("--jobs",      type=int, default=os.cpu_count(), metavar="<n>", help="Inputs traced at once by Pin")
+    parser.add_argument("--workers",   type=int, default=0,     metavar="<n>",       help="Replay processes (default: one per core)")
+    parser.add_argument("--max-paths", type=int, default=64,    metavar="<n>",       help="Stop after this number of traces")
+    parser.add_argument("--timeout",   type=int, default=600,   metavar="<seconds>", help="Time given to Pin to trace an input")
+    parser.add_argument("--solver-log", type=str,               metavar="<file>",    help="Log every solver query and how it was answered")
+    parser.add_argument("--solver-cache", type=str,             metavar="<file>",    help="Load and save the solver results in this file")
+    parser.add_argument("--workdir",   type=str,                metavar="<dir>",     help="Directory of the traces (default: a new temporary directory)")
+    parser.add_argument("command",     nargs=argparse.REMAINDER, help="-- <vmp binary> <args>")
+    argv = parser.parse_args(sys.argv[1:])
+
+    if argv.command and argv.command[0] == '--':
+        argv.command = argv.command[1:]
+
+    syntax = '[!] Syntax: %s --start <start> --end <end> --symsize <sym size> --vbraddr <vbraddr> --vbrflag <vbrflag> [--input <x> <y>] -- <vmp binary> <args>' %(sys.argv[0])
+
+    if argv.start is None or argv.end is None or not argv.command:
+        print('[-] You must define the traced function and the binary')
+        print(syntax)
+        return -1
+
+    if argv.symsize not in [1, 2, 4, 8]:
+        print('[-] Size of symbolic variables must be equal to: 1, 2, 4, or 8 bytes')
+        print(syntax)
+        return -1
+
+    # Without it, every symbolic popfq or cmp would count as a branch
+    if argv.vbraddr is None or argv.vbrflag is None:
+        print('[-] You must define the virtual branch with --vbraddr and --vbrflag')
+        print(syntax)
+        return -1
+
+    if argv.input is None:
+        try:
+            argv.input = [int(x, 0) for x in argv.command[1:3]]
+        except ValueError:
+            argv.input = []
+        if len(argv.input) != 2:
+            print('[-] The first input can not be taken from the arguments of the binary, give it with --input')
+            return -1
+
+    return analysis(argv)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -8,67 +8,87 @@ import argparse
 import sys
 
 from triton import *
+from vmp_solver import QueryLog, SolverCache, get_model
+from vmp_trace import read_trace
 
 
+QUERIES = QueryLog()
+CACHE = SolverCache()
 
-def sync_reg(ctx, regs):
-    mapping = {
-        ctx.registers.rax : regs[0],
-        ctx.registers.rbx : regs[1],
-        ctx.registers.rcx : regs[2],
-        ctx.registers.rdx : regs[3],
-        ctx.registers.rdi : regs[4],
-        ctx.registers.rsi : regs[5],
-        ctx.registers.rbp : regs[6],
-        ctx.registers.rsp : regs[7],
-        ctx.registers.r8  : regs[8],
-        ctx.registers.r9  : regs[9],
-        ctx.registers.r10 : regs[10],
-        ctx.registers.r11 : regs[11],
-        ctx.registers.r12 : regs[12],
-        ctx.registers.r13 : regs[13],
-        ctx.registers.r14 : regs[14],
-        ctx.registers.r15 : regs[15],
-    }
-
-    for tt_reg, pin_value in mapping.items():
-        tt_value = ctx.getConcreteRegisterValue(tt_reg)
-        if tt_value != int(pin_value, 16):
-            ctx.setConcreteRegisterValue(tt_reg, int(pin_value, 16))
+
+
+def gpr_registers(ctx):
+    # Same order as the registers of a VMP trace
+    return [
+        ctx.registers.rax, ctx.registers.rbx, ctx.registers.rcx, ctx.registers.rdx,
+        ctx.registers.rdi, ctx.registers.rsi, ctx.registers.rbp, ctx.registers.rsp,
+        ctx.registers.r8,  ctx.registers.r9,  ctx.registers.r10, ctx.registers.r11,
+        ctx.registers.r12, ctx.registers.r13, ctx.registers.r14, ctx.registers.r15,
+    ]
+
+
+def sync_reg(ctx, regs, pin_regs, dirty):
+    # Only registers changed by Pin or written by Triton since the last
+    # synchronization may differ, the others are already in sync.
+    for index in dirty:
+        tt_reg = regs[index]
+        if ctx.getConcreteRegisterValue(tt_reg) != pin_regs[index]:
+            ctx.setConcreteRegisterValue(tt_reg, pin_regs[index])
+    dirty.clear()
     return
 
 
-def sync_memory(ctx, args):
-    _, addr, size, data = args
-    memory = MemoryAccess(int(addr, 16), int(size))
+def written_gpr(ctx, inst, index):
+    # Indexes of the GPRs written by the instruction
+    dirty = set()
+    for reg, _ in inst.getWrittenRegisters():
+        i = index.get(ctx.getParentRegister(reg).getId())
+        if i is not None:
+            dirty.add(i)
+    return dirty
+
+
+def sync_memory(ctx, record):
+    _, addr, size, data = record
+    memory = MemoryAccess(addr, size)
     synch  = ctx.getConcreteMemoryValue(memory)
-    if synch != int(data, 16):
-        ctx.setConcreteMemoryValue(memory, int(data, 16))
+    if synch != data:
+        ctx.setConcreteMemoryValue(memory, data)
     return
 
 
+def check_memory(ctx, record):
+    # A write replayed by Triton must give the value seen by Pin
+    _, addr, size, data = record
+    memory = MemoryAccess(addr, size)
+    if ctx.getConcreteMemoryValue(memory) == data:
+        return True
+    ctx.setConcreteMemoryValue(memory, data)
+    return False
+
+
 def detecting_vjmp(ctx, inst):
     ast = ctx.getAstContext()
 
     if inst.isSymbolized() and inst.getType() == OPCODE.X86.POPFQ:
         cf = ctx.getRegisterAst(ctx.registers.cf)
         if len(ast.search(cf, AST_NODE.VARIABLE)) == 2:
-            model, status, _ = ctx.getModel(cf != cf.evaluate(), status=True)
+            model, status = get_model(ctx, cf != cf.evaluate(), QUERIES, f'{hex(inst.getAddress())} cf', cache=CACHE)
             if status == SOLVER_STATE.SAT:
                 print(f'[+] A potential symbolic jump found on CF flag: {inst} - Model: {model}')
 
     if inst.isSymbolized() and inst.getType() == OPCODE.X86.CMP:
         af = ctx.getRegisterAst(ctx.registers.af)
         if len(ast.search(af, AST_NODE.VARIABLE)) == 2:
-            model, status, _ = ctx.getModel(af != af.evaluate(), status=True)
+            model, status = get_model(ctx, af != af.evaluate(), QUERIES, f'{hex(inst.getAddress())} af', cache=CACHE)
             if status == SOLVER_STATE.SAT:
                 print(f'[+] A potential symbolic jump found of AF flag: {inst} - Model: {model}')
 
     return
 
 
-def exec_instruction(ctx, symsize, args, fuse):
-    _, addr, size, data = args
+def exec_instruction(ctx, symsize, record, fuse):
+    _, addr, size, data, _ = record
 
     if fuse:
         print('[+] Symbolize inputs')
@@ -81,7 +101,7 @@ def exec_instruction(ctx, symsize, args, fuse):
         ctx.symbolizeRegister(map_size[symsize][0], 'x')
         ctx.symbolizeRegister(map_size[symsize][1], 'y')
 
-    inst = Instruction(int(addr, 16), bytes.fromhex(data))
+    inst = Instruction(addr, data)
     ctx.processing(inst)
     detecting_vjmp(ctx, inst)
     #if inst.isSymbolized():
@@ -89,32 +109,50 @@ def exec_instruction(ctx, symsize, args, fuse):
     #else:
     #    print(f'[ ] {inst}')
 
-    return False
+    return inst
 
 
-def emulate(ctx, symsize, file):
+def emulate(ctx, symsize, file, check=0):
     count = 0
     fuse = True
+    writes = 0
+    mismatch = 0
+
+    regs     = gpr_registers(ctx)
+    index    = {reg.getId(): i for i, reg in enumerate(regs)}
+    pin_regs = [0] * len(regs)
+    dirty    = set()
 
-    with open(file, 'r') as fd:
-      for line in fd:
-        args = line.split(':')
-        kind = args[0]
+    for record in read_trace(file):
+        kind = record[0]
 
         # Synch memory read
         if kind == 'mr':
-            sync_memory(ctx, args)
+            sync_memory(ctx, record)
 
         # Synch registers
         if kind == 'r':
-            sync_reg(ctx, args[1:])
+            for i, value in record[1]:
+                pin_regs[i] = value
+                dirty.add(i)
+            sync_reg(ctx, regs, pin_regs, dirty)
 
         # Execute instruction
         if kind == 'i':
-            fuse = exec_instruction(ctx, symsize, args, fuse)
+            inst  = exec_instruction(ctx, symsize, record, fuse)
+            fuse  = False
+            dirty = written_gpr(ctx, inst, index)
             count += 1
 
+        # Check the memory model against the writes seen by Pin (-mw traces)
+        if kind == 'mw' and check:
+            writes += 1
+            if writes % check == 0 and not check_memory(ctx, record):
+                mismatch += 1
+
     print(f'[+] Instruction executed: {count}')
+    if mismatch:
+        print(f'[!] Memory writes which differ from the trace: {mismatch}')
     return
 
 
@@ -126,20 +164,27 @@ def setMode(ctx):
     return
 
 
-def one_path(ctx, trace, symsize):
+def one_path(ctx, trace, symsize, check=0):
     ctx.concretizeAllRegister()
     ctx.concretizeAllMemory()
     print('[+] Replaying the VMP trace')
-    emulate(ctx, symsize, trace)
+    emulate(ctx, symsize, trace, check)
     print('[+] Emulation done')
     eax = ctx.getRegisterAst(ctx.registers.eax)
     return eax
 
 
 def analysis(argv):
+    global CACHE
     ctx = TritonContext(ARCH.X86_64)
     setMode(ctx)
-    ret_expr = one_path(ctx, argv.trace, argv.symsize)
+    CACHE = SolverCache(argv.solver_cache)
+    ret_expr = one_path(ctx, argv.trace, argv.symsize, argv.check_writes)
+    if QUERIES.total():
+        QUERIES.summary()
+    if argv.solver_log:
+        QUERIES.write(argv.solver_log)
+    CACHE.save()
     return 0
 
 
@@ -147,6 +192,9 @@ def main():
     parser = argparse.ArgumentParser(formatter_class=argparse.RawDescriptionHelpFormatter)
     parser.add_argument("--trace",   type=str, metavar="<trace>",  help="Specify the VMP trace")
     parser.add_argument("--symsize", type=int, metavar="<symsize>", help="Specify the size of symbolic variables")
+    parser.add_argument("--check-writes", type=int, default=0, metavar="<n>", help="Check one memory write out of n against the trace (traces recorded with -mw)")
+    parser.add_argument("--solver-log", type=str, metavar="<file>", help="Log every solver query and how it was answered")
+    parser.add_argument("--solver-cache", type=str, metavar="<file>", help="Load and save the solver results in this file")
     argv = parser.parse_args(sys.argv[1:])
 
     if argv.trace is None:
@@ -1,128 +1,1015 @@
 #include "pin.H"
+#include "code_table.h"
+#include "control_manager.H"
+#include "image_filter.h"
+#include "trace_sink.h"
+#include "trace_writer.h"
+#include "vmp_trace_format.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
-#include <list>
+#include <set>
+#include <sstream>
+#include <sys/wait.h>
+#include <vector>
 
+/* Size of the in-memory buffer used by the trace writer */
+#define WRITER_BUFFER_SIZE (4 << 20)
 
-std::ostream* out = &std::cerr;
-bool start = false;
+/* Number of pages of the per-thread Pin trace buffer (-buffer mode) */
+#define TRACE_BUFFER_PAGES 1024
 
-static KNOB<UINT32> KnobStart(KNOB_MODE_WRITEONCE, "pintool", "start", "0", "Start the tracing at this address");
-static KNOB<UINT32> KnobEnd(KNOB_MODE_WRITEONCE, "pintool", "end", "0", "Stop the tracing at this address");
 
+CodeTable codes;
+ImageFilter images;
 
+/* Addresses which open and close a tracing window (-start/-end pairs) */
+std::set<ADDRINT> start_addrs;
+std::set<ADDRINT> end_addrs;
 
-VOID cb_inst(CONTEXT* ctx, const unsigned char* addr, UINT32 size) {
-  std::ios_base::fmtflags f(out->flags());
-  UINT64 buffer = 0;
+/* Registers of a trace, in the order of the `r:` records */
+static const REG trace_regs[VMPT_NUM_REGS] = {
+  REG_RAX, REG_RBX, REG_RCX, REG_RDX, REG_RDI, REG_RSI, REG_RBP, REG_RSP,
+  REG_R8,  REG_R9,  REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15,
+};
 
-  std::list<LEVEL_BASE::REG> regs;
-  regs.push_back(LEVEL_BASE::REG_RAX);
-  regs.push_back(LEVEL_BASE::REG_RBX);
-  regs.push_back(LEVEL_BASE::REG_RCX);
-  regs.push_back(LEVEL_BASE::REG_RDX);
-  regs.push_back(LEVEL_BASE::REG_RDI);
-  regs.push_back(LEVEL_BASE::REG_RSI);
-  regs.push_back(LEVEL_BASE::REG_RBP);
-  regs.push_back(LEVEL_BASE::REG_RSP);
-  regs.push_back(LEVEL_BASE::REG_R8);
-  regs.push_back(LEVEL_BASE::REG_R9);
-  regs.push_back(LEVEL_BASE::REG_R10);
-  regs.push_back(LEVEL_BASE::REG_R11);
-  regs.push_back(LEVEL_BASE::REG_R12);
-  regs.push_back(LEVEL_BASE::REG_R13);
-  regs.push_back(LEVEL_BASE::REG_R14);
-  regs.push_back(LEVEL_BASE::REG_R15);
+/* One record of the Pin trace buffer (-buffer mode) */
+struct BufferRecord {
+  const CodeEntry* code;
+  UINT32           reads;  /* Number of memory reads logged for this instruction */
+  UINT32           writes; /* Number of memory writes logged after this instruction */
+  ADDRINT          wseq;   /* Number of its write in the access log */
+  ADDRINT          regs[VMPT_NUM_REGS];
+};
+
+/* Kinds of the memory access log entries */
+enum {
+  LOG_READ,
+  LOG_WRITE,
+  LOG_CLOBBER,  /* Write whose value could not be captured */
+};
+
+/* Values of the memory accesses (-buffer mode). They must be captured when
+ * the instruction executes, so they are logged by analysis routines next to
+ * the trace buffer and consumed in order when the buffer is flushed. Writes
+ * are logged after their instruction, which may fault first: they carry the
+ * number of the write, the same as in the record of their instruction. */
+class AccessLog {
+  public:
+    AccessLog() : head(0) {}
+
+    void push(UINT32 kind, ADDRINT addr, UINT32 size, ADDRINT seq = 0) {
+      UINT32 stored = (kind == LOG_CLOBBER) ? 0 : size;
+      size_t pos = this->data.size();
+      this->data.resize(pos + header + stored);
+      UINT8* entry = &this->data[pos];
+      std::memcpy(entry, &addr, sizeof(addr));
+      std::memcpy(entry + sizeof(addr), &seq, sizeof(seq));
+      std::memcpy(entry + 2 * sizeof(addr), &size, sizeof(size));
+      std::memcpy(entry + 2 * sizeof(addr) + sizeof(size), &kind, sizeof(kind));
+      std::memcpy(entry + header, reinterpret_cast<const VOID*>(addr), stored);
+    }
+
+    /* Kind and number of the next entry, false if the log is empty */
+    bool next(UINT32* kind, ADDRINT* seq) const {
+      if (this->head >= this->data.size())
+        return false;
+      std::memcpy(seq, &this->data[this->head + sizeof(ADDRINT)], sizeof(*seq));
+      std::memcpy(kind, &this->data[this->head + 2 * sizeof(ADDRINT) + sizeof(UINT32)], sizeof(*kind));
+      return true;
+    }
+
+    const UINT8* pop(ADDRINT* addr, UINT32* size, UINT32* kind) {
+      const UINT8* entry = &this->data[this->head];
+      std::memcpy(addr, entry, sizeof(*addr));
+      std::memcpy(size, entry + 2 * sizeof(*addr), sizeof(*size));
+      std::memcpy(kind, entry + 2 * sizeof(*addr) + sizeof(*size), sizeof(*kind));
+      this->head += header + ((*kind == LOG_CLOBBER) ? 0 : *size);
+      return entry + header;
+    }
+
+    /* Drops the entries already consumed */
+    void compact(void) {
+      this->data.erase(this->data.begin(), this->data.begin() + this->head);
+      this->head = 0;
+    }
+
+  private:
+    /* Address, number, size and kind, then the value */
+    static const size_t header = 2 * sizeof(ADDRINT) + 2 * sizeof(UINT32);
+
+    std::vector<UINT8> data;
+    size_t             head;
+};
+
+/* A trace file being written */
+struct TraceOutput {
+  std::ostream* out;
+  TraceSink*    sink;
+  TraceWriter*  writer;
+  std::ostream* index;      /* -index, nullptr otherwise */
+  std::string   rename;     /* Fork server children write <path>.part, renamed to <path> once closed */
+};
+
+/* Input tuple of the -inputs mode, in the order of the argument registers */
+typedef std::vector<ADDRINT> InputTuple;
+
+/* Tracing state of an application thread. Every thread writes its own
+ * stream, so threads record concurrently without sharing a lock. */
+struct ThreadState {
+  THREADID      tid;
+  UINT32        depth;    /* Number of open tracing windows, recording when not 0 */
+  TraceOutput   output;
+  AccessLog     accesses; /* -buffer mode */
+
+  ADDRINT       waddr;    /* Memory write of the current instruction, its value */
+  UINT32        wsize;    /* is read after the instruction */
+
+  /* -inputs and -forkserver modes */
+  INT32         input;    /* Input being traced, -1 before the first window */
+  bool          forked;   /* Fork server child */
+  TraceOutput   saved;    /* Output of the thread while inputs are traced */
+  CONTEXT       snapshot; /* Context at the start of the first window */
+};
+
+/* The state is reachable from analysis routines through a tool register and
+ * from callbacks through a TLS key. */
+REG state_reg;
+TLS_KEY state_key;
+
+/* -buffer mode: number of the last memory write of the thread */
+REG wseq_reg;
+
+/* Live thread states, only used to start and stop them */
+std::vector<ThreadState*> states;
+PIN_LOCK states_lock;
+
+/* -inputs mode: the function is replayed in place with every tuple by the
+ * first thread reaching a window */
+std::vector<InputTuple> inputs;
+ThreadState* inputs_owner = nullptr;
+
+/* -forkserver mode: the first thread reaching a window forks a child per
+ * input read from the server file, each child traces the window and exits */
+std::ifstream* server = nullptr;
+AFUNPTR fork_fn = nullptr;
+std::vector<int> server_children;
+
+/* Argument registers (System V) set from an input tuple */
+static const REG input_regs[] = { REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9 };
+
+BUFFER_ID trace_buffer;
+
+/* Windows defined by the InstLib controller (-control) when no -start/-end
+ * pair is given. Nothing is instrumented before its first start event. */
+CONTROLLER::CONTROL_MANAGER control;
+volatile bool control_started = false;
+
+/* -format */
+TraceFormat trace_format;
+
+static KNOB<ADDRINT> KnobStart(KNOB_MODE_APPEND, "pintool", "start", "0", "Start the tracing at this address (may be repeated)");
+static KNOB<ADDRINT> KnobEnd(KNOB_MODE_APPEND, "pintool", "end", "0", "Stop the tracing at this address (may be repeated)");
+static KNOB<std::string> KnobImage(KNOB_MODE_APPEND, "pintool", "image", "", "Trace this image (path or file name, may be repeated). Default: the main executable");
+static KNOB<std::string> KnobInputs(KNOB_MODE_WRITEONCE, "pintool", "inputs", "", "Replay the traced function with every input tuple of this file (one trace per input)");
+static KNOB<std::string> KnobForkServer(KNOB_MODE_WRITEONCE, "pintool", "forkserver", "", "Fork a child tracing the function for every input tuple read from this file or FIFO");
+static KNOB<UINT32> KnobJobs(KNOB_MODE_WRITEONCE, "pintool", "jobs", "1", "Maximum number of fork server children running at once");
+static KNOB<std::string> KnobOutput(KNOB_MODE_WRITEONCE, "pintool", "o", "", "Write the trace to this file instead of stderr (other threads: <file>.<tid>)");
+static KNOB<std::string> KnobFormat(KNOB_MODE_WRITEONCE, "pintool", "format", "text", "Trace format: text, binary or columnar");
+static KNOB<BOOL> KnobBuffer(KNOB_MODE_WRITEONCE, "pintool", "buffer", "0", "Record through the Pin trace buffer API");
+static KNOB<BOOL> KnobDedup(KNOB_MODE_WRITEONCE, "pintool", "dedup", "0", "Only record the memory reads whose value is not known by the replayer (the replayer must model every write like Pin)");
+static KNOB<BOOL> KnobWrites(KNOB_MODE_WRITEONCE, "pintool", "mw", "0", "Record the memory writes (mw records)");
+static KNOB<BOOL> KnobUses(KNOB_MODE_WRITEONCE, "pintool", "uses", "0", "Record the registers read and written by every instruction (u records)");
+static KNOB<UINT32> KnobIndex(KNOB_MODE_WRITEONCE, "pintool", "index", "0", "Write <trace>.idx with a checkpoint every n instructions (0: no index)");
+static KNOB<BOOL> KnobCompress(KNOB_MODE_WRITEONCE, "pintool", "compress", "0", "Compress the trace (LZ4 frame)");
+static KNOB<BOOL> KnobAsync(KNOB_MODE_WRITEONCE, "pintool", "async", "0", "Write the trace from a Pin internal thread");
+
+
+
+/* Runtime gating. These are inlined by Pin, so code outside of the windows
+ * only pays a compare and a branch per instruction. */
+ADDRINT cb_recording(ThreadState* state) {
+  return state->depth != 0;
+}
+
+
+VOID cb_enter(ThreadState* state) {
+  state->depth++;
+}
+
+
+VOID cb_leave(ThreadState* state) {
+  if (state->depth)
+    state->depth--;
+}
+
+
+VOID cb_inst(ThreadState* state, const CodeEntry* code,
+             ADDRINT rax, ADDRINT rbx, ADDRINT rcx, ADDRINT rdx,
+             ADDRINT rdi, ADDRINT rsi, ADDRINT rbp, ADDRINT rsp,
+             ADDRINT r8,  ADDRINT r9,  ADDRINT r10, ADDRINT r11,
+             ADDRINT r12, ADDRINT r13, ADDRINT r14, ADDRINT r15) {
+  UINT64 regs[VMPT_NUM_REGS] = {
+    rax, rbx, rcx, rdx, rdi, rsi, rbp, rsp,
+    r8,  r9,  r10, r11, r12, r13, r14, r15,
+  };
 
   // Registers
-  *out << "r";
-  for (const auto& reg : regs) {
-    PIN_GetContextRegval(ctx, reg, reinterpret_cast<unsigned char*>(&buffer));
-    *out << ":" << std::hex << "0x" << buffer << std::dec;
-  }
-  *out << std::endl;
+  state->output.writer->regs(regs);
 
   // Instruction
-  *out << "i:" << std::hex << "0x" << reinterpret_cast<unsigned long>(addr) << std::dec << ":" << size << ":";
-  for (size_t i = 0; i < size; ++i)
-    *out << std::uppercase << std::hex << std::setfill('0') << std::setw(2) << (((int)addr[i]) & 0xFF);
-  *out << std::endl;
+  state->output.writer->inst(code);
+}
+
+
+typedef void (TraceWriter::*AccessRecord)(ADDRINT, UINT32, UINT64);
+
+VOID emit_access(TraceWriter* writer, AccessRecord record, ADDRINT addr, UINT32 size, const UINT8* data) {
+  // Accesses wider than 8 bytes (SSE, x87) are split into 8, 4, 2 and 1 byte records
+  while (size) {
+    UINT32 chunk = (size >= 8) ? 8 : (size >= 4) ? 4 : (size >= 2) ? 2 : 1;
+    UINT64 value = 0;
+    std::memcpy(&value, data, chunk);
+    (writer->*record)(addr, chunk, value);
+    addr += chunk;
+    data += chunk;
+    size -= chunk;
+  }
+}
+
+
+VOID cb_memread(ThreadState* state, UINT64 addr, UINT32 size) {
+  emit_access(state->output.writer, &TraceWriter::memread, addr, size, reinterpret_cast<const UINT8*>(addr));
+}
+
+
+VOID cb_writeaddr(ThreadState* state, ADDRINT addr, UINT32 size) {
+  state->waddr = addr;
+  state->wsize = size;
+}
+
+
+VOID cb_memwrite(ThreadState* state) {
+  emit_access(state->output.writer, &TraceWriter::memwrite, state->waddr, state->wsize, reinterpret_cast<const UINT8*>(state->waddr));
+}
+
+
+VOID cb_clobber(ThreadState* state, ADDRINT addr, UINT32 size) {
+  state->output.writer->invalidate(addr, size);
+}
+
+
+VOID cb_logread(ThreadState* state, ADDRINT addr, UINT32 size) {
+  state->accesses.push(LOG_READ, addr, size);
+}
+
+
+/* The writes are numbered in wseq_reg, their records get the number */
+ADDRINT cb_logwriteaddr(ThreadState* state, ADDRINT addr, UINT32 size, ADDRINT seq) {
+  cb_writeaddr(state, addr, size);
+  return seq + 1;
+}
+
+
+VOID cb_logwrite(ThreadState* state, ADDRINT seq) {
+  state->accesses.push(LOG_WRITE, state->waddr, state->wsize, seq);
+}
+
+
+ADDRINT cb_logclobber(ThreadState* state, ADDRINT addr, UINT32 size, ADDRINT seq) {
+  state->accesses.push(LOG_CLOBBER, addr, size, seq + 1);
+  return seq + 1;
+}
+
+
+VOID* cb_buffer_full(BUFFER_ID id, THREADID tid, const CONTEXT* ctx, VOID* buf, UINT64 count, VOID* v) {
+  const BufferRecord* records = static_cast<const BufferRecord*>(buf);
+  ThreadState* state = static_cast<ThreadState*>(PIN_GetThreadData(state_key, tid));
+
+  if (state) {
+    TraceWriter* writer = state->output.writer;
+    ADDRINT addr;
+    ADDRINT seq;
+    UINT32 size, kind;
+
+    for (UINT64 i = 0; i < count; ++i) {
+      /* Writes numbered up to the record are left over: the window opened
+       * during their instruction. The next ones are of later records. */
+      while (state->accesses.next(&kind, &seq) && kind != LOG_READ &&
+             (seq < records[i].wseq || (seq == records[i].wseq && !records[i].writes)))
+        state->accesses.pop(&addr, &size, &kind);
+
+      for (UINT32 r = 0; r < records[i].reads; ++r) {
+        const UINT8* data = state->accesses.pop(&addr, &size, &kind);
+        emit_access(writer, &TraceWriter::memread, addr, size, data);
+      }
+
+      writer->regs(records[i].regs);
+      writer->inst(records[i].code);
+
+      /* The write is missing if the instruction faulted */
+      if (records[i].writes && state->accesses.next(&kind, &seq) && kind != LOG_READ && seq == records[i].wseq) {
+        const UINT8* data = state->accesses.pop(&addr, &size, &kind);
+        if (kind == LOG_CLOBBER)
+          writer->invalidate(addr, size);
+        else
+          emit_access(writer, &TraceWriter::memwrite, addr, size, data);
+      }
+    }
+
+    state->accesses.compact();
+  }
+
+  return buf;
+}
+
+
+/* The main thread writes to -o (or stderr), the other ones to <o>.<tid>. In
+ * -inputs mode, the trace of the input N goes to <o>.input<N>. */
+/* Path of the trace of a thread and input, empty for stderr */
+std::string stream_path(THREADID tid, INT32 input) {
+  if (tid == 0 && input < 0 && KnobOutput.Value().empty())
+    return "";
+
+  std::ostringstream path;
+  path << (KnobOutput.Value().empty() ? "vmp.trace" : KnobOutput.Value());
+  if (tid != 0)
+    path << "." << tid;
+  if (input >= 0)
+    path << ".input" << input;
+
+  return path.str();
+}
+
+
+VOID open_output(TraceOutput* output, THREADID tid, INT32 input, bool partial = false) {
+  std::string path = stream_path(tid, input);
+  std::string file = partial ? path + ".part" : path;
+
+  output->rename = partial ? path : "";
+  output->out    = path.empty() ? &std::cerr : new std::ofstream(file.c_str(), std::ios::out | std::ios::binary);
+  output->sink   = new TraceSink(output->out, WRITER_BUFFER_SIZE, KnobCompress);
+  output->writer = new TraceWriter(output->sink, trace_format, WRITER_BUFFER_SIZE, KnobDedup, KnobWrites, KnobUses);
+  output->index  = nullptr;
+
+  /* stderr can not be seeked, it never gets an index */
+  if (KnobIndex && !path.empty()) {
+    output->index = new std::ofstream((path + ".idx").c_str(), std::ios::out | std::ios::binary);
+    output->writer->setIndex(output->index, KnobIndex);
+  }
+
+  if (KnobAsync && !output->sink->startThread())
+    std::cerr << "Warning: could not start the writer thread of thread " << tid << std::endl;
+}
+
+
+VOID close_output(TraceOutput* output) {
+  delete output->writer;
+  output->sink->stopThread();
+  if (output->index) {
+    output->sink->writeBlocks(output->index);
+    delete output->index;
+  }
+  delete output->sink;
+  if (output->out != &std::cerr)
+    delete output->out;
+  if (!output->rename.empty())
+    rename((output->rename + ".part").c_str(), output->rename.c_str());
+  output->out = nullptr;
+  output->sink = nullptr;
+  output->writer = nullptr;
+  output->index = nullptr;
+}
+
+
+VOID close_thread(ThreadState* state) {
+  close_output(&state->output);
+  if (state->saved.writer)
+    close_output(&state->saved);
+  delete state;
+}
+
+
+VOID ThreadStart(THREADID tid, CONTEXT* ctx, INT32 flags, VOID* v) {
+  ThreadState* state = new ThreadState;
+
+  state->tid          = tid;
+  state->depth        = 0;
+  state->input        = -1;
+  state->forked       = false;
+  state->saved.writer = nullptr;
+  open_output(&state->output, tid, -1);
+
+  PIN_GetLock(&states_lock, tid + 1);
+  states.push_back(state);
+  PIN_ReleaseLock(&states_lock);
+
+  PIN_SetThreadData(state_key, state, tid);
+  PIN_SetContextReg(ctx, state_reg, reinterpret_cast<ADDRINT>(state));
+  if (KnobBuffer)
+    PIN_SetContextReg(ctx, wseq_reg, 0);
+}
+
+
+VOID ThreadFini(THREADID tid, const CONTEXT* ctx, INT32 code, VOID* v) {
+  ThreadState* state = static_cast<ThreadState*>(PIN_GetThreadData(state_key, tid));
+
+  if (!state)
+    return;
+
+  PIN_GetLock(&states_lock, tid + 1);
+  states.erase(std::find(states.begin(), states.end(), state));
+  PIN_ReleaseLock(&states_lock);
+
+  PIN_SetThreadData(state_key, nullptr, tid);
+  close_thread(state);
+}
+
+
+/* Traces the function with the current input tuple, or resumes the original
+ * call once every input has been traced. Does not return. */
+VOID run_input(ThreadState* state) {
+  CONTEXT ctx;
+
+  PIN_SaveContext(&state->snapshot, &ctx);
+
+  if (static_cast<size_t>(state->input) < inputs.size()) {
+    const InputTuple& tuple = inputs[state->input];
+    open_output(&state->output, state->tid, state->input);
+    for (size_t i = 0; i < tuple.size(); ++i)
+      PIN_SetContextReg(&ctx, input_regs[i], tuple[i]);
+  }
+  else {
+    state->output = state->saved;
+    state->saved.writer = nullptr;
+  }
+
+  PIN_ExecuteAt(&ctx);
+}
+
+
+/* -inputs mode. The first window reached is executed again from its start
+ * with the argument registers of every input tuple, then the original call
+ * runs (and is traced) as usual. Only the registers are restored between two
+ * runs, so the function must be pure. */
+VOID cb_inputs_start(ThreadState* state, CONTEXT* ctx) {
+  if (inputs_owner || state->depth)
+    return;
+
+  PIN_GetLock(&states_lock, state->tid + 1);
+  bool owner = (inputs_owner == nullptr);
+  if (owner)
+    inputs_owner = state;
+  PIN_ReleaseLock(&states_lock);
+
+  if (!owner)
+    return;
+
+  PIN_SaveContext(ctx, &state->snapshot);
+  state->saved = state->output;
+  state->input = 0;
+  run_input(state);
+}
+
+
+VOID cb_inputs_end(ThreadState* state, CONTEXT* ctx) {
+  if (state != inputs_owner || state->depth || !state->saved.writer)
+    return;
+
+  close_output(&state->output);
+  state->input++;
+  run_input(state);
+}
+
+
+/* An input tuple is a line of up to 6 integers (decimal or 0x hexadecimal)
+ * separated by spaces. Empty lines and # comments give an empty tuple. */
+bool parse_tuple(const std::string& line, InputTuple* tuple) {
+  std::istringstream fields(line.substr(0, line.find('#')));
+  std::string field;
+
+  while (fields >> field) {
+    if (tuple->size() == sizeof(input_regs) / sizeof(input_regs[0]))
+      return false;
+    tuple->push_back(static_cast<ADDRINT>(strtoull(field.c_str(), nullptr, 0)));
+  }
+
+  return true;
+}
+
+
+bool load_inputs(const std::string& path) {
+  std::ifstream file(path.c_str());
+  std::string line;
+
+  if (!file)
+    return false;
+
+  while (std::getline(file, line)) {
+    InputTuple tuple;
+    if (!parse_tuple(line, &tuple))
+      return false;
+    if (!tuple.empty())
+      inputs.push_back(tuple);
+  }
+
+  return !inputs.empty();
+}
+
+
+/* Fork server child: the buffers and writer threads inherited from the parent
+ * belong to the parent's files, they are dropped without being flushed. The
+ * trace only appears under its name once complete, so that a client feeding
+ * the server can wait for it. */
+VOID forkserver_child(ThreadState* state, const CONTEXT* snapshot, const InputTuple& tuple) {
+  CONTEXT ctx;
+
+  states.clear();
+  states.push_back(state);
+
+  state->forked = true;
+  open_output(&state->output, state->tid, state->input, true);
+
+  PIN_SaveContext(snapshot, &ctx);
+  for (size_t i = 0; i < tuple.size(); ++i)
+    PIN_SetContextReg(&ctx, input_regs[i], tuple[i]);
+
+  PIN_ExecuteAt(&ctx);
+}
+
+
+/* Whether a child of the server is gone, waiting for it if `block`. ECHILD:
+ * the application reaped it itself. */
+static bool child_done(int pid, bool block) {
+  for (;;) {
+    int r = waitpid(pid, nullptr, block ? 0 : WNOHANG);
+    if (r == pid)
+      return true;
+    if (r == 0)
+      return false;
+    if (errno != EINTR)
+      return true;
+  }
+}
+
+
+/* The children of the server are polled by pid: waitpid(-1) would also reap
+ * the children of the application */
+static VOID wait_server_child() {
+  for (;;) {
+    for (std::vector<int>::iterator it = server_children.begin(); it != server_children.end(); ++it) {
+      if (child_done(*it, false)) {
+        server_children.erase(it);
+        return;
+      }
+    }
+    PIN_Sleep(10);
+  }
+}
+
+
+/* -forkserver mode. The parent reads the inputs at the start of the first
+ * window and forks (through the libc of the application, so that Pin follows
+ * the child) a child per input. At the end of the inputs, the original call
+ * resumes in the parent. */
+VOID cb_forkserver_start(ThreadState* state, CONTEXT* ctx) {
+  if (inputs_owner || state->depth)
+    return;
+
+  PIN_GetLock(&states_lock, state->tid + 1);
+  bool owner = (inputs_owner == nullptr);
+  if (owner)
+    inputs_owner = state;
+  PIN_ReleaseLock(&states_lock);
+
+  if (!owner)
+    return;
+
+  if (!fork_fn) {
+    std::cerr << "Error: fork() not found in the application, tracing the window once" << std::endl;
+    return;
+  }
+
+  std::string line;
+  for (state->input = 0; std::getline(*server, line); ) {
+    InputTuple tuple;
+    if (!parse_tuple(line, &tuple)) {
+      std::cerr << "Warning: invalid input tuple: " << line << std::endl;
+      continue;
+    }
+    if (tuple.empty())
+      continue;
+
+    if (server_children.size() >= KnobJobs.Value())
+      wait_server_child();
+
+    int pid = -1;
+    PIN_CallApplicationFunction(ctx, state->tid, CALLINGSTD_DEFAULT, fork_fn, nullptr, PIN_PARG(int), &pid, PIN_PARG_END());
+
+    if (pid == 0)
+      forkserver_child(state, ctx, tuple);
+    if (pid < 0)
+      std::cerr << "Warning: fork failed for the input " << state->input << std::endl;
+    else
+      server_children.push_back(pid);
+
+    state->input++;
+  }
+
+  for (size_t i = 0; i < server_children.size(); ++i)
+    child_done(server_children[i], true);
+  server_children.clear();
+}
+
+
+VOID cb_forkserver_end(ThreadState* state) {
+  if (state->forked && !state->depth)
+    PIN_ExitProcess(0);
+}
+
+
+VOID ControlHandler(CONTROLLER::EVENT_TYPE ev, VOID* v, CONTEXT* ctx, VOID* ip, THREADID tid, BOOL bcast) {
+  if (ev != CONTROLLER::EVENT_START && ev != CONTROLLER::EVENT_STOP)
+    return;
+
+  UINT32 depth = (ev == CONTROLLER::EVENT_START) ? 1 : 0;
+
+  /* First start: the code is instrumented again and the current instruction
+   * executed again, so that it is recorded */
+  if (depth && !control_started) {
+    PIN_GetLock(&states_lock, tid + 1);
+    bool first = !control_started;
+    control_started = true;
+    PIN_ReleaseLock(&states_lock);
+
+    if (first) {
+      ControlHandler(ev, v, ctx, ip, tid, bcast);
+      PIN_RemoveInstrumentation();
+      if (ctx)
+        PIN_ExecuteAt(ctx);
+      return;
+    }
+  }
+
+  if (bcast) {
+    PIN_GetLock(&states_lock, tid + 1);
+    for (size_t i = 0; i < states.size(); ++i)
+      states[i]->depth = depth;
+    PIN_ReleaseLock(&states_lock);
+    return;
+  }
+
+  ThreadState* state = static_cast<ThreadState*>(PIN_GetThreadData(state_key, tid));
+  if (state)
+    state->depth = depth;
+}
+
+
+/* Inserts the predicate of the next INS_InsertThen* call */
+VOID InsertIfRecording(INS ins, IPOINT point = IPOINT_BEFORE) {
+  INS_InsertIfCall(ins, point, (AFUNPTR)cb_recording, IARG_REG_VALUE, state_reg, IARG_END);
+}
+
+
+/* Memory writes are recorded (-mw) and keep the shadow memory of the writer
+ * in sync. Their value is read after the instruction (after every iteration
+ * for REP instructions), but their address is only known before it. When
+ * there is no point after the instruction, the written bytes are clobbered
+ * instead. Numbered writes (-buffer) also count the writes of the thread in
+ * wseq_reg and get the count. Returns the number of entries logged by the
+ * instruction. */
+UINT32 InstrumentWrite(INS ins, AFUNPTR after, AFUNPTR clobber, bool numbered = false) {
+  if ((!KnobDedup && !KnobWrites) || !INS_IsMemoryWrite(ins))
+    return 0;
+
+  bool fallthrough = INS_IsValidForIpointAfter(ins);
+  bool taken = INS_IsValidForIpointTakenBranch(ins);
+
+  if (!fallthrough && !taken) {
+    InsertIfRecording(ins);
+    if (numbered)
+      INS_InsertThenCall(ins, IPOINT_BEFORE, clobber, IARG_REG_VALUE, state_reg, IARG_MEMORYWRITE_EA, IARG_MEMORYWRITE_SIZE,
+                         IARG_REG_VALUE, wseq_reg, IARG_RETURN_REGS, wseq_reg, IARG_END);
+    else
+      INS_InsertThenCall(ins, IPOINT_BEFORE, clobber, IARG_REG_VALUE, state_reg, IARG_MEMORYWRITE_EA, IARG_MEMORYWRITE_SIZE, IARG_END);
+    return 1;
+  }
+
+  InsertIfRecording(ins);
+  if (numbered)
+    INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)cb_logwriteaddr, IARG_REG_VALUE, state_reg, IARG_MEMORYWRITE_EA, IARG_MEMORYWRITE_SIZE,
+                       IARG_REG_VALUE, wseq_reg, IARG_RETURN_REGS, wseq_reg, IARG_END);
+  else
+    INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)cb_writeaddr, IARG_REG_VALUE, state_reg, IARG_MEMORYWRITE_EA, IARG_MEMORYWRITE_SIZE, IARG_END);
+
+  /* The write of the instruction is the last one numbered */
+  if (fallthrough) {
+    InsertIfRecording(ins, IPOINT_AFTER);
+    if (numbered)
+      INS_InsertThenCall(ins, IPOINT_AFTER, after, IARG_REG_VALUE, state_reg, IARG_REG_VALUE, wseq_reg, IARG_END);
+    else
+      INS_InsertThenCall(ins, IPOINT_AFTER, after, IARG_REG_VALUE, state_reg, IARG_END);
+  }
+
+  if (taken) {
+    InsertIfRecording(ins, IPOINT_TAKEN_BRANCH);
+    if (numbered)
+      INS_InsertThenCall(ins, IPOINT_TAKEN_BRANCH, after, IARG_REG_VALUE, state_reg, IARG_REG_VALUE, wseq_reg, IARG_END);
+    else
+      INS_InsertThenCall(ins, IPOINT_TAKEN_BRANCH, after, IARG_REG_VALUE, state_reg, IARG_END);
+  }
+
+  return 1;
+}
+
+
+/* Records the instruction through the Pin trace buffer. Only the memory
+ * values need analysis routines, everything else is filled inline by Pin. */
+VOID InstrumentBuffered(INS ins) {
+  UINT32 reads = 0;
+
+  if (INS_IsMemoryRead(ins)) {
+    InsertIfRecording(ins);
+    INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)cb_logread, IARG_REG_VALUE, state_reg, IARG_MEMORYREAD_EA, IARG_MEMORYREAD_SIZE, IARG_END);
+    reads++;
+  }
 
-  out->flags(f);
+  if (INS_HasMemoryRead2(ins)) {
+    InsertIfRecording(ins);
+    INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)cb_logread, IARG_REG_VALUE, state_reg, IARG_MEMORYREAD2_EA, IARG_MEMORYREAD_SIZE, IARG_END);
+    reads++;
+  }
+
+  UINT32 writes = InstrumentWrite(ins, (AFUNPTR)cb_logwrite, (AFUNPTR)cb_logclobber, true);
+
+  InsertIfRecording(ins);
+  INS_InsertFillBufferThen(ins, IPOINT_BEFORE, trace_buffer,
+    IARG_PTR,       codes.lookup(ins), offsetof(BufferRecord, code),
+    IARG_UINT32,    reads,             offsetof(BufferRecord, reads),
+    IARG_UINT32,    writes,            offsetof(BufferRecord, writes),
+    IARG_REG_VALUE, wseq_reg,          offsetof(BufferRecord, wseq),
+    IARG_REG_VALUE, REG_RAX,           offsetof(BufferRecord, regs[0]),
+    IARG_REG_VALUE, REG_RBX,           offsetof(BufferRecord, regs[1]),
+    IARG_REG_VALUE, REG_RCX,           offsetof(BufferRecord, regs[2]),
+    IARG_REG_VALUE, REG_RDX,           offsetof(BufferRecord, regs[3]),
+    IARG_REG_VALUE, REG_RDI,           offsetof(BufferRecord, regs[4]),
+    IARG_REG_VALUE, REG_RSI,           offsetof(BufferRecord, regs[5]),
+    IARG_REG_VALUE, REG_RBP,           offsetof(BufferRecord, regs[6]),
+    IARG_REG_VALUE, REG_RSP,           offsetof(BufferRecord, regs[7]),
+    IARG_REG_VALUE, REG_R8,            offsetof(BufferRecord, regs[8]),
+    IARG_REG_VALUE, REG_R9,            offsetof(BufferRecord, regs[9]),
+    IARG_REG_VALUE, REG_R10,           offsetof(BufferRecord, regs[10]),
+    IARG_REG_VALUE, REG_R11,           offsetof(BufferRecord, regs[11]),
+    IARG_REG_VALUE, REG_R12,           offsetof(BufferRecord, regs[12]),
+    IARG_REG_VALUE, REG_R13,           offsetof(BufferRecord, regs[13]),
+    IARG_REG_VALUE, REG_R14,           offsetof(BufferRecord, regs[14]),
+    IARG_REG_VALUE, REG_R15,           offsetof(BufferRecord, regs[15]),
+    IARG_END);
 }
 
 
-VOID cb_memread(UINT64 addr, UINT32 size) {
-  std::ios_base::fmtflags f(out->flags());
-  *out << "mr:" << std::hex << "0x" << addr << std::dec << ":" << size << ":";
-  switch (size) {
-    case 1: *out << std::hex << "0x" << static_cast<const int>(*reinterpret_cast<const unsigned char*>(addr)) << std::dec; break;
-    case 2: *out << std::hex << "0x" << *reinterpret_cast<const short*>(addr) << std::dec; break;
-    case 4: *out << std::hex << "0x" << *reinterpret_cast<const UINT32*>(addr) << std::dec; break;
-    case 8: *out << std::hex << "0x" << *reinterpret_cast<const UINT64*>(addr) << std::dec; break;
+VOID ImageLoad(IMG img, VOID* v) {
+  images.load(img);
+
+  if (server && !fork_fn) {
+    RTN rtn = RTN_FindByName(img, "fork");
+    if (RTN_Valid(rtn))
+      fork_fn = reinterpret_cast<AFUNPTR>(RTN_Address(rtn));
   }
-  *out << std::endl;
-  out->flags(f);
+}
+
+
+VOID ImageUnload(IMG img, VOID* v) {
+  images.unload(img);
 }
 
 
 VOID Trace(TRACE trace, VOID* v) {
+  /* Skip the images which are not traced, a trace never spans two images */
+  if (!images.contains(TRACE_Address(trace))) {
+    return;
+  }
+
+  /* -control: before the first start event, nothing is recorded */
+  if (start_addrs.empty() && !control_started) {
+    return;
+  }
+
   for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
     for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
-      /* Skip libs */
-      if (INS_Address(ins) >= 0x7f0000000000) {
-        continue;
+      /* Windows are opened and closed at runtime, so that the code is traced
+       * on every call, whatever the JIT cached. The start instruction is
+       * recorded, the end one is not. */
+      if (start_addrs.count(INS_Address(ins))) {
+        if (!inputs.empty())
+          INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)cb_inputs_start, IARG_REG_VALUE, state_reg, IARG_CONTEXT, IARG_END);
+        if (server)
+          INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)cb_forkserver_start, IARG_REG_VALUE, state_reg, IARG_CONTEXT, IARG_END);
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)cb_enter, IARG_REG_VALUE, state_reg, IARG_END);
       }
 
-      /* Start of instrumentation */
-      if (INS_Address(ins) == KnobStart) {
-        start = true;
+      if (end_addrs.count(INS_Address(ins))) {
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)cb_leave, IARG_REG_VALUE, state_reg, IARG_END);
+        if (!inputs.empty())
+          INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)cb_inputs_end, IARG_REG_VALUE, state_reg, IARG_CONTEXT, IARG_END);
+        if (server)
+          INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)cb_forkserver_end, IARG_REG_VALUE, state_reg, IARG_END);
       }
 
-      /* End of instrumentation */
-      if (INS_Address(ins) == KnobEnd) {
-        start = false;
-        return;
+      if (KnobBuffer) {
+        InstrumentBuffered(ins);
+        continue;
       }
 
-      if (start && INS_IsMemoryRead(ins)) {
-        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)cb_memread,
+      if (INS_IsMemoryRead(ins)) {
+        InsertIfRecording(ins);
+        INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)cb_memread,
+          IARG_REG_VALUE, state_reg,
           IARG_MEMORYREAD_EA,
           IARG_MEMORYREAD_SIZE,
           IARG_END);
       }
 
-      if (start && INS_HasMemoryRead2(ins)) {
-        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)cb_memread,
+      if (INS_HasMemoryRead2(ins)) {
+        InsertIfRecording(ins);
+        INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)cb_memread,
+          IARG_REG_VALUE, state_reg,
           IARG_MEMORYREAD2_EA,
           IARG_MEMORYREAD_SIZE,
           IARG_END);
       }
 
-      if (start) {
-        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)cb_inst, IARG_CONTEXT, IARG_INST_PTR, IARG_UINT32, INS_Size(ins), IARG_END);
-      }
+      /* Registers are passed by value, this is much cheaper than IARG_CONTEXT */
+      IARGLIST args = IARGLIST_Alloc();
+      IARGLIST_AddArguments(args, IARG_REG_VALUE, state_reg, IARG_PTR, codes.lookup(ins), IARG_END);
+      for (size_t i = 0; i < VMPT_NUM_REGS; ++i)
+        IARGLIST_AddArguments(args, IARG_REG_VALUE, trace_regs[i], IARG_END);
+      InsertIfRecording(ins);
+      INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)cb_inst, IARG_IARGLIST, args, IARG_END);
+      IARGLIST_Free(args);
+
+      InstrumentWrite(ins, (AFUNPTR)cb_memwrite, (AFUNPTR)cb_clobber);
     }
   }
 }
 
 
+VOID PrepareForFini(VOID* v) {
+  PIN_GetLock(&states_lock, 0);
+  for (size_t i = 0; i < states.size(); ++i) {
+    states[i]->output.sink->stopThread();
+    if (states[i]->saved.writer)
+      states[i]->saved.sink->stopThread();
+  }
+  PIN_ReleaseLock(&states_lock);
+}
+
+
+/* Threads still alive at exit do not always get a ThreadFini callback */
+VOID Fini(INT32 code, VOID* v) {
+  PIN_GetLock(&states_lock, 0);
+  for (size_t i = 0; i < states.size(); ++i) {
+    PIN_SetThreadData(state_key, nullptr, states[i]->tid);
+    close_thread(states[i]);
+  }
+  states.clear();
+  PIN_ReleaseLock(&states_lock);
+}
+
+
 int usage(void) {
-  std::cerr << "Usage: ./pin -t VMP_Trace.so -start <start addr> -end <end addr> -- <vmp_binary> <vmp_binary_arg>" << std::endl;
+  std::cerr << "Usage: ./pin -t VMP_Trace.so -start <start addr> -end <end addr> [-start <start addr> -end <end addr> ...] [-image <name> ...] [-inputs <file> | -forkserver <file> [-jobs <n>]] [-o <trace file>] [-format text|binary|columnar] [-buffer] [-dedup 0|1] [-mw] [-uses] [-index <n>] [-compress] [-async] -- <vmp_binary> <vmp_binary_arg>" << std::endl;
+  std::cerr << "       ./pin -t VMP_Trace.so -control start:address:<symbol|image+offset|addr>[:count<n>],stop:address:<...> [options] -- <vmp_binary> <vmp_binary_arg>" << std::endl;
   return -1;
 }
 
 
+/* The controller has a default start event (the whole program), so it is
+ * only used when -control is given */
+bool has_control(int argc, char* argv[]) {
+  for (int i = 1; i < argc && strcmp(argv[i], "--"); ++i) {
+    if (!strcmp(argv[i], "-control"))
+      return true;
+  }
+  return false;
+}
+
+
 int main(int argc, char* argv[]) {
   if (PIN_Init(argc, argv)) {
     return usage();
   }
 
-  if (!KnobStart || !KnobEnd) {
+  if (KnobStart.NumberOfValues() != KnobEnd.NumberOfValues()) {
     return usage();
   }
 
+  for (UINT32 i = 0; i < KnobStart.NumberOfValues(); ++i) {
+    if (!KnobStart.Value(i) && !KnobEnd.Value(i)) {
+      continue;
+    }
+    if (!KnobStart.Value(i) || !KnobEnd.Value(i)) {
+      return usage();
+    }
+    start_addrs.insert(KnobStart.Value(i));
+    end_addrs.insert(KnobEnd.Value(i));
+  }
+
+  /* The trace buffer can not be flushed on demand, so it can not be split per input */
+  if (!KnobInputs.Value().empty()) {
+    if (start_addrs.empty() || KnobBuffer) {
+      return usage();
+    }
+    if (!load_inputs(KnobInputs.Value())) {
+      std::cerr << "Error: could not read the inputs from " << KnobInputs.Value() << std::endl;
+      return -1;
+    }
+  }
+
+  if (!KnobForkServer.Value().empty()) {
+    if (start_addrs.empty() || KnobBuffer || !inputs.empty() || !KnobJobs) {
+      return usage();
+    }
+    /* Opening a FIFO blocks until the client opens it too */
+    server = new std::ifstream(KnobForkServer.Value().c_str());
+    if (!*server) {
+      std::cerr << "Error: could not open " << KnobForkServer.Value() << std::endl;
+      return -1;
+    }
+    PIN_InitSymbols();
+  }
+
+  /* Without -start/-end, the windows are driven by the controller */
+  if (start_addrs.empty()) {
+    if (!has_control(argc, argv)) {
+      return usage();
+    }
+    control.RegisterHandler(ControlHandler, 0, FALSE);
+    control.Activate();
+  }
+
+  if (KnobFormat.Value() == "text") {
+    trace_format = FORMAT_TEXT;
+  }
+  else if (KnobFormat.Value() == "binary") {
+    trace_format = FORMAT_BINARY;
+  }
+  else if (KnobFormat.Value() == "columnar") {
+    trace_format = FORMAT_COLUMNAR;
+  }
+  else {
+    return usage();
+  }
+
+  /* Columnar blocks are compressed already, have no flat offsets to index and
+   * no column for the register uses */
+  if (trace_format == FORMAT_COLUMNAR && (KnobCompress || KnobIndex || KnobUses)) {
+    return usage();
+  }
+
+  state_reg = PIN_ClaimToolRegister();
+  if (!REG_valid(state_reg)) {
+    std::cerr << "Error: could not claim a tool register" << std::endl;
+    return -1;
+  }
+
+  state_key = PIN_CreateThreadDataKey(0);
+  PIN_InitLock(&states_lock);
+  PIN_AddThreadStartFunction(ThreadStart, 0);
+  PIN_AddThreadFiniFunction(ThreadFini, 0);
+
+  if (KnobAsync) {
+    PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
+  }
+
+  if (KnobBuffer) {
+    wseq_reg = PIN_ClaimToolRegister();
+    if (!REG_valid(wseq_reg)) {
+      std::cerr << "Error: could not claim a tool register" << std::endl;
+      return -1;
+    }
+
+    trace_buffer = PIN_DefineTraceBuffer(sizeof(BufferRecord), TRACE_BUFFER_PAGES, cb_buffer_full, 0);
+    if (trace_buffer == BUFFER_ID_INVALID) {
+      std::cerr << "Error: could not allocate the trace buffer" << std::endl;
+      return -1;
+    }
+  }
+
+  for (UINT32 i = 0; i < KnobImage.NumberOfValues(); ++i) {
+    if (!KnobImage.Value(i).empty())
+      images.addName(KnobImage.Value(i));
+  }
+
+  IMG_AddInstrumentFunction(ImageLoad, 0);
+  IMG_AddUnloadFunction(ImageUnload, 0);
   TRACE_AddInstrumentFunction(Trace, 0);
+  PIN_AddFiniFunction(Fini, 0);
   PIN_StartProgram();
 
   return 0;
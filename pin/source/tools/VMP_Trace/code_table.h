@@ -0,0 +1,126 @@
+#ifndef CODE_TABLE_H
+#define CODE_TABLE_H
+
+#include "pin.H"
+#include "vmp_trace_format.h"
+#include <cstring>
+#include <deque>
+#include <map>
+
+
+/* An instruction as seen at instrumentation time */
+struct CodeEntry {
+  UINT32  id;
+  ADDRINT addr;
+  UINT32  size;
+  UINT8   bytes[VMPT_MAX_INST_SIZE];
+  UINT32  read;       /* VMPT_USES */
+  UINT32  written;
+};
+
+
+/* Bit of a register in VMPT_USES, 0 for the registers which are not tracked */
+static UINT32 reg_use(REG reg) {
+  switch (REG_FullRegName(reg)) {
+    case REG_RAX:    return 1 << 0;
+    case REG_RBX:    return 1 << 1;
+    case REG_RCX:    return 1 << 2;
+    case REG_RDX:    return 1 << 3;
+    case REG_RDI:    return 1 << 4;
+    case REG_RSI:    return 1 << 5;
+    case REG_RBP:    return 1 << 6;
+    case REG_RSP:    return 1 << 7;
+    case REG_R8:     return 1 << 8;
+    case REG_R9:     return 1 << 9;
+    case REG_R10:    return 1 << 10;
+    case REG_R11:    return 1 << 11;
+    case REG_R12:    return 1 << 12;
+    case REG_R13:    return 1 << 13;
+    case REG_R14:    return 1 << 14;
+    case REG_R15:    return 1 << 15;
+    case REG_RFLAGS: return VMPT_USE_FLAGS;
+    case REG_INST_PTR:
+    case REG_SEG_FS_BASE:
+    case REG_SEG_GS_BASE:
+      return 0;
+    default:
+      return REG_is_seg(reg) ? 0 : VMPT_USE_OTHER;
+  }
+}
+
+
+/* Registers read and written by an instruction. A register which is only
+ * partly written (al, a conditional move, some of the flags) keeps a part of
+ * its previous value, it is reported as read too. */
+static VOID reg_uses(INS ins, UINT32* read, UINT32* written) {
+  UINT32 partial = 0;
+
+  *read    = 0;
+  *written = 0;
+
+  for (UINT32 i = 0; i < INS_MaxNumRRegs(ins); ++i)
+    *read |= reg_use(INS_RegR(ins, i));
+
+  for (UINT32 i = 0; i < INS_MaxNumWRegs(ins); ++i) {
+    REG reg = INS_RegW(ins, i);
+    UINT32 bit = reg_use(reg);
+    if (bit & VMPT_USE_FLAGS)
+      continue;
+    /* A predicated write (cmov) may keep the whole register */
+    if (!INS_IsPredicated(ins) && (REG_is_gr64(reg) || REG_is_gr32(reg)))
+      *written |= bit;
+    else
+      partial |= bit;
+  }
+
+  /* The flags are overwritten when all the status flags are */
+  const xed_simple_flag_t* flags = xed_decoded_inst_get_rflags_info(INS_XedDec(ins));
+  if (flags) {
+    const UINT32 status = 0x8d5;  /* OF, SF, ZF, AF, PF, CF */
+    if (xed_simple_flag_get_must_write(flags) && (xed_simple_flag_get_written_flag_set(flags)->flat & status) == status)
+      *written |= VMPT_USE_FLAGS;
+    else if (xed_simple_flag_get_written_flag_set(flags)->flat)
+      partial |= VMPT_USE_FLAGS;
+  }
+
+  *read    |= partial;
+  *written |= partial;
+
+  if (INS_IsMemoryRead(ins) || INS_HasMemoryRead2(ins))
+    *read |= VMPT_USE_MEMORY;
+  if (INS_IsMemoryWrite(ins))
+    *written |= VMPT_USE_MEMORY;
+}
+
+
+/* Gives a compact ID to every unique (address, bytes) instrumented. A new
+ * ID is given if the code at an address changes (self-modifying code).
+ * Entries never move, analysis routines receive a pointer to them. */
+class CodeTable {
+  public:
+    const CodeEntry* lookup(INS ins) {
+      CodeEntry entry;
+
+      entry.addr = INS_Address(ins);
+      entry.size = INS_Size(ins);
+      std::memset(entry.bytes, 0, sizeof(entry.bytes));
+      PIN_SafeCopy(entry.bytes, reinterpret_cast<VOID*>(entry.addr), entry.size);
+
+      std::map<ADDRINT, CodeEntry*>::iterator it = this->index.find(entry.addr);
+      if (it != this->index.end() && it->second->size == entry.size && !std::memcmp(it->second->bytes, entry.bytes, entry.size))
+        return it->second;
+
+      entry.id = this->entries.size();
+      reg_uses(ins, &entry.read, &entry.written);
+      this->entries.push_back(entry);
+      this->index[entry.addr] = &this->entries.back();
+
+      return &this->entries.back();
+    }
+
+  private:
+    std::deque<CodeEntry>         entries;
+    std::map<ADDRINT, CodeEntry*> index;    /* Address -> last entry */
+};
+
+#endif /* CODE_TABLE_H */
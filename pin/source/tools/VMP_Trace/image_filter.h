@@ -0,0 +1,78 @@
+#ifndef IMAGE_FILTER_H
+#define IMAGE_FILTER_H
+
+#include "pin.H"
+#include <map>
+#include <string>
+#include <vector>
+
+
+/* Address ranges of the images to trace, maintained from the image load and
+ * unload callbacks. Unlike INSTLIB::FILTER_LIB, the selection does not rely
+ * on RTN: the sections added by VMProtect have no symbols. Code outside of
+ * every image (e.g. the vdso or JIT code) is not traced. */
+class ImageFilter {
+  public:
+    ImageFilter() : lastLow(1), lastHigh(0) {}
+
+    /* Selects an image by path or file name. Without any name, only the main
+     * executable is selected. */
+    void addName(const std::string& name) {
+      this->names.push_back(name);
+    }
+
+    void load(IMG img) {
+      if (!this->selected(img))
+        return;
+      for (UINT32 i = 0; i < IMG_NumRegions(img); ++i)
+        this->ranges[IMG_RegionLowAddress(img, i)] = IMG_RegionHighAddress(img, i);
+    }
+
+    void unload(IMG img) {
+      for (UINT32 i = 0; i < IMG_NumRegions(img); ++i)
+        this->ranges.erase(IMG_RegionLowAddress(img, i));
+      this->lastLow = 1;
+      this->lastHigh = 0;
+    }
+
+    /* Consecutive lookups almost always hit the same image, the last range
+     * found is checked first. */
+    bool contains(ADDRINT addr) {
+      if (addr >= this->lastLow && addr <= this->lastHigh)
+        return true;
+
+      std::map<ADDRINT, ADDRINT>::iterator it = this->ranges.upper_bound(addr);
+      if (it == this->ranges.begin())
+        return false;
+      --it;
+      if (addr > it->second)
+        return false;
+
+      this->lastLow = it->first;
+      this->lastHigh = it->second;
+      return true;
+    }
+
+  private:
+    std::vector<std::string>    names;
+    std::map<ADDRINT, ADDRINT>  ranges;    /* Low -> high address (inclusive) */
+    ADDRINT                     lastLow;
+    ADDRINT                     lastHigh;
+
+    bool selected(IMG img) {
+      if (this->names.empty())
+        return IMG_IsMainExecutable(img);
+
+      const std::string& path = IMG_Name(img);
+      std::string::size_type slash = path.rfind('/');
+      std::string file = (slash == std::string::npos) ? path : path.substr(slash + 1);
+
+      for (size_t i = 0; i < this->names.size(); ++i) {
+        if (this->names[i] == path || this->names[i] == file)
+          return true;
+      }
+      return false;
+    }
+};
+
+#endif /* IMAGE_FILTER_H */
@@ -0,0 +1,129 @@
+#include "lz4_frame.h"
+
+#include <string.h>
+
+#define MINMATCH      4
+#define LASTLITERALS  5   /* The last 5 bytes of a block are always literals */
+#define MFLIMIT       12  /* The last match must start 12 bytes before the end */
+#define MAX_DISTANCE  65535
+#define HASH_LOG      12
+
+
+static inline uint32_t read32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+
+static inline void write32(uint8_t* p, uint32_t v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+
+static inline uint32_t hash32(uint32_t v) {
+  return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+
+/* Writes a length continuation (the part which did not fit in the token) */
+static inline uint8_t* put_length(uint8_t* op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = static_cast<uint8_t>(len);
+  return op;
+}
+
+
+static uint8_t* put_sequence(uint8_t* op, const uint8_t* literals, size_t litlen, size_t offset, size_t matchlen) {
+  uint8_t* token = op++;
+
+  *token = static_cast<uint8_t>((litlen >= 15 ? 15 : litlen) << 4);
+  if (litlen >= 15)
+    op = put_length(op, litlen - 15);
+  memcpy(op, literals, litlen);
+  op += litlen;
+
+  /* The last sequence only has literals */
+  if (matchlen == 0)
+    return op;
+
+  *op++ = static_cast<uint8_t>(offset);
+  *op++ = static_cast<uint8_t>(offset >> 8);
+
+  matchlen -= MINMATCH;
+  *token |= static_cast<uint8_t>(matchlen >= 15 ? 15 : matchlen);
+  if (matchlen >= 15)
+    op = put_length(op, matchlen - 15);
+
+  return op;
+}
+
+
+static size_t compress(const uint8_t* src, size_t size, uint8_t* dst) {
+  uint32_t table[1 << HASH_LOG];
+  uint8_t* op = dst;
+  size_t anchor = 0;
+  size_t ip = 0;
+
+  memset(table, 0, sizeof(table));
+
+  if (size > MFLIMIT) {
+    size_t limit = size - MFLIMIT;
+    size_t matchlimit = size - LASTLITERALS;
+
+    while (ip < limit) {
+      uint32_t seq = read32(src + ip);
+      uint32_t h = hash32(seq);
+      size_t ref = table[h];
+      table[h] = static_cast<uint32_t>(ip);
+
+      if (ref >= ip || ip - ref > MAX_DISTANCE || read32(src + ref) != seq) {
+        ip++;
+        continue;
+      }
+
+      size_t len = MINMATCH;
+      while (ip + len < matchlimit && src[ref + len] == src[ip + len])
+        len++;
+
+      op = put_sequence(op, src + anchor, ip - anchor, ip - ref, len);
+      ip += len;
+      anchor = ip;
+    }
+  }
+
+  return put_sequence(op, src + anchor, size - anchor, 0, 0) - dst;
+}
+
+
+size_t lz4f_header(uint8_t* dst) {
+  write32(dst, LZ4F_MAGIC);
+  dst[4] = 0x60;  /* FLG: version 01, independent blocks, no checksums */
+  dst[5] = 0x70;  /* BD: 4 MiB blocks */
+  dst[6] = 0x73;  /* HC: (xxh32(FLG, BD) >> 8) & 0xff */
+  return LZ4F_HEADER_SIZE;
+}
+
+
+size_t lz4f_block(const uint8_t* src, size_t size, uint8_t* dst) {
+  size_t csize = compress(src, size, dst + 4);
+
+  /* Store the block uncompressed if compression does not help */
+  if (csize >= size) {
+    write32(dst, static_cast<uint32_t>(size) | 0x80000000);
+    memcpy(dst + 4, src, size);
+    return 4 + size;
+  }
+
+  write32(dst, static_cast<uint32_t>(csize));
+  return 4 + csize;
+}
+
+
+size_t lz4f_endmark(uint8_t* dst) {
+  write32(dst, 0);
+  return LZ4F_ENDMARK_SIZE;
+}
@@ -0,0 +1,33 @@
+/*
+** Minimal LZ4 frame encoder used to compress traces on the fly.
+**
+** Frames use independent blocks of at most 4 MiB, without block or content
+** checksums, so they can be read back by the `lz4` command line tool, the
+** python `lz4.frame` module or the fallback decoder of `vmp_trace.py`.
+*/
+
+#ifndef LZ4_FRAME_H
+#define LZ4_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ4F_MAGIC            0x184D2204
+#define LZ4F_MAX_BLOCK_SIZE   (4 << 20)
+#define LZ4F_HEADER_SIZE      7
+#define LZ4F_ENDMARK_SIZE     4
+
+/* Worst case size of a compressed block of `size` bytes (block size field included) */
+#define LZ4F_BLOCK_BOUND(size) (4 + (size) + ((size) / 255) + 16)
+
+/* Writes the frame header into dst and returns its size */
+size_t lz4f_header(uint8_t* dst);
+
+/* Compresses one block of at most LZ4F_MAX_BLOCK_SIZE bytes into dst (at least
+ * LZ4F_BLOCK_BOUND(size) bytes) and returns the number of bytes written. */
+size_t lz4f_block(const uint8_t* src, size_t size, uint8_t* dst);
+
+/* Writes the end mark of the frame into dst and returns its size */
+size_t lz4f_endmark(uint8_t* dst);
+
+#endif /* LZ4_FRAME_H */
@@ -0,0 +1,140 @@
+#ifndef SHADOW_MEMORY_H
+#define SHADOW_MEMORY_H
+
+#include "pin.H"
+#include "vmp_trace_format.h"
+#include <cstring>
+#include <map>
+#include <ostream>
+#include <vector>
+
+#define SHADOW_PAGE_BITS  12
+#define SHADOW_PAGE_SIZE  (1 << SHADOW_PAGE_BITS)
+#define SHADOW_PAGE_MASK  (SHADOW_PAGE_SIZE - 1)
+
+
+/* Memory as known by the replayer of a trace: the bytes reported by `mr`
+ * records and the bytes written by the traced instructions. A read whose
+ * value matches the shadow does not need to be reported again. */
+class ShadowMemory {
+  public:
+    ShadowMemory() : lastIndex(~static_cast<ADDRINT>(0)), lastPage(nullptr) {}
+
+    ~ShadowMemory() {
+      for (std::map<ADDRINT, Page*>::iterator it = this->pages.begin(); it != this->pages.end(); ++it)
+        delete it->second;
+    }
+
+    /* Returns true if every byte is known and equal to data */
+    bool same(ADDRINT addr, UINT32 size, const UINT8* data) {
+      if ((addr & SHADOW_PAGE_MASK) + size > SHADOW_PAGE_SIZE)
+        return this->same(addr, 1, data) && this->same(addr + 1, size - 1, data + 1);
+
+      Page* page = this->page(addr, false);
+      if (!page)
+        return false;
+
+      UINT32 off = addr & SHADOW_PAGE_MASK;
+      for (UINT32 i = 0; i < size; ++i) {
+        if (!page->valid(off + i))
+          return false;
+      }
+      return !std::memcmp(page->data + off, data, size);
+    }
+
+    void update(ADDRINT addr, UINT32 size, const UINT8* data) {
+      if ((addr & SHADOW_PAGE_MASK) + size > SHADOW_PAGE_SIZE) {
+        this->update(addr, 1, data);
+        this->update(addr + 1, size - 1, data + 1);
+        return;
+      }
+
+      Page* page = this->page(addr, true);
+      UINT32 off = addr & SHADOW_PAGE_MASK;
+      std::memcpy(page->data + off, data, size);
+      for (UINT32 i = 0; i < size; ++i)
+        page->setValid(off + i);
+      this->touch(page, addr);
+    }
+
+    /* Forgets bytes written with an unknown value */
+    void invalidate(ADDRINT addr, UINT32 size) {
+      for (UINT32 i = 0; i < size; ++i) {
+        Page* page = this->page(addr + i, false);
+        if (page) {
+          page->clearValid((addr + i) & SHADOW_PAGE_MASK);
+          this->touch(page, addr + i);
+        }
+      }
+    }
+
+    /* Number of pages changed since the last writeDirty() */
+    size_t numDirty(void) const {
+      return this->dirty.size();
+    }
+
+    /* Writes the pages changed since the last call as VMPT_PAGE records */
+    void writeDirty(std::ostream* out) {
+      VMPT_PAGE rec;
+      for (size_t i = 0; i < this->dirty.size(); ++i) {
+        Page* page = this->pages[this->dirty[i]];
+        rec.addr = this->dirty[i] << SHADOW_PAGE_BITS;
+        std::memcpy(rec.valid, page->bitmap, sizeof(rec.valid));
+        std::memcpy(rec.data, page->data, sizeof(rec.data));
+        out->write(reinterpret_cast<const char*>(&rec), sizeof(rec));
+        page->dirty = false;
+      }
+      this->dirty.clear();
+    }
+
+  private:
+    struct Page {
+      UINT8 data[SHADOW_PAGE_SIZE];
+      UINT8 bitmap[SHADOW_PAGE_SIZE / 8];   /* Bytes known */
+      bool  dirty;                          /* Changed since the last writeDirty() */
+
+      bool valid(UINT32 off) const { return this->bitmap[off >> 3] & (1 << (off & 7)); }
+      void setValid(UINT32 off) { this->bitmap[off >> 3] |= (1 << (off & 7)); }
+      void clearValid(UINT32 off) { this->bitmap[off >> 3] &= ~(1 << (off & 7)); }
+    };
+
+    std::map<ADDRINT, Page*> pages;
+    ADDRINT                  lastIndex;   /* Accesses are very local, the last page is cached */
+    Page*                    lastPage;
+    std::vector<ADDRINT>     dirty;       /* Indexes of the dirty pages */
+
+    void touch(Page* page, ADDRINT addr) {
+      if (!page->dirty) {
+        page->dirty = true;
+        this->dirty.push_back(addr >> SHADOW_PAGE_BITS);
+      }
+    }
+
+    Page* page(ADDRINT addr, bool create) {
+      ADDRINT index = addr >> SHADOW_PAGE_BITS;
+
+      if (index == this->lastIndex)
+        return this->lastPage;
+
+      std::map<ADDRINT, Page*>::iterator it = this->pages.find(index);
+      Page* page = nullptr;
+
+      if (it != this->pages.end())
+        page = it->second;
+      else if (create) {
+        page = new Page;
+        std::memset(page->data, 0, sizeof(page->data));
+        std::memset(page->bitmap, 0, sizeof(page->bitmap));
+        page->dirty = false;
+        this->pages[index] = page;
+      }
+      else
+        return nullptr;
+
+      this->lastIndex = index;
+      this->lastPage = page;
+      return page;
+    }
+};
+
+#endif /* SHADOW_MEMORY_H */
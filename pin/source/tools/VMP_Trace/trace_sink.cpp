@@ -0,0 +1,193 @@
+#include "trace_sink.h"
+#include "lz4_frame.h"
+#include "vmp_trace_format.h"
+
+#include <algorithm>
+
+
+TraceSink::TraceSink(std::ostream* out, size_t capacity, bool compress) {
+  this->out      = out;
+  this->capacity = capacity;
+  this->compress = compress;
+  this->closed   = false;
+  this->cbuffer  = nullptr;
+  this->logical  = 0;
+  this->physical = 0;
+  this->running  = false;
+  this->stopping = false;
+
+  PIN_MutexInit(&this->lock);
+  PIN_SemaphoreInit(&this->ready);
+  PIN_SemaphoreInit(&this->drained);
+
+  if (this->compress) {
+    UINT8 header[LZ4F_HEADER_SIZE];
+    this->cbuffer = new UINT8[LZ4F_BLOCK_BOUND(LZ4F_MAX_BLOCK_SIZE)];
+    this->physical = lz4f_header(header);
+    this->out->write(reinterpret_cast<const char*>(header), this->physical);
+  }
+}
+
+
+TraceSink::~TraceSink() {
+  this->close();
+
+  for (size_t i = 0; i < this->pool.size(); ++i)
+    delete[] this->pool[i];
+  delete[] this->cbuffer;
+
+  PIN_SemaphoreFini(&this->drained);
+  PIN_SemaphoreFini(&this->ready);
+  PIN_MutexFini(&this->lock);
+}
+
+
+bool TraceSink::startThread(void) {
+  if (PIN_SpawnInternalThread(TraceSink::threadMain, this, 0, &this->uid) == INVALID_THREADID)
+    return false;
+  this->running = true;
+  return true;
+}
+
+
+/* Called from the PREPARE_FOR_FINI_CALLBACK, or when the output is closed
+ * earlier (thread exit, end of the inputs) while other threads may still
+ * submit. The queue is drained; buffers submitted once the writer thread has
+ * left its loop are written inline. */
+void TraceSink::stopThread(void) {
+  PIN_MutexLock(&this->lock);
+
+  /* Already stopped by another thread: wait for the end of the drain */
+  while (this->running && this->stopping) {
+    PIN_SemaphoreClear(&this->drained);
+    PIN_MutexUnlock(&this->lock);
+    PIN_SemaphoreWait(&this->drained);
+    PIN_MutexLock(&this->lock);
+  }
+
+  if (!this->running) {
+    PIN_MutexUnlock(&this->lock);
+    return;
+  }
+  this->stopping = true;
+  PIN_SemaphoreSet(&this->ready);
+  PIN_MutexUnlock(&this->lock);
+
+  PIN_WaitForThreadTermination(this->uid, PIN_INFINITE_TIMEOUT, nullptr);
+}
+
+
+char* TraceSink::submit(char* buffer, size_t size) {
+  PIN_MutexLock(&this->lock);
+
+  /* Bound the memory used by the queue */
+  while (this->running && this->pending.size() >= SINK_MAX_PENDING) {
+    PIN_SemaphoreClear(&this->drained);
+    PIN_MutexUnlock(&this->lock);
+    PIN_SemaphoreWait(&this->drained);
+    PIN_MutexLock(&this->lock);
+  }
+
+  if (!this->running) {
+    PIN_MutexUnlock(&this->lock);
+    this->write(buffer, size);
+    return buffer;
+  }
+
+  Chunk chunk = { buffer, size };
+  this->pending.push_back(chunk);
+  PIN_SemaphoreSet(&this->ready);
+
+  char* next = nullptr;
+  if (!this->pool.empty()) {
+    next = this->pool.back();
+    this->pool.pop_back();
+  }
+  PIN_MutexUnlock(&this->lock);
+
+  return next ? next : new char[this->capacity];
+}
+
+
+void TraceSink::close(void) {
+  if (this->closed)
+    return;
+
+  if (this->compress) {
+    UINT8 endmark[LZ4F_ENDMARK_SIZE];
+    this->out->write(reinterpret_cast<const char*>(endmark), lz4f_endmark(endmark));
+  }
+
+  this->out->flush();
+  this->closed = true;
+}
+
+
+void TraceSink::write(const char* data, size_t size) {
+  if (!this->compress) {
+    this->out->write(data, size);
+    return;
+  }
+
+  while (size) {
+    size_t block = std::min(size, static_cast<size_t>(LZ4F_MAX_BLOCK_SIZE));
+    size_t csize = lz4f_block(reinterpret_cast<const UINT8*>(data), block, this->cbuffer);
+    this->out->write(reinterpret_cast<const char*>(this->cbuffer), csize);
+    this->blocks.push_back(std::make_pair(this->logical, this->physical));
+    this->logical += block;
+    this->physical += csize;
+    data += block;
+    size -= block;
+  }
+}
+
+
+void TraceSink::writeBlocks(std::ostream* index) {
+  UINT8 kind = VMPT_IDX_BLOCK;
+  VMPT_BLOCK rec;
+
+  for (size_t i = 0; i < this->blocks.size(); ++i) {
+    rec.offset      = this->blocks[i].first;
+    rec.file_offset = this->blocks[i].second;
+    index->write(reinterpret_cast<const char*>(&kind), sizeof(kind));
+    index->write(reinterpret_cast<const char*>(&rec), sizeof(rec));
+  }
+}
+
+
+void TraceSink::run(void) {
+  for (;;) {
+    PIN_MutexLock(&this->lock);
+    if (this->pending.empty()) {
+      /* Cleared under the lock with an empty queue: a later submit() can not
+       * queue a chunk which would never be written */
+      if (this->stopping) {
+        this->running = false;
+        PIN_SemaphoreSet(&this->drained);
+        PIN_MutexUnlock(&this->lock);
+        return;
+      }
+      PIN_SemaphoreClear(&this->ready);
+      PIN_MutexUnlock(&this->lock);
+      PIN_SemaphoreWait(&this->ready);
+      continue;
+    }
+
+    Chunk chunk = this->pending.front();
+    this->pending.pop_front();
+    PIN_MutexUnlock(&this->lock);
+
+    this->write(chunk.data, chunk.size);
+
+    PIN_MutexLock(&this->lock);
+    this->pool.push_back(chunk.data);
+    PIN_SemaphoreSet(&this->drained);
+    PIN_MutexUnlock(&this->lock);
+  }
+}
+
+
+VOID TraceSink::threadMain(VOID* arg) {
+  static_cast<TraceSink*>(arg)->run();
+  PIN_ExitThread(0);
+}
@@ -0,0 +1,65 @@
+#ifndef TRACE_SINK_H
+#define TRACE_SINK_H
+
+#include "pin.H"
+#include <deque>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+/* Maximum number of buffers queued for the writer thread */
+#define SINK_MAX_PENDING 8
+
+
+/* Receives the filled buffers of a TraceWriter and writes them to the output
+ * stream, optionally LZ4 compressed. When the writer thread is started,
+ * buffers are queued and written by a Pin internal thread so that the traced
+ * application does not stall on compression and I/O. */
+class TraceSink {
+  public:
+    TraceSink(std::ostream* out, size_t capacity, bool compress);
+    ~TraceSink();
+
+    bool startThread(void);
+    void stopThread(void);
+
+    /* Takes ownership of a filled buffer and returns an empty one of the same capacity */
+    char* submit(char* buffer, size_t size);
+
+    void close(void);
+
+    /* Writes the VMPT_IDX_BLOCK records of a compressed trace. The writer
+     * thread must be stopped. */
+    void writeBlocks(std::ostream* index);
+
+  private:
+    struct Chunk {
+      char*  data;
+      size_t size;
+    };
+
+    std::ostream*       out;
+    size_t              capacity;
+    bool                compress;
+    bool                closed;
+    UINT8*              cbuffer;    /* Compression output */
+    UINT64              logical;    /* Bytes received */
+    UINT64              physical;   /* Bytes written */
+    std::vector<std::pair<UINT64, UINT64> > blocks;  /* Logical and physical offsets of the LZ4 blocks */
+
+    bool                running;
+    bool                stopping;
+    PIN_THREAD_UID      uid;
+    PIN_MUTEX           lock;
+    PIN_SEMAPHORE       ready;      /* Set when a chunk is queued */
+    PIN_SEMAPHORE       drained;    /* Set when a chunk is written */
+    std::deque<Chunk>   pending;
+    std::vector<char*>  pool;       /* Buffers ready to be reused */
+
+    void write(const char* data, size_t size);
+    void run(void);
+
+    static VOID threadMain(VOID* arg);
+};
+
+#endif /* TRACE_SINK_H */
@@ -0,0 +1,422 @@
+#include "trace_writer.h"
+#include "lz4_frame.h"
+#include "vmp_trace_format.h"
+
+#include <algorithm>
+#include <cstring>
+
+
+static const char hex_lower[] = "0123456789abcdef";
+static const char hex_upper[] = "0123456789ABCDEF";
+
+
+TraceWriter::TraceWriter(TraceSink* sink, TraceFormat format, size_t capacity, bool dedup, bool writes, bool uses) {
+  this->sink     = sink;
+  this->binary   = (format == FORMAT_BINARY);
+  this->columnar = (format == FORMAT_COLUMNAR);
+  this->writes   = writes;
+  this->uses     = uses;
+  this->capacity = capacity;
+  this->buffer   = new char[capacity];
+  this->pos      = 0;
+
+  this->shadowValid = false;
+  std::memset(this->shadow, 0, sizeof(this->shadow));
+  this->memory      = dedup ? new ShadowMemory : nullptr;
+
+  this->index         = nullptr;
+  this->interval      = 0;
+  this->icount        = 0;
+  this->flushed       = 0;
+  this->checkpointDue = false;
+
+  for (UINT8 i = 0; i < VMPC_NUM_COLS; ++i) {
+    this->columns[i].data  = this->columnar ? new UINT8[VMPC_BLOCK_SIZE] : nullptr;
+    this->columns[i].size  = 0;
+    this->columns[i].count = 0;
+  }
+
+  if (this->binary) {
+    VMPT_HEADER header;
+    std::memcpy(header.magic, VMPT_MAGIC, sizeof(header.magic));
+    header.version = VMPT_VERSION;
+    this->put(&header, sizeof(header));
+  }
+
+  if (this->columnar) {
+    VMPT_HEADER header;
+    std::memcpy(header.magic, VMPC_MAGIC, sizeof(header.magic));
+    header.version = VMPC_VERSION;
+    this->put(&header, sizeof(header));
+  }
+}
+
+
+TraceWriter::~TraceWriter() {
+  for (UINT8 i = 0; i < VMPC_NUM_COLS; ++i) {
+    if (this->columns[i].count)
+      this->flushColumn(i);
+    delete[] this->columns[i].data;
+  }
+  this->flush();
+  delete[] this->buffer;
+  delete this->memory;
+}
+
+
+void TraceWriter::flush(void) {
+  if (this->pos) {
+    this->flushed += this->pos;
+    this->buffer = this->sink->submit(this->buffer, this->pos);
+    this->pos = 0;
+  }
+}
+
+
+void TraceWriter::setIndex(std::ostream* index, UINT32 interval) {
+  VMPT_INDEX_HEADER header;
+
+  std::memcpy(header.magic, VMPT_INDEX_MAGIC, sizeof(header.magic));
+  header.version  = VMPT_INDEX_VERSION;
+  header.interval = interval;
+  index->write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  this->index    = index;
+  this->interval = interval;
+}
+
+
+/* Records where the next instruction starts and what the replayer knows at
+ * that point: the registers and the memory */
+void TraceWriter::checkpoint(void) {
+  VMPT_CHECKPOINT rec;
+  UINT8 kind = VMPT_IDX_CHECKPOINT;
+
+  rec.icount = this->icount;
+  rec.offset = this->flushed + this->pos;
+  std::memcpy(rec.regs, this->shadow, sizeof(rec.regs));
+  rec.pages  = this->memory ? this->memory->numDirty() : 0;
+
+  this->index->write(reinterpret_cast<const char*>(&kind), sizeof(kind));
+  this->index->write(reinterpret_cast<const char*>(&rec), sizeof(rec));
+  if (this->memory)
+    this->memory->writeDirty(this->index);
+
+  this->checkpointDue = false;
+}
+
+
+/* Appends an element to a column, the block is written once full */
+void TraceWriter::putColumn(UINT8 column, const void* data, size_t size, UINT64 inst, ADDRINT addr) {
+  Column* col = &this->columns[column];
+
+  if (col->size + size > VMPC_BLOCK_SIZE)
+    this->flushColumn(column);
+
+  if (!col->count) {
+    col->first   = inst;
+    col->minAddr = addr;
+    col->maxAddr = addr;
+  }
+  col->last    = inst;
+  col->minAddr = std::min<UINT64>(col->minAddr, addr);
+  col->maxAddr = std::max<UINT64>(col->maxAddr, addr);
+
+  std::memcpy(col->data + col->size, data, size);
+  col->size += size;
+  col->count++;
+}
+
+
+void TraceWriter::flushColumn(UINT8 column) {
+  Column* col = &this->columns[column];
+  VMPC_BLOCK rec;
+
+  rec.column   = column;
+  rec.count    = col->count;
+  rec.size     = col->size;
+  rec.first    = col->first;
+  rec.last     = col->last;
+  rec.min_addr = col->minAddr;
+  rec.max_addr = col->maxAddr;
+  this->put(&rec, sizeof(rec));
+
+  /* Compressed in place in the output buffer */
+  UINT8* dst = reinterpret_cast<UINT8*>(this->reserve(LZ4F_BLOCK_BOUND(col->size)));
+  this->pos += lz4f_block(col->data, col->size, dst);
+
+  col->size  = 0;
+  col->count = 0;
+}
+
+
+void TraceWriter::put(const void* data, size_t size) {
+  std::memcpy(this->reserve(size), data, size);
+  this->pos += size;
+}
+
+
+void TraceWriter::putKind(UINT8 kind) {
+  this->put(&kind, sizeof(kind));
+}
+
+
+void TraceWriter::putChar(char c) {
+  *this->reserve(1) = c;
+  this->pos += 1;
+}
+
+
+void TraceWriter::putStr(const char* s) {
+  this->put(s, std::strlen(s));
+}
+
+
+/* Same as `std::hex << "0x" << value` */
+void TraceWriter::putHex(UINT64 value) {
+  char tmp[18];
+  char* p = tmp + sizeof(tmp);
+
+  do {
+    *--p = hex_lower[value & 0xf];
+    value >>= 4;
+  } while (value);
+  *--p = 'x';
+  *--p = '0';
+
+  this->put(p, tmp + sizeof(tmp) - p);
+}
+
+
+void TraceWriter::putDec(UINT64 value) {
+  char tmp[20];
+  char* p = tmp + sizeof(tmp);
+
+  do {
+    *--p = '0' + (value % 10);
+    value /= 10;
+  } while (value);
+
+  this->put(p, tmp + sizeof(tmp) - p);
+}
+
+
+void TraceWriter::regs(const UINT64* regs) {
+  if (this->checkpointDue)
+    this->checkpoint();
+
+  if (this->binary || this->columnar) {
+    VMPT_REGS_DELTA rec;
+    UINT64 values[VMPT_NUM_REGS];
+    size_t count = 0;
+
+    rec.mask = 0;
+    for (size_t i = 0; i < VMPT_NUM_REGS; ++i) {
+      if (!this->shadowValid || regs[i] != this->shadow[i]) {
+        rec.mask |= (1 << i);
+        values[count++] = regs[i];
+        this->shadow[i] = regs[i];
+      }
+    }
+    this->shadowValid = true;
+
+    if (this->columnar) {
+      UINT8 delta[sizeof(rec) + sizeof(values)];
+      std::memcpy(delta, &rec, sizeof(rec));
+      std::memcpy(delta + sizeof(rec), values, count * sizeof(UINT64));
+      this->putColumn(VMPC_COL_REGS, delta, sizeof(rec) + count * sizeof(UINT64), this->icount, 0);
+      return;
+    }
+
+    this->putKind(VMPT_REC_REGS_DELTA);
+    this->put(&rec, sizeof(rec));
+    this->put(values, count * sizeof(UINT64));
+    return;
+  }
+
+  this->putChar('r');
+  for (size_t i = 0; i < VMPT_NUM_REGS; ++i) {
+    this->putChar(':');
+    this->putHex(regs[i]);
+  }
+  this->putChar('\n');
+
+  /* Only needed by the checkpoints in the text format */
+  if (this->index)
+    std::memcpy(this->shadow, regs, sizeof(this->shadow));
+}
+
+
+void TraceWriter::inst(const CodeEntry* code) {
+  if (this->columnar) {
+    if (code->id >= this->emitted.size())
+      this->emitted.resize(code->id + 1024, false);
+
+    if (!this->emitted[code->id]) {
+      VMPT_CODE rec;
+      rec.id   = code->id;
+      rec.addr = code->addr;
+      rec.size = code->size;
+      std::memcpy(rec.bytes, code->bytes, sizeof(rec.bytes));
+      this->putColumn(VMPC_COL_CODE, &rec, sizeof(rec), this->icount, code->addr);
+      this->emitted[code->id] = true;
+    }
+
+    UINT32 id = code->id;
+    this->putColumn(VMPC_COL_EXEC, &id, sizeof(id), this->icount++, code->addr);
+    return;
+  }
+
+  this->icount++;
+  if (this->index && this->icount % this->interval == 0)
+    this->checkpointDue = true;
+
+  if (this->binary) {
+    if (code->id >= this->emitted.size())
+      this->emitted.resize(code->id + 1024, false);
+
+    if (!this->emitted[code->id]) {
+      VMPT_CODE rec;
+      rec.id   = code->id;
+      rec.addr = code->addr;
+      rec.size = code->size;
+      std::memcpy(rec.bytes, code->bytes, sizeof(rec.bytes));
+      this->putKind(VMPT_REC_CODE);
+      this->put(&rec, sizeof(rec));
+      this->emitted[code->id] = true;
+
+      if (this->uses) {
+        VMPT_USES uses;
+        uses.read    = code->read;
+        uses.written = code->written;
+        this->putKind(VMPT_REC_USES);
+        this->put(&uses, sizeof(uses));
+      }
+
+      /* Readers starting from a checkpoint need the code dictionary */
+      if (this->index) {
+        UINT8 kind = VMPT_IDX_CODE;
+        this->index->write(reinterpret_cast<const char*>(&kind), sizeof(kind));
+        this->index->write(reinterpret_cast<const char*>(&rec), sizeof(rec));
+      }
+    }
+
+    VMPT_EXEC rec;
+    rec.id = code->id;
+    this->putKind(VMPT_REC_EXEC);
+    this->put(&rec, sizeof(rec));
+    return;
+  }
+
+  if (this->uses) {
+    if (code->id >= this->emitted.size())
+      this->emitted.resize(code->id + 1024, false);
+
+    if (!this->emitted[code->id]) {
+      this->putStr("u:");
+      this->putHex(code->read);
+      this->putChar(':');
+      this->putHex(code->written);
+      this->putChar('\n');
+      this->emitted[code->id] = true;
+    }
+  }
+
+  this->putStr("i:");
+  this->putHex(code->addr);
+  this->putChar(':');
+  this->putDec(code->size);
+  this->putChar(':');
+  for (size_t i = 0; i < code->size; ++i) {
+    this->putChar(hex_upper[code->bytes[i] >> 4]);
+    this->putChar(hex_upper[code->bytes[i] & 0xf]);
+  }
+  this->putChar('\n');
+}
+
+
+void TraceWriter::memread(ADDRINT addr, UINT32 size, UINT64 value) {
+  const UINT8* bytes = reinterpret_cast<const UINT8*>(&value);
+
+  if (this->checkpointDue)
+    this->checkpoint();
+
+  /* The replayer already holds this value */
+  if (this->memory) {
+    if (this->memory->same(addr, size, bytes))
+      return;
+    this->memory->update(addr, size, bytes);
+  }
+
+  if (this->columnar) {
+    VMPC_ACCESS rec;
+    rec.inst  = this->icount;
+    rec.addr  = addr;
+    rec.size  = size;
+    rec.value = value;
+    this->putColumn(VMPC_COL_MEMREAD, &rec, sizeof(rec), rec.inst, addr);
+    return;
+  }
+
+  if (this->binary) {
+    VMPT_MEMREAD rec;
+    rec.addr  = addr;
+    rec.size  = size;
+    rec.value = value;
+    this->putKind(VMPT_REC_MEMREAD);
+    this->put(&rec, sizeof(rec));
+    return;
+  }
+
+  this->putStr("mr:");
+  this->putHex(addr);
+  this->putChar(':');
+  this->putDec(size);
+  this->putChar(':');
+  this->putHex(value);
+  this->putChar('\n');
+}
+
+
+void TraceWriter::memwrite(ADDRINT addr, UINT32 size, UINT64 value) {
+  if (this->memory)
+    this->memory->update(addr, size, reinterpret_cast<const UINT8*>(&value));
+
+  if (!this->writes)
+    return;
+
+  /* Written by the previous instruction */
+  if (this->columnar) {
+    VMPC_ACCESS rec;
+    rec.inst  = this->icount - 1;
+    rec.addr  = addr;
+    rec.size  = size;
+    rec.value = value;
+    this->putColumn(VMPC_COL_MEMWRITE, &rec, sizeof(rec), rec.inst, addr);
+    return;
+  }
+
+  if (this->binary) {
+    VMPT_MEMWRITE rec;
+    rec.addr  = addr;
+    rec.size  = size;
+    rec.value = value;
+    this->putKind(VMPT_REC_MEMWRITE);
+    this->put(&rec, sizeof(rec));
+    return;
+  }
+
+  this->putStr("mw:");
+  this->putHex(addr);
+  this->putChar(':');
+  this->putDec(size);
+  this->putChar(':');
+  this->putHex(value);
+  this->putChar('\n');
+}
+
+
+void TraceWriter::invalidate(ADDRINT addr, UINT32 size) {
+  if (this->memory)
+    this->memory->invalidate(addr, size);
+}
@@ -0,0 +1,88 @@
+#ifndef TRACE_WRITER_H
+#define TRACE_WRITER_H
+
+#include "pin.H"
+#include "code_table.h"
+#include "shadow_memory.h"
+#include "trace_sink.h"
+#include "vmp_trace_format.h"
+#include <ostream>
+#include <vector>
+
+
+enum TraceFormat {
+  FORMAT_TEXT,
+  FORMAT_BINARY,
+  FORMAT_COLUMNAR,
+};
+
+
+/* Formats trace records (text, binary or columnar) into a large in-memory
+ * buffer which is handed to the trace sink in bulk. */
+class TraceWriter {
+  public:
+    TraceWriter(TraceSink* sink, TraceFormat format, size_t capacity, bool dedup, bool writes, bool uses);
+    ~TraceWriter();
+
+    void regs(const UINT64* regs);
+    void inst(const CodeEntry* code);
+    void memread(ADDRINT addr, UINT32 size, UINT64 value);
+    void memwrite(ADDRINT addr, UINT32 size, UINT64 value);
+    void invalidate(ADDRINT addr, UINT32 size);
+    void flush(void);
+
+    /* Writes a checkpoint to the index every `interval` instructions */
+    void setIndex(std::ostream* index, UINT32 interval);
+
+  private:
+    TraceSink*    sink;
+    bool          binary;
+    bool          columnar;
+    bool          writes;                 /* Emit memory write records */
+    bool          uses;                   /* Emit register use records */
+    char*         buffer;
+    size_t        capacity;
+    size_t        pos;
+    UINT64        shadow[VMPT_NUM_REGS];  /* Last registers emitted */
+    bool          shadowValid;
+    std::vector<bool> emitted;            /* Code IDs already emitted */
+    ShadowMemory* memory;                 /* Memory known by the replayer, null without dedup */
+
+    std::ostream* index;
+    UINT32        interval;
+    UINT64        icount;                 /* Instructions written */
+    UINT64        flushed;                /* Bytes handed to the sink */
+    bool          checkpointDue;          /* Before the next instruction */
+
+    /* Block of a column being filled (columnar format) */
+    struct Column {
+      UINT8*  data;
+      UINT32  size;
+      UINT32  count;
+      UINT64  first;
+      UINT64  last;
+      UINT64  minAddr;
+      UINT64  maxAddr;
+    };
+
+    Column        columns[VMPC_NUM_COLS];
+
+    void checkpoint(void);
+    void putColumn(UINT8 column, const void* data, size_t size, UINT64 inst, ADDRINT addr);
+    void flushColumn(UINT8 column);
+
+    char* reserve(size_t size) {
+      if (this->pos + size > this->capacity)
+        this->flush();
+      return this->buffer + this->pos;
+    }
+
+    void put(const void* data, size_t size);
+    void putKind(UINT8 kind);
+    void putChar(char c);
+    void putStr(const char* s);
+    void putHex(UINT64 value);
+    void putDec(UINT64 value);
+};
+
+#endif /* TRACE_WRITER_H */
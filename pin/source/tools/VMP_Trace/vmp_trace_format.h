@@ -0,0 +1,189 @@
+/*
+** Binary layout of a VMP trace.
+**
+** A binary trace starts with a VMPT_HEADER followed by a flat sequence of
+** records. Each record starts with a one byte kind (VMPT_REC_*) followed by
+** the payload of that kind. All integers are little-endian.
+**
+** Records are emitted in the same order as the text format: memory reads
+** done by an instruction, then the registers before its execution, then the
+** instruction itself, then the memory writes it did (only with -mw).
+** Registers are delta encoded: a VMPT_REC_REGS_DELTA record only carries the
+** registers which changed since the previous one.
+** Instructions are dictionary encoded: the first execution of an instruction
+** emits a VMPT_REC_CODE record (id, address and bytes), all its executions
+** then emit a VMPT_REC_EXEC record which only carries the id.
+** With -uses, the first execution of an instruction is preceded by a
+** VMPT_REC_USES record (`u:` line in the text format) giving the registers
+** it reads and overwrites, it applies to all the executions of the next
+** instruction record. A forward taint analysis of the trace only needs these
+** masks and the addresses of the `mr:` and `mw:` records.
+** `vmp_trace.py` converts a binary trace back to the `mr:`, `r:`, `i:`, `u:`
+** and `mw:` text format.
+**
+** With -index, a `<trace>.idx` file is written next to the trace. It starts
+** with a VMPT_INDEX_HEADER followed by records (VMPT_IDX_*, one byte kind
+** then payload). Every `interval` instructions, a checkpoint gives the offset
+** of the next instruction in the uncompressed trace, the registers known at
+** that point and the memory pages whose known bytes changed since the
+** previous checkpoint (only with -dedup, the reader rebuilds the memory by
+** applying the pages of every checkpoint up to the one it starts from). The
+** code records of binary traces are copied to the index, and for compressed
+** traces, the index ends with the file offset of every LZ4 block.
+**
+** A columnar trace (-format columnar) starts with a VMPT_HEADER whose magic is
+** VMPC_MAGIC, followed by blocks of the columns below. Each column is a
+** stream of fixed or self-sized elements which is cut into blocks of at most
+** VMPC_BLOCK_SIZE bytes. A block is a VMPC_BLOCK header followed by one LZ4
+** block (the same encoding as a block of a LZ4 frame: a uint32_t size, bit 31
+** set when the data is stored uncompressed). The header carries the range of
+** instructions and addresses of its elements, so that a scan over a column
+** can skip the blocks which can not match. Blocks of different columns are
+** interleaved in the order they fill up; the records of the flat format are
+** rebuilt by merging the columns on the instruction number.
+*/
+
+#ifndef VMP_TRACE_FORMAT_H
+#define VMP_TRACE_FORMAT_H
+
+#include <stdint.h>
+
+#define VMPT_MAGIC            "VMPT"
+#define VMPT_VERSION          5
+
+#define VMPT_NUM_REGS         16
+#define VMPT_MAX_INST_SIZE    15
+
+/* Record kinds */
+#define VMPT_REC_REGS         0x01
+#define VMPT_REC_INST         0x02
+#define VMPT_REC_MEMREAD      0x03
+#define VMPT_REC_REGS_DELTA   0x04
+#define VMPT_REC_CODE         0x05
+#define VMPT_REC_EXEC         0x06
+#define VMPT_REC_MEMWRITE     0x07
+#define VMPT_REC_USES         0x08
+
+/* VMPT_USES bits, above the registers (bit i is register i of VMPT_REGS) */
+#define VMPT_USE_FLAGS        (1 << 16)   /* Status flags */
+#define VMPT_USE_OTHER        (1 << 17)   /* Any other register (SIMD, x87...) */
+#define VMPT_USE_MEMORY       (1 << 18)   /* Memory read (read) or written (written) */
+
+#define VMPT_INDEX_MAGIC      "VMPI"
+#define VMPT_INDEX_VERSION    1
+#define VMPT_PAGE_SIZE        4096
+
+/* Index record kinds */
+#define VMPT_IDX_CODE         0x01  /* VMPT_CODE */
+#define VMPT_IDX_CHECKPOINT   0x02  /* VMPT_CHECKPOINT followed by `pages` VMPT_PAGE */
+#define VMPT_IDX_BLOCK        0x03  /* VMPT_BLOCK */
+
+#define VMPC_MAGIC            "VMPC"
+#define VMPC_VERSION          1
+#define VMPC_BLOCK_SIZE       (64 << 10)
+
+/* Columns */
+#define VMPC_COL_CODE         0x01  /* VMPT_CODE, first execution of an instruction */
+#define VMPC_COL_EXEC         0x02  /* uint32_t code id, one per instruction */
+#define VMPC_COL_REGS         0x03  /* VMPT_REGS_DELTA and its values, one per instruction */
+#define VMPC_COL_MEMREAD      0x04  /* VMPC_ACCESS */
+#define VMPC_COL_MEMWRITE     0x05  /* VMPC_ACCESS */
+#define VMPC_NUM_COLS         6
+
+#pragma pack(push, 1)
+
+typedef struct {
+  char      magic[4];   /* VMPT_MAGIC */
+  uint32_t  version;    /* VMPT_VERSION */
+} VMPT_HEADER;
+
+/* rax, rbx, rcx, rdx, rdi, rsi, rbp, rsp, r8 ... r15 */
+typedef struct {
+  uint64_t  regs[VMPT_NUM_REGS];
+} VMPT_REGS;
+
+/* Followed by one uint64_t per bit set in mask, in register order */
+typedef struct {
+  uint16_t  mask;
+} VMPT_REGS_DELTA;
+
+typedef struct {
+  uint64_t  addr;
+  uint8_t   size;
+  uint8_t   bytes[VMPT_MAX_INST_SIZE];
+} VMPT_INST;
+
+typedef struct {
+  uint32_t  id;
+  uint64_t  addr;
+  uint8_t   size;
+  uint8_t   bytes[VMPT_MAX_INST_SIZE];
+} VMPT_CODE;
+
+typedef struct {
+  uint32_t  id;         /* VMPT_CODE id */
+} VMPT_EXEC;
+
+typedef struct {
+  uint64_t  addr;
+  uint8_t   size;       /* 1, 2, 4 or 8 */
+  uint64_t  value;
+} VMPT_MEMREAD;
+
+typedef struct {
+  uint64_t  addr;
+  uint8_t   size;       /* 1, 2, 4 or 8 */
+  uint64_t  value;      /* Value after the write */
+} VMPT_MEMWRITE;
+
+/* A register partly written (al, cmov, inc on the flags) is reported as read
+ * too: the registers of `written` only depend on the ones of `read` */
+typedef struct {
+  uint32_t  read;       /* Registers and memory read */
+  uint32_t  written;    /* Registers and memory written */
+} VMPT_USES;
+
+typedef struct {
+  char      magic[4];   /* VMPT_INDEX_MAGIC */
+  uint32_t  version;    /* VMPT_INDEX_VERSION */
+  uint32_t  interval;   /* Instructions between two checkpoints */
+} VMPT_INDEX_HEADER;
+
+typedef struct {
+  uint64_t  icount;     /* Instructions before the checkpoint */
+  uint64_t  offset;     /* Offset of the next record in the uncompressed trace */
+  uint64_t  regs[VMPT_NUM_REGS];
+  uint32_t  pages;
+} VMPT_CHECKPOINT;
+
+typedef struct {
+  uint64_t  addr;
+  uint8_t   valid[VMPT_PAGE_SIZE / 8];  /* Bitmap of the known bytes */
+  uint8_t   data[VMPT_PAGE_SIZE];
+} VMPT_PAGE;
+
+typedef struct {
+  uint64_t  offset;     /* Offset of the block in the uncompressed trace */
+  uint64_t  file_offset;
+} VMPT_BLOCK;
+
+typedef struct {
+  uint8_t   column;     /* VMPC_COL_* */
+  uint32_t  count;      /* Elements in the block */
+  uint32_t  size;       /* Uncompressed size */
+  uint64_t  first;      /* Instruction number of the first element */
+  uint64_t  last;       /* Instruction number of the last element */
+  uint64_t  min_addr;   /* Lowest instruction or memory address (0 for VMPC_COL_REGS) */
+  uint64_t  max_addr;
+} VMPC_BLOCK;
+
+typedef struct {
+  uint64_t  inst;       /* Instruction number */
+  uint64_t  addr;
+  uint8_t   size;       /* 1, 2, 4 or 8 */
+  uint64_t  value;
+} VMPC_ACCESS;
+
+#pragma pack(pop)
+
+#endif /* VMP_TRACE_FORMAT_H */
@@ -0,0 +1,36 @@
+/*
+** Compresses the standard input into a LZ4 frame with the encoder of the
+** Pintool (-compress), so that the readers can be checked on its output.
+**
+**   $ ./lz4_compress [<block size>] < trace > trace.lz4
+*/
+
+#include "lz4_frame.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+
+int main(int argc, char* argv[]) {
+  size_t block = (argc > 1) ? strtoul(argv[1], nullptr, 0) : LZ4F_MAX_BLOCK_SIZE;
+
+  if (block == 0 || block > LZ4F_MAX_BLOCK_SIZE) {
+    fprintf(stderr, "[!] Syntax: %s [<block size>] (at most %d bytes)\n", argv[0], LZ4F_MAX_BLOCK_SIZE);
+    return -1;
+  }
+
+  std::vector<uint8_t> src(block);
+  std::vector<uint8_t> dst(LZ4F_BLOCK_BOUND(block));
+
+  fwrite(dst.data(), 1, lz4f_header(dst.data()), stdout);
+  for (;;) {
+    size_t size = fread(src.data(), 1, block, stdin);
+    if (size == 0)
+      break;
+    fwrite(dst.data(), 1, lz4f_block(src.data(), size, dst.data()), stdout);
+  }
+  fwrite(dst.data(), 1, lz4f_endmark(dst.data()), stdout);
+
+  return ferror(stdin) || ferror(stdout) ? -1 : 0;
+}
@@ -0,0 +1,430 @@
+#!/usr/bin/env python
+## -*- coding: utf-8 -*-
+##
+## Checks of the trace formats and of the tools reading them, run from the
+## root of the repository:
+##
+##   $ ./tests/test_vmp.py [<trace> ...]
+##
+## The traces (vmp_traces/ by default) are converted from text to binary and
+## columnar, and back, and compressed by the LZ4 encoder of the Pintool: every
+## conversion must give the records of the original trace.
+##
+## trace_bench (vmp_replay/) must count the same records as vmp_trace.py and
+## get the same checksum from them, on the text and binary traces.
+##
+## explore_vmp.merge() must build a decision tree which gives the return value
+## of every path with the branches it took, whatever the order of the paths.
+##
+## vmp_solver.run() must give the values of the SMT-LIB semantics on the
+## corner cases of the operations (division by zero, shifts and rotations out
+## of range, extract, sign-extend), and the values of evaluate() when Triton is
+## installed. Without Triton, its AST nodes are stubbed.
+##
+## vmp_replay/test_vmp_replay does the same checks of AstProgram and checks
+## the merge of the paths on Triton's C++ API, it is only built when Triton is
+## installed in $TRITON_DIR (/usr/local by default, as in vmp_replay/Makefile).
+##
+## The native helpers are built with the compiler in $CXX (g++ by default).
+##
+
+import argparse
+import glob
+import itertools
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import types
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+import vmp_trace
+
+
+class StubNodeTypes(object):
+    # AST_NODE of the stub, a distinct number for every name
+
+    def __getattr__(self, name):
+        return self.__dict__.setdefault(name, len(self.__dict__) + 1)
+
+
+def import_triton():
+    # The scripts import Triton first, the checks which do not need it use a
+    # stub when it is not installed
+    try:
+        import triton
+        return triton
+    except ImportError:
+        stub = types.ModuleType('triton')
+        stub.AST_NODE = StubNodeTypes()
+        sys.modules['triton'] = stub
+    return None
+
+
+TRITON = import_triton()
+
+import explore_vmp
+import vmp_solver
+
+AST_NODE = vmp_solver.AST_NODE
+
+PINTOOL = os.path.join(ROOT, 'pin', 'source', 'tools', 'VMP_Trace')
+NATIVE  = os.path.join(ROOT, 'vmp_replay')
+
+# Small LZ4 blocks so that the readers cross block boundaries
+LZ4_BLOCK_SIZE = 64 << 10
+
+
+
+def build(cmd):
+    # Prints the output of a failed build
+    proc = subprocess.run(cmd, cwd=ROOT, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, universal_newlines=True)
+    if proc.returncode:
+        print(f'[-] {" ".join(cmd)} failed:\n{proc.stdout}')
+    return proc.returncode == 0
+
+
+def records(path):
+    # Records as text lines, with the full register file, so that register
+    # deltas compare equal whatever was unchanged in the record
+    regs = [0] * vmp_trace.VMPT_NUM_REGS
+    return [vmp_trace.format_record(r, regs) for r in vmp_trace.read_trace(path)]
+
+
+def compare(name, expected, got):
+    if expected == got:
+        return True
+    for i, (a, b) in enumerate(zip(expected, got)):
+        if a != b:
+            print(f'[-] {name}: record {i} is {b}, expected {a}')
+            return False
+    print(f'[-] {name}: {len(got)} records, expected {len(expected)}')
+    return False
+
+
+def lz4_compress(tool, src, dst):
+    with open(src, 'rb') as fin, open(dst, 'wb') as fout:
+        subprocess.run([tool, str(LZ4_BLOCK_SIZE)], stdin=fin, stdout=fout, check=True)
+    return
+
+
+def convert(function, src, dst):
+    with open(dst, 'w' if function is vmp_trace.to_text else 'wb') as out:
+        function(src, out)
+    return
+
+
+def check_formats(traces, tmp):
+    # text -> binary -> columnar -> binary -> text, and LZ4 frames of the text
+    # and binary traces
+    lz4 = os.path.join(tmp, 'lz4_compress')
+    if not build([os.environ.get('CXX', 'g++'), '-O2', '-I' + PINTOOL, '-o', lz4,
+                  os.path.join(ROOT, 'tests', 'lz4_compress.cpp'), os.path.join(PINTOOL, 'lz4_frame.cpp')]):
+        return 1
+
+    failures = 0
+    for trace in traces:
+        name     = os.path.basename(trace)
+        base     = os.path.join(tmp, name)
+        expected = records(trace)
+        ok       = True
+
+        convert(vmp_trace.to_binary,   trace,          base + '.bin')
+        convert(vmp_trace.to_columnar, base + '.bin',  base + '.col')
+        convert(vmp_trace.to_binary,   base + '.col',  base + '.col.bin')
+        convert(vmp_trace.to_text,     base + '.col.bin', base + '.txt')
+        lz4_compress(lz4, trace,         base + '.lz4')
+        lz4_compress(lz4, base + '.bin', base + '.bin.lz4')
+
+        # Columnar traces have no 'u' records
+        columns = [r for r in expected if not r.startswith('u:')]
+        for suffix, want in (('.bin', expected), ('.col', columns), ('.col.bin', columns), ('.txt', columns), ('.lz4', expected), ('.bin.lz4', expected)):
+            ok &= compare(name + suffix, want, records(base + suffix))
+
+        if ok:
+            print(f'[+] {name}: {len(expected)} records, binary, columnar and LZ4 round trips match')
+        failures += not ok
+
+    return failures
+
+
+def bench_summary(path):
+    # Record counts and checksum of trace_bench: the address and value of the
+    # accesses, the first register of the register files and the address of
+    # the instructions
+    counts = dict.fromkeys(('i', 'r', 'mr', 'mw'), 0)
+    regs   = [0] * vmp_trace.VMPT_NUM_REGS
+    total  = 0
+    for record in vmp_trace.read_trace(path):
+        kind = record[0]
+        if kind in ('mr', 'mw'):
+            total += record[1] + record[3]
+        elif kind == 'r':
+            for index, value in record[1]:
+                regs[index] = value
+            total += regs[0]
+        elif kind == 'i':
+            total += record[1]
+        else:
+            continue
+        counts[kind] += 1
+    return (counts['i'], counts['r'], counts['mr'], counts['mw'], total & ((1 << 64) - 1))
+
+
+def check_trace_bench(traces, tmp):
+    if not build(['make', '-s', '-C', NATIVE, 'trace_bench']):
+        return 1
+
+    failures = 0
+    for trace in traces:
+        name = os.path.basename(trace)
+        base = os.path.join(tmp, name)
+        ok   = True
+        if not os.path.exists(base + '.bin'):
+            convert(vmp_trace.to_binary, trace, base + '.bin')
+
+        for path in (trace, base + '.bin'):
+            out = subprocess.run([os.path.join(NATIVE, 'trace_bench'), path], stdout=subprocess.PIPE, universal_newlines=True).stdout
+            m   = re.search(r': (\d+) inst, (\d+) regs, (\d+) mr, (\d+) mw, .* \(checksum ([0-9a-f]+)\)', out)
+            got = (int(m[1]), int(m[2]), int(m[3]), int(m[4]), int(m[5], 16)) if m else None
+            expected = bench_summary(path)
+            if got != expected:
+                print(f'[-] trace_bench {os.path.basename(path)}: {out.strip()}, expected {expected}')
+                ok = False
+
+        if ok:
+            print(f'[+] {name}: trace_bench agrees with vmp_trace.py')
+        failures += not ok
+
+    return failures
+
+
+class MergeAst(object):
+    # ite() of an AST context, the conditions are the branches taken
+
+    def ite(self, cond, then, other):
+        return ('ite', cond, then, other)
+
+
+def decide(node, taken):
+    while isinstance(node, tuple):
+        _, cond, then, other = node
+        node = then if cond in taken else other
+    return node
+
+
+def merge_paths(*paths):
+    # (sites, ret) to the (path, branches, ret) triples of explore_vmp
+    return [(tuple(sites), [(site, '%#x=%d' %(site[0], site[2]), None) for site in sites], ret) for sites, ret in paths]
+
+
+def check_merge():
+    two = merge_paths(
+        ([(0x10, 'af', 1)], 'x + y'),
+        ([(0x10, 'af', 0)], 'x - y'))
+    three = merge_paths(
+        ([(0x10, 'af', 1)], 'y'),
+        ([(0x10, 'af', 0), (0x20, 'zf', 1)], 'x * y'),
+        ([(0x10, 'af', 0), (0x20, 'zf', 0)], 'x ^ y'))
+    shorter = merge_paths(
+        ([(0x10, 'af', 1)], 'y'),
+        ([(0x10, 'af', 0), (0x20, 'zf', 1)], 'x * y'),
+        ([(0x10, 'af', 0)], 'x ^ y'))
+
+    failures = 0
+    for name, paths in (('two paths', two), ('three paths', three), ('three paths, one of them shorter', shorter)):
+        ok = True
+        for order in itertools.permutations(paths):
+            tree = explore_vmp.merge(MergeAst(), list(order))
+            for _, branches, ret in order:
+                got = decide(tree, set(cond for _, cond, _ in branches))
+                if got != ret:
+                    print(f'[-] merge, {name}: {got} for the path of {ret}, paths {[p[2] for p in order]}')
+                    ok = False
+        if ok:
+            print(f'[+] merge, {name}: every path gets its return value')
+        failures += not ok
+
+    return failures
+
+
+class StubVariable(object):
+
+    def __init__(self, id, size):
+        self.id   = id
+        self.size = size
+
+    def getId(self):
+        return self.id
+
+    def getBitSize(self):
+        return self.size
+
+
+class StubNode(object):
+    # The part of the AST nodes of Triton used by vmp_solver.compile_ast()
+
+    def __init__(self, kind, size, children, value=None):
+        self.kind     = kind
+        self.size     = size
+        self.children = children
+        self.value    = value
+
+    def getType(self):
+        return self.kind
+
+    def getBitvectorSize(self):
+        return self.size
+
+    def getChildren(self):
+        return self.children
+
+    def getInteger(self):
+        return self.value
+
+    def evaluate(self):
+        return self.value
+
+    def getSymbolicVariable(self):
+        return self.value
+
+
+class StubAst(object):
+    # Same signatures as the AstContext of Triton
+
+    def integer(self, value):
+        return StubNode(AST_NODE.INTEGER, 0, [], value)
+
+    def bv(self, value, size):
+        return StubNode(AST_NODE.BV, size, [], value)
+
+    def variable(self, var):
+        return StubNode(AST_NODE.VARIABLE, var.getBitSize(), [], var)
+
+    def __getattr__(self, name):
+        # Operations whose size is the size of their first operand
+        kind = getattr(AST_NODE, name.upper())
+        return lambda *children: StubNode(kind, children[0].getBitvectorSize(), list(children))
+
+    def bvrol(self, node, rot):
+        return StubNode(AST_NODE.BVROL, node.getBitvectorSize(), [node, self.integer(rot)])
+
+    def bvror(self, node, rot):
+        return StubNode(AST_NODE.BVROR, node.getBitvectorSize(), [node, self.integer(rot)])
+
+    def extract(self, high, low, node):
+        return StubNode(AST_NODE.EXTRACT, high - low + 1, [self.integer(high), self.integer(low), node])
+
+    def sx(self, size, node):
+        return StubNode(AST_NODE.SX, node.getBitvectorSize() + size, [self.integer(size), node])
+
+    def zx(self, size, node):
+        return StubNode(AST_NODE.ZX, node.getBitvectorSize() + size, [self.integer(size), node])
+
+
+# (expression, node of the 8-bit x and y, x, y, value), as defined by SMT-LIB
+EVALUATIONS = [
+    ('bvudiv 5 0',         lambda a, x, y: a.bvudiv(x, y),  0x05, 0x00, 0xff),
+    ('bvurem 5 0',         lambda a, x, y: a.bvurem(x, y),  0x05, 0x00, 0x05),
+    ('bvsdiv -5 0',        lambda a, x, y: a.bvsdiv(x, y),  0xfb, 0x00, 0x01),
+    ('bvsdiv 5 0',         lambda a, x, y: a.bvsdiv(x, y),  0x05, 0x00, 0xff),
+    ('bvsdiv -128 -1',     lambda a, x, y: a.bvsdiv(x, y),  0x80, 0xff, 0x80),
+    ('bvsrem -5 0',        lambda a, x, y: a.bvsrem(x, y),  0xfb, 0x00, 0xfb),
+    ('bvsrem -5 3',        lambda a, x, y: a.bvsrem(x, y),  0xfb, 0x03, 0xfe),
+    ('bvsmod -5 0',        lambda a, x, y: a.bvsmod(x, y),  0xfb, 0x00, 0xfb),
+    ('bvsmod -5 3',        lambda a, x, y: a.bvsmod(x, y),  0xfb, 0x03, 0x01),
+    ('bvsmod 5 -3',        lambda a, x, y: a.bvsmod(x, y),  0x05, 0xfd, 0xff),
+    ('bvashr -128 1',      lambda a, x, y: a.bvashr(x, y),  0x80, 0x01, 0xc0),
+    ('bvashr -128 8',      lambda a, x, y: a.bvashr(x, y),  0x80, 0x08, 0xff),
+    ('bvashr -128 200',    lambda a, x, y: a.bvashr(x, y),  0x80, 0xc8, 0xff),
+    ('bvashr 64 9',        lambda a, x, y: a.bvashr(x, y),  0x40, 0x09, 0x00),
+    ('bvshl 1 8',          lambda a, x, y: a.bvshl(x, y),   0x01, 0x08, 0x00),
+    ('bvlshr 128 8',       lambda a, x, y: a.bvlshr(x, y),  0x80, 0x08, 0x00),
+    ('bvrol 0x81 1',       lambda a, x, y: a.bvrol(x, 1),   0x81, 0x00, 0x03),
+    ('bvrol 0x81 9',       lambda a, x, y: a.bvrol(x, 9),   0x81, 0x00, 0x03),
+    ('bvror 0x81 1',       lambda a, x, y: a.bvror(x, 1),   0x81, 0x00, 0xc0),
+    ('bvror 0x81 0',       lambda a, x, y: a.bvror(x, 0),   0x81, 0x00, 0x81),
+    ('extract 7 4 0xab',   lambda a, x, y: a.extract(7, 4, x), 0xab, 0x00, 0x0a),
+    ('extract 0 0 0xab',   lambda a, x, y: a.extract(0, 0, x), 0xab, 0x00, 0x01),
+    ('sx 8 0x80',          lambda a, x, y: a.sx(8, x),      0x80, 0x00, 0xff80),
+    ('sx 8 0x7f',          lambda a, x, y: a.sx(8, x),      0x7f, 0x00, 0x007f),
+    ('zx 8 0x80',          lambda a, x, y: a.zx(8, x),      0x80, 0x00, 0x0080),
+    ('sx 4 (extract 3 0 0x0c)', lambda a, x, y: a.sx(4, a.extract(3, 0, x)), 0x0c, 0x00, 0xfc),
+]
+
+
+def check_evaluator():
+    if TRITON:
+        ctx = TRITON.TritonContext(TRITON.ARCH.X86_64)
+        ast = ctx.getAstContext()
+        vx  = ctx.newSymbolicVariable(8, 'x')
+        vy  = ctx.newSymbolicVariable(8, 'y')
+    else:
+        ast = StubAst()
+        vx  = StubVariable(0, 8)
+        vy  = StubVariable(1, 8)
+
+    failures = 0
+    for text, expr, x, y, expected in EVALUATIONS:
+        node = expr(ast, ast.variable(vx), ast.variable(vy))
+        program, _ = vmp_solver.compile_ast(node)
+        got = vmp_solver.run(program, {vx.getId(): x, vy.getId(): y})
+        if got != expected:
+            print(f'[-] vmp_solver.run: {text} = {got:#x}, expected {expected:#x}')
+            failures += 1
+        if TRITON:
+            ctx.setConcreteVariableValue(vx, x)
+            ctx.setConcreteVariableValue(vy, y)
+            if node.evaluate() != expected:
+                print(f'[-] evaluate(): {text} = {node.evaluate():#x}, expected {expected:#x}')
+                failures += 1
+
+    if not failures:
+        print(f'[+] vmp_solver.run: {len(EVALUATIONS)} expressions evaluate to their SMT-LIB value' + (' and to evaluate()' if TRITON else ' (Triton is not installed, its nodes are stubbed)'))
+    return failures
+
+
+def check_replayer():
+    triton = os.environ.get('TRITON_DIR', '/usr/local')
+    if not os.path.exists(os.path.join(triton, 'include', 'triton', 'context.hpp')):
+        print(f'[!] Triton is not installed in {triton}, test_vmp_replay is skipped (set TRITON_DIR)')
+        return 0
+
+    if not build(['make', '-s', '-C', NATIVE, 'TRITON_DIR=' + triton, 'test_vmp_replay']):
+        return 1
+
+    proc = subprocess.run([os.path.join(NATIVE, 'test_vmp_replay')], stdout=subprocess.PIPE, universal_newlines=True)
+    print(proc.stdout.replace('[+] All checks passed', '[+] test_vmp_replay passed'), end='')
+    return proc.returncode != 0
+
+
+def main():
+    parser = argparse.ArgumentParser(formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("traces", type=str, nargs='*', metavar="<trace>", help="Text traces to check (default: vmp_traces/*)")
+    argv = parser.parse_args(sys.argv[1:])
+
+    traces = argv.traces or sorted(glob.glob(os.path.join(ROOT, 'vmp_traces', '*.vmp.trace*')))
+    tmp    = tempfile.mkdtemp(prefix='vmp_test.')
+
+    try:
+        failures  = check_formats(traces, tmp)
+        failures += check_trace_bench(traces, tmp)
+        failures += check_merge()
+        failures += check_evaluator()
+        failures += check_replayer()
+    finally:
+        shutil.rmtree(tmp)
+
+    if failures:
+        print(f'[-] {failures} checks failed')
+        return -1
+    print('[+] All checks passed')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
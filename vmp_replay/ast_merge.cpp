@@ -0,0 +1,222 @@
+#include "ast_merge.h"
+
+#include <triton/exceptions.hpp>
+#include <triton/symbolicExpression.hpp>
+
+
+AstImporter::AstImporter(triton::Context& ctx) {
+  this->ast = ctx.getAstContext();
+}
+
+
+void AstImporter::mapVariable(const std::string& alias, const triton::engines::symbolic::SharedSymbolicVariable& var) {
+  this->variables[alias] = var;
+}
+
+
+/* Children to import, references are followed */
+static std::vector<triton::ast::SharedAbstractNode> sources(const triton::ast::SharedAbstractNode& node) {
+  if (node->getType() == triton::ast::REFERENCE_NODE) {
+    const triton::ast::ReferenceNode* ref = reinterpret_cast<const triton::ast::ReferenceNode*>(node.get());
+    return {ref->getSymbolicExpression()->getAst()};
+  }
+  return node->getChildren();
+}
+
+
+/* Integer operands (sizes, bit positions, rotations) are kept as they are */
+static triton::uint32 integer(const triton::ast::SharedAbstractNode& node) {
+  if (node->getType() == triton::ast::INTEGER_NODE)
+    return static_cast<triton::uint32>(reinterpret_cast<triton::ast::IntegerNode*>(node.get())->getInteger());
+  return static_cast<triton::uint32>(node->evaluate());
+}
+
+
+/* Nodes are identified by their structure, with the children already
+ * imported. Their hash is not enough: Triton combines the hashes of the
+ * children commutatively, bvsub(a, b) and bvsub(b, a) have the same one. */
+AstImporter::Key AstImporter::key(const triton::ast::SharedAbstractNode& node, const std::vector<triton::ast::SharedAbstractNode>& children) const {
+  Key k(node->getType(), node->getBitvectorSize(), {}, {}, "");
+
+  switch (node->getType()) {
+    case triton::ast::BV_NODE:
+      std::get<3>(k).push_back(node->evaluate());
+      break;
+
+    case triton::ast::VARIABLE_NODE:
+      std::get<4>(k) = reinterpret_cast<triton::ast::VariableNode*>(node.get())->getSymbolicVariable()->getAlias();
+      break;
+
+    default:
+      for (const auto& child : children) {
+        if (child->getType() == triton::ast::INTEGER_NODE)
+          std::get<3>(k).push_back(reinterpret_cast<triton::ast::IntegerNode*>(child.get())->getInteger());
+        else
+          std::get<2>(k).push_back(child.get());
+      }
+      break;
+  }
+
+  return k;
+}
+
+
+/* Iterative, expressions of long traces are too deep for the stack */
+triton::ast::SharedAbstractNode AstImporter::import(const triton::ast::SharedAbstractNode& root) {
+  std::vector<std::pair<triton::ast::SharedAbstractNode, bool>> stack;
+
+  stack.push_back({root, false});
+  while (!stack.empty()) {
+    triton::ast::SharedAbstractNode node = stack.back().first;
+
+    if (this->imported.count(node.get())) {
+      stack.pop_back();
+      continue;
+    }
+
+    std::vector<triton::ast::SharedAbstractNode> children = sources(node);
+
+    /* Children first */
+    if (!stack.back().second) {
+      stack.back().second = true;
+      for (const auto& child : children) {
+        if (child->getType() != triton::ast::INTEGER_NODE && !this->imported.count(child.get()))
+          stack.push_back({child, false});
+      }
+      continue;
+    }
+
+    stack.pop_back();
+    std::vector<triton::ast::SharedAbstractNode> c;
+    for (const auto& child : children)
+      c.push_back(child->getType() == triton::ast::INTEGER_NODE ? child : this->imported[child.get()].second);
+
+    /* A reference is its expression */
+    if (node->getType() == triton::ast::REFERENCE_NODE) {
+      this->imported[node.get()] = {node, c[0]};
+      continue;
+    }
+
+    Key k = this->key(node, c);
+    auto it = this->nodes.find(k);
+    if (it == this->nodes.end())
+      it = this->nodes.emplace(k, this->rebuild(node, c)).first;
+    this->imported[node.get()] = {node, it->second};
+  }
+
+  return this->imported[root.get()].second;
+}
+
+
+triton::ast::SharedAbstractNode AstImporter::rebuild(const triton::ast::SharedAbstractNode& node, const std::vector<triton::ast::SharedAbstractNode>& c) {
+  triton::ast::SharedAstContext& ast = this->ast;
+
+  switch (node->getType()) {
+    case triton::ast::REFERENCE_NODE: return c[0];
+    case triton::ast::BV_NODE:        return ast->bv(node->evaluate(), node->getBitvectorSize());
+
+    case triton::ast::VARIABLE_NODE: {
+      const auto& var = reinterpret_cast<triton::ast::VariableNode*>(node.get())->getSymbolicVariable();
+      auto it = this->variables.find(var->getAlias());
+      if (it == this->variables.end())
+        throw triton::exceptions::Ast("AstImporter: unknown variable " + var->getName());
+      return ast->variable(it->second);
+    }
+
+    case triton::ast::BSWAP_NODE:     return ast->bswap(c[0]);
+    case triton::ast::BVNEG_NODE:     return ast->bvneg(c[0]);
+    case triton::ast::BVNOT_NODE:     return ast->bvnot(c[0]);
+    case triton::ast::LNOT_NODE:      return ast->lnot(c[0]);
+
+    case triton::ast::BVADD_NODE:     return ast->bvadd(c[0], c[1]);
+    case triton::ast::BVAND_NODE:     return ast->bvand(c[0], c[1]);
+    case triton::ast::BVASHR_NODE:    return ast->bvashr(c[0], c[1]);
+    case triton::ast::BVLSHR_NODE:    return ast->bvlshr(c[0], c[1]);
+    case triton::ast::BVMUL_NODE:     return ast->bvmul(c[0], c[1]);
+    case triton::ast::BVNAND_NODE:    return ast->bvnand(c[0], c[1]);
+    case triton::ast::BVNOR_NODE:     return ast->bvnor(c[0], c[1]);
+    case triton::ast::BVOR_NODE:      return ast->bvor(c[0], c[1]);
+    case triton::ast::BVSDIV_NODE:    return ast->bvsdiv(c[0], c[1]);
+    case triton::ast::BVSGE_NODE:     return ast->bvsge(c[0], c[1]);
+    case triton::ast::BVSGT_NODE:     return ast->bvsgt(c[0], c[1]);
+    case triton::ast::BVSHL_NODE:     return ast->bvshl(c[0], c[1]);
+    case triton::ast::BVSLE_NODE:     return ast->bvsle(c[0], c[1]);
+    case triton::ast::BVSLT_NODE:     return ast->bvslt(c[0], c[1]);
+    case triton::ast::BVSMOD_NODE:    return ast->bvsmod(c[0], c[1]);
+    case triton::ast::BVSREM_NODE:    return ast->bvsrem(c[0], c[1]);
+    case triton::ast::BVSUB_NODE:     return ast->bvsub(c[0], c[1]);
+    case triton::ast::BVUDIV_NODE:    return ast->bvudiv(c[0], c[1]);
+    case triton::ast::BVUGE_NODE:     return ast->bvuge(c[0], c[1]);
+    case triton::ast::BVUGT_NODE:     return ast->bvugt(c[0], c[1]);
+    case triton::ast::BVULE_NODE:     return ast->bvule(c[0], c[1]);
+    case triton::ast::BVULT_NODE:     return ast->bvult(c[0], c[1]);
+    case triton::ast::BVUREM_NODE:    return ast->bvurem(c[0], c[1]);
+    case triton::ast::BVXNOR_NODE:    return ast->bvxnor(c[0], c[1]);
+    case triton::ast::BVXOR_NODE:     return ast->bvxor(c[0], c[1]);
+    case triton::ast::DISTINCT_NODE:  return ast->distinct(c[0], c[1]);
+    case triton::ast::EQUAL_NODE:     return ast->equal(c[0], c[1]);
+    case triton::ast::IFF_NODE:       return ast->iff(c[0], c[1]);
+
+    case triton::ast::BVROL_NODE:     return ast->bvrol(c[0], integer(c[1]));
+    case triton::ast::BVROR_NODE:     return ast->bvror(c[0], integer(c[1]));
+    case triton::ast::EXTRACT_NODE:   return ast->extract(integer(c[0]), integer(c[1]), c[2]);
+    case triton::ast::SX_NODE:        return ast->sx(integer(c[0]), c[1]);
+    case triton::ast::ZX_NODE:        return ast->zx(integer(c[0]), c[1]);
+    case triton::ast::ITE_NODE:       return ast->ite(c[0], c[1], c[2]);
+
+    case triton::ast::CONCAT_NODE:    return ast->concat(c);
+    case triton::ast::LAND_NODE:      return ast->land(c);
+    case triton::ast::LOR_NODE:       return ast->lor(c);
+    case triton::ast::LXOR_NODE:      return ast->lxor(c);
+
+    /* Memory arrays, quantifiers and SMT commands do not come out of a replay */
+    default:
+      throw triton::exceptions::Ast("AstImporter: unsupported node type " + std::to_string(node->getType()));
+  }
+}
+
+
+static triton::ast::SharedAbstractNode merge(const triton::ast::SharedAstContext& ast, const std::vector<MergedPath>& paths, const std::vector<size_t>& group, size_t depth) {
+  std::vector<std::pair<triton::ast::SharedAbstractNode, std::vector<size_t>>> branches;
+  std::vector<size_t> done;   /* Paths without constraint left */
+
+  if (group.size() == 1)
+    return paths[group[0]].ret;
+
+  /* Imported constraints are hash-consed, the same branch is the same node */
+  for (size_t i : group) {
+    if (depth >= paths[i].constraints.size()) {
+      done.push_back(i);
+      continue;
+    }
+    const triton::ast::SharedAbstractNode& constraint = paths[i].constraints[depth];
+    size_t b = 0;
+    while (b < branches.size() && branches[b].first != constraint)
+      b++;
+    if (b == branches.size())
+      branches.push_back({constraint, {}});
+    branches[b].second.push_back(i);
+  }
+
+  /* Same virtual branches, same expression */
+  if (branches.empty())
+    return paths[done[0]].ret;
+
+  if (done.empty() && branches.size() == 1)
+    return merge(ast, paths, branches[0].second, depth + 1);
+
+  size_t first = done.empty() ? 1 : 0;
+  triton::ast::SharedAbstractNode node = done.empty() ? merge(ast, paths, branches[0].second, depth + 1) : paths[done[0]].ret;
+  for (size_t b = first; b < branches.size(); ++b)
+    node = ast->ite(branches[b].first, merge(ast, paths, branches[b].second, depth + 1), node);
+  return node;
+}
+
+
+triton::ast::SharedAbstractNode merge_paths(const triton::ast::SharedAstContext& ast, const std::vector<MergedPath>& paths) {
+  std::vector<size_t> all;
+
+  for (size_t i = 0; i < paths.size(); ++i)
+    all.push_back(i);
+  return merge(ast, paths, all, 0);
+}
@@ -0,0 +1,66 @@
+/*
+** Merging of the expressions of traces replayed in their own Triton contexts.
+**
+** AstImporter copies ASTs into another context: variables are matched by
+** alias and nodes are hash-consed, so the sub-expressions shared by several
+** paths (everything computed before their first different virtual branch)
+** become a single node of the merged expression. merge_paths() then builds a
+** decision tree of ite nodes over the virtual branches taken by every path.
+*/
+
+#ifndef AST_MERGE_H
+#define AST_MERGE_H
+
+#include <triton/ast.hpp>
+#include <triton/context.hpp>
+
+#include <map>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+
+class AstImporter {
+  public:
+    AstImporter(triton::Context& ctx);
+
+    /* Variables of the imported ASTs with this alias become `var` */
+    void mapVariable(const std::string& alias, const triton::engines::symbolic::SharedSymbolicVariable& var);
+
+    /* References are unrolled */
+    triton::ast::SharedAbstractNode import(const triton::ast::SharedAbstractNode& node);
+
+    /* Distinct nodes imported so far */
+    size_t numNodes(void) const { return this->nodes.size(); }
+
+  private:
+    /* Type, size, imported children, integer operands (or the value of a
+     * bitvector) and alias of a variable */
+    typedef std::tuple<triton::ast::ast_e, triton::uint32, std::vector<const triton::ast::AbstractNode*>, std::vector<triton::uint512>, std::string> Key;
+
+    triton::ast::SharedAstContext ast;
+    std::map<std::string, triton::engines::symbolic::SharedSymbolicVariable> variables;
+    std::map<Key, triton::ast::SharedAbstractNode> nodes;
+
+    /* Source nodes already imported. The source is kept so that its address
+     * is not reused. */
+    std::map<const triton::ast::AbstractNode*, std::pair<triton::ast::SharedAbstractNode, triton::ast::SharedAbstractNode>> imported;
+
+    Key key(const triton::ast::SharedAbstractNode& node, const std::vector<triton::ast::SharedAbstractNode>& children) const;
+    triton::ast::SharedAbstractNode rebuild(const triton::ast::SharedAbstractNode& node, const std::vector<triton::ast::SharedAbstractNode>& children);
+};
+
+
+/* Return value of a path and the virtual branches it took, in the context of the merge */
+struct MergedPath {
+  triton::ast::SharedAbstractNode              ret;
+  std::vector<triton::ast::SharedAbstractNode> constraints;
+};
+
+
+/* Paths are grouped on their first different constraint, the first path
+ * (or the one without constraint left) is the default branch */
+triton::ast::SharedAbstractNode merge_paths(const triton::ast::SharedAstContext& ast, const std::vector<MergedPath>& paths);
+
+#endif /* AST_MERGE_H */
@@ -0,0 +1,69 @@
+/*
+** One bit per byte of the traced memory, allocated by page. Used by the taint
+** pass (tainted bytes) and the slicer (live bytes).
+*/
+
+#ifndef SHADOW_BITS_H
+#define SHADOW_BITS_H
+
+#include "vmp_trace_format.h"
+
+#include <bitset>
+#include <stdint.h>
+#include <unordered_map>
+
+
+class ShadowBits {
+  public:
+    ShadowBits() : last(nullptr), lastAddr(0) {}
+
+    bool any(uint64_t addr, uint32_t size) {
+      for (uint32_t i = 0; i < size; ++i) {
+        Page* p = this->page(addr + i, false);
+        if (p && p->test((addr + i) & (VMPT_PAGE_SIZE - 1)))
+          return true;
+      }
+      return false;
+    }
+
+    void set(uint64_t addr, uint32_t size, bool value) {
+      for (uint32_t i = 0; i < size; ++i) {
+        Page* p = this->page(addr + i, value);
+        if (p)
+          p->set((addr + i) & (VMPT_PAGE_SIZE - 1), value);
+      }
+    }
+
+    void clear(void) {
+      this->pages.clear();
+      this->last = nullptr;
+    }
+
+  private:
+    typedef std::bitset<VMPT_PAGE_SIZE> Page;
+
+    std::unordered_map<uint64_t, Page> pages;
+    Page*    last;      /* Cache of the last page */
+    uint64_t lastAddr;
+
+    Page* page(uint64_t addr, bool create) {
+      uint64_t base = addr & ~static_cast<uint64_t>(VMPT_PAGE_SIZE - 1);
+
+      if (this->last && this->lastAddr == base)
+        return this->last;
+
+      auto it = this->pages.find(base);
+      if (it == this->pages.end()) {
+        if (!create)
+          return nullptr;
+        it = this->pages.emplace(base, Page()).first;
+      }
+
+      /* Pages are never erased, pointers to them stay valid */
+      this->last     = &it->second;
+      this->lastAddr = base;
+      return this->last;
+    }
+};
+
+#endif /* SHADOW_BITS_H */
@@ -0,0 +1,92 @@
+/*
+** Vectorized helpers of the trace reader: byte search (newlines, colons) and
+** hexadecimal decoding. SSE2 is part of x86-64, AVX2 is used when the build
+** enables it (-mavx2 or -march=native). Other targets use the scalar code.
+*/
+
+#ifndef SIMD_SCAN_H
+#define SIMD_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+
+/* Returns the first c in [p, end), or end */
+static inline const char* scan_byte(const char* p, const char* end, char c) {
+#if defined(__AVX2__)
+  const __m256i needle32 = _mm256_set1_epi8(c);
+  while (end - p >= 32) {
+    uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), needle32));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 32;
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i needle = _mm_set1_epi8(c);
+  while (end - p >= 16) {
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), needle));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+  while (p < end && *p != c)
+    p++;
+  return p;
+}
+
+
+static inline uint64_t hex_scalar(const char* p, const char* end) {
+  uint64_t value = 0;
+  for (; p < end; ++p)
+    value = (value << 4) | ((*p & 0xf) + 9 * ((*p >> 6) & 1));
+  return value;
+}
+
+
+/* Decodes the (at most 16) hexadecimal digits of [p, end). The 16 bytes
+ * before end are loaded at once, so `base` (the start of the readable
+ * memory) must not be after end - 16 for the vector path. */
+static inline uint64_t hex_decode(const char* p, const char* end, const char* base) {
+  size_t n = end - p;
+
+  if (n > 16)
+    return hex_scalar(p, end);
+
+#if defined(__SSE2__)
+  if (end - base >= 16) {
+    static const uint8_t ones[32] = {
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    };
+
+    /* The digits end on lane 15, the lanes before the first digit are zeroed */
+    __m128i v    = _mm_loadu_si128(reinterpret_cast<const __m128i*>(end - 16));
+    __m128i keep = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ones + n));
+
+    /* '0'-'9' -> 0-9, 'a'-'f' and 'A'-'F' -> 10-15 */
+    __m128i letter = _mm_and_si128(_mm_srli_epi16(v, 6), _mm_set1_epi8(1));
+    __m128i nibble = _mm_add_epi8(_mm_and_si128(v, _mm_set1_epi8(0xf)), _mm_mullo_epi16(letter, _mm_set1_epi16(9)));
+    nibble = _mm_and_si128(nibble, keep);
+
+    /* Pairs of nibbles to bytes, then the 8 bytes in digit order */
+    __m128i bytes = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(nibble, _mm_set1_epi16(0x00ff)), 4), _mm_srli_epi16(nibble, 8));
+    bytes = _mm_packus_epi16(bytes, bytes);
+    return __builtin_bswap64(static_cast<uint64_t>(_mm_cvtsi128_si64(bytes)));
+  }
+#else
+  (void)base;
+#endif
+
+  return hex_scalar(p, end);
+}
+
+#endif /* SIMD_SCAN_H */
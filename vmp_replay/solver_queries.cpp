@@ -0,0 +1,866 @@
+#include "solver_queries.h"
+#include "ast_merge.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <tuple>
+#include <unistd.h>
+
+#include <triton/config.hpp>
+#include <triton/symbolicExpression.hpp>
+
+#ifdef TRITON_Z3_INTERFACE
+  #include <triton/z3Solver.hpp>
+#endif
+#ifdef TRITON_BITWUZLA_INTERFACE
+  #include <triton/bitwuzlaSolver.hpp>
+#endif
+
+
+static triton::uint512 mask(triton::uint32 size) {
+  if (size >= 512)
+    return ~triton::uint512(0);
+  return (triton::uint512(1) << size) - 1;
+}
+
+
+static bool negative(const triton::uint512& value, triton::uint32 size) {
+  return boost::multiprecision::bit_test(value, size - 1);
+}
+
+
+static triton::uint512 neg(const triton::uint512& value, triton::uint32 size) {
+  return (~value + 1) & mask(size);
+}
+
+
+static triton::uint32 small(const triton::uint512& value) {
+  return value > 0xffffffff ? 0xffffffff : value.convert_to<triton::uint32>();
+}
+
+
+static triton::uint512 rotate(const triton::uint512& value, triton::uint32 r, triton::uint32 size) {
+  r %= size;
+  if (!r)
+    return value;
+  return ((value << r) | (value >> (size - r))) & mask(size);
+}
+
+
+/* Unsigned division and remainder of the absolute values, signs as in SMT-LIB */
+static triton::uint512 signed_div(const triton::uint512& a, const triton::uint512& b, triton::uint32 size, triton::ast::ast_e type) {
+  bool na = negative(a, size);
+  bool nb = negative(b, size);
+  triton::uint512 ua = na ? neg(a, size) : a;
+  triton::uint512 ub = nb ? neg(b, size) : b;
+
+  if (b == 0) {
+    if (type == triton::ast::BVSDIV_NODE)
+      return na ? triton::uint512(1) : mask(size);
+    return a;
+  }
+
+  if (type == triton::ast::BVSDIV_NODE) {
+    triton::uint512 q = ua / ub;
+    return na != nb ? neg(q, size) : q;
+  }
+
+  triton::uint512 r = ua % ub;
+  if (type == triton::ast::BVSREM_NODE || r == 0)
+    return na ? neg(r, size) : r;
+
+  /* bvsmod: the sign of the divisor */
+  if (na == nb)
+    return na ? neg(r, size) : r;
+  return ((na ? neg(r, size) : r) + b) & mask(size);
+}
+
+
+/* Type, size, operands and extra of an operation. Operands are indexes of
+ * compiled operations, so this identifies a node by its structure, the same
+ * way as vmp_solver.py, and both give the same program and canonical key. */
+typedef std::tuple<triton::ast::ast_e, triton::uint32, std::vector<size_t>, std::vector<triton::uint512>> OpKey;
+
+
+bool AstProgram::compile(const triton::ast::SharedAbstractNode& root) {
+  struct Frame {
+    triton::ast::SharedAbstractNode              node;
+    std::vector<triton::ast::SharedAbstractNode> children;
+    size_t                                       next;
+    std::vector<size_t>                          operands;
+    bool                                         started;
+  };
+
+  std::map<OpKey, size_t> index;
+  std::map<const triton::ast::AbstractNode*, size_t> compiled;
+  std::vector<Frame> frames;
+
+  this->program.clear();
+  this->vars.clear();
+
+  frames.push_back({root, {}, 0, {}, false});
+  while (!frames.empty()) {
+    Frame& frame = frames.back();
+    const triton::ast::SharedAbstractNode& node = frame.node;
+    triton::ast::ast_e type = node->getType();
+
+    if (!frame.started) {
+      frame.started = true;
+      if (type == triton::ast::REFERENCE_NODE)
+        frame.children.push_back(reinterpret_cast<triton::ast::ReferenceNode*>(node.get())->getSymbolicExpression()->getAst());
+      else if (type != triton::ast::BV_NODE && type != triton::ast::VARIABLE_NODE)
+        frame.children = node->getChildren();
+    }
+
+    /* Children first, left to right. The source nodes are alive during the
+     * compilation, their addresses are not reused. */
+    while (frame.next < frame.children.size()) {
+      const triton::ast::SharedAbstractNode& child = frame.children[frame.next];
+      if (child->getType() != triton::ast::INTEGER_NODE) {
+        auto it = compiled.find(child.get());
+        if (it == compiled.end())
+          break;
+        frame.operands.push_back(it->second);
+      }
+      frame.next++;
+    }
+    if (frame.next < frame.children.size()) {
+      triton::ast::SharedAbstractNode child = frame.children[frame.next];
+      frames.push_back({child, {}, 0, {}, false});
+      continue;
+    }
+
+    Op op;
+    op.type     = type;
+    op.size     = node->getBitvectorSize();
+    op.operands = frame.operands;
+
+    for (const auto& child : frame.children) {
+      if (child->getType() == triton::ast::INTEGER_NODE)
+        op.extra.push_back(reinterpret_cast<triton::ast::IntegerNode*>(child.get())->getInteger());
+    }
+
+    switch (type) {
+      case triton::ast::BV_NODE:
+        op.extra = {node->evaluate()};
+        break;
+
+      case triton::ast::VARIABLE_NODE: {
+        const auto& var = reinterpret_cast<triton::ast::VariableNode*>(node.get())->getSymbolicVariable();
+        this->vars[var->getId()] = var;
+        op.extra = {var->getId()};
+        break;
+      }
+
+      /* Sizes of the operands */
+      case triton::ast::CONCAT_NODE:
+      case triton::ast::BVSGE_NODE:
+      case triton::ast::BVSGT_NODE:
+      case triton::ast::BVSLE_NODE:
+      case triton::ast::BVSLT_NODE:
+        for (const auto& child : frame.children)
+          op.extra.push_back(child->getBitvectorSize());
+        break;
+
+      case triton::ast::REFERENCE_NODE:
+      case triton::ast::BSWAP_NODE:   case triton::ast::BVADD_NODE:   case triton::ast::BVAND_NODE:
+      case triton::ast::BVASHR_NODE:  case triton::ast::BVLSHR_NODE:  case triton::ast::BVMUL_NODE:
+      case triton::ast::BVNAND_NODE:  case triton::ast::BVNEG_NODE:   case triton::ast::BVNOR_NODE:
+      case triton::ast::BVNOT_NODE:   case triton::ast::BVOR_NODE:    case triton::ast::BVROL_NODE:
+      case triton::ast::BVROR_NODE:   case triton::ast::BVSDIV_NODE:  case triton::ast::BVSHL_NODE:
+      case triton::ast::BVSMOD_NODE:  case triton::ast::BVSREM_NODE:  case triton::ast::BVSUB_NODE:
+      case triton::ast::BVUDIV_NODE:  case triton::ast::BVUGE_NODE:   case triton::ast::BVUGT_NODE:
+      case triton::ast::BVULE_NODE:   case triton::ast::BVULT_NODE:   case triton::ast::BVUREM_NODE:
+      case triton::ast::BVXNOR_NODE:  case triton::ast::BVXOR_NODE:   case triton::ast::DISTINCT_NODE:
+      case triton::ast::EQUAL_NODE:   case triton::ast::EXTRACT_NODE: case triton::ast::IFF_NODE:
+      case triton::ast::ITE_NODE:     case triton::ast::LAND_NODE:    case triton::ast::LNOT_NODE:
+      case triton::ast::LOR_NODE:     case triton::ast::LXOR_NODE:    case triton::ast::SX_NODE:
+      case triton::ast::ZX_NODE:
+        break;
+
+      default:
+        return false;
+    }
+
+    OpKey key(op.type, op.size, op.operands, op.extra);
+    auto it = index.find(key);
+    if (it == index.end()) {
+      it = index.emplace(key, this->program.size()).first;
+      this->program.push_back(op);
+    }
+    compiled[node.get()] = it->second;
+    frames.pop_back();
+  }
+
+  return true;
+}
+
+
+std::string AstProgram::key(std::vector<triton::usize>* order) const {
+  /* FNV-1a 128 */
+  const unsigned __int128 prime  = (static_cast<unsigned __int128>(0x0000000001000000ULL) << 64) | 0x000000000000013bULL;
+  unsigned __int128       hash   = (static_cast<unsigned __int128>(0x6c62272e07bb0142ULL) << 64) | 0x62b821756295c58dULL;
+  std::ostringstream      text;
+
+  order->clear();
+  for (const Op& op : this->program) {
+    std::vector<triton::uint512> extra = op.extra;
+    if (op.type == triton::ast::VARIABLE_NODE) {
+      triton::usize id = op.extra[0].convert_to<triton::usize>();
+      auto it = std::find(order->begin(), order->end(), id);
+      extra = {triton::uint512(it - order->begin())};
+      if (it == order->end())
+        order->push_back(id);
+    }
+
+    text << static_cast<int>(op.type) << " " << op.size << " ";
+    for (size_t i = 0; i < op.operands.size(); ++i)
+      text << (i ? "," : "") << op.operands[i];
+    text << "|";
+    for (size_t i = 0; i < extra.size(); ++i)
+      text << (i ? "," : "") << extra[i];
+    text << "\n";
+  }
+
+  for (unsigned char byte : text.str())
+    hash = (hash ^ byte) * prime;
+
+  char digits[33];
+  std::snprintf(digits, sizeof(digits), "%016llx%016llx", static_cast<unsigned long long>(hash >> 64), static_cast<unsigned long long>(hash));
+  return digits;
+}
+
+
+triton::uint512 AstProgram::run(const std::map<triton::usize, triton::uint512>& assignment) {
+  std::vector<triton::uint512>& out = this->values;
+
+  out.resize(this->program.size());
+  for (size_t i = 0; i < this->program.size(); ++i) {
+    const Op& op = this->program[i];
+    triton::uint32 s = op.size;
+    triton::uint512 m = mask(s);
+    triton::uint512 a = op.operands.size() > 0 ? out[op.operands[0]] : 0;
+    triton::uint512 b = op.operands.size() > 1 ? out[op.operands[1]] : 0;
+    triton::uint512 r = 0;
+
+    switch (op.type) {
+      case triton::ast::BV_NODE:        r = op.extra[0]; break;
+      case triton::ast::VARIABLE_NODE:  r = assignment.at(op.extra[0].convert_to<triton::usize>()); break;
+      case triton::ast::REFERENCE_NODE: r = a; break;
+
+      case triton::ast::BVADD_NODE:     r = (a + b) & m; break;
+      case triton::ast::BVSUB_NODE:     r = (a - b) & m; break;
+      case triton::ast::BVMUL_NODE:     r = (a * b) & m; break;
+      case triton::ast::BVAND_NODE:     r = a & b; break;
+      case triton::ast::BVOR_NODE:      r = a | b; break;
+      case triton::ast::BVXOR_NODE:     r = a ^ b; break;
+      case triton::ast::BVNAND_NODE:    r = ~(a & b) & m; break;
+      case triton::ast::BVNOR_NODE:     r = ~(a | b) & m; break;
+      case triton::ast::BVXNOR_NODE:    r = ~(a ^ b) & m; break;
+      case triton::ast::BVNOT_NODE:     r = ~a & m; break;
+      case triton::ast::BVNEG_NODE:     r = neg(a, s); break;
+
+      case triton::ast::BVSHL_NODE:     r = b >= s ? 0 : (a << small(b)) & m; break;
+      case triton::ast::BVLSHR_NODE:    r = b >= s ? 0 : a >> small(b); break;
+      case triton::ast::BVASHR_NODE: {
+        triton::uint32 n = b >= s ? s : small(b);
+        r = n == s ? 0 : a >> n;
+        if (negative(a, s))
+          r |= m & ~(n == s ? 0 : m >> n);
+        break;
+      }
+
+      case triton::ast::BVUDIV_NODE:    r = b == 0 ? m : a / b; break;
+      case triton::ast::BVUREM_NODE:    r = b == 0 ? a : a % b; break;
+      case triton::ast::BVSDIV_NODE:
+      case triton::ast::BVSREM_NODE:
+      case triton::ast::BVSMOD_NODE:    r = signed_div(a, b, s, op.type); break;
+
+      case triton::ast::BVROL_NODE:     r = rotate(a, small(op.extra.empty() ? b : op.extra[0]) % s, s); break;
+      case triton::ast::BVROR_NODE:     r = rotate(a, s - small(op.extra.empty() ? b : op.extra[0]) % s, s); break;
+      case triton::ast::BSWAP_NODE:
+        for (triton::uint32 byte = 0; byte < s / 8; ++byte)
+          r = (r << 8) | ((a >> (byte * 8)) & 0xff);
+        break;
+
+      case triton::ast::BVULT_NODE:     r = a <  b; break;
+      case triton::ast::BVULE_NODE:     r = a <= b; break;
+      case triton::ast::BVUGT_NODE:     r = a >  b; break;
+      case triton::ast::BVUGE_NODE:     r = a >= b; break;
+      case triton::ast::BVSLT_NODE:
+      case triton::ast::BVSLE_NODE:
+      case triton::ast::BVSGT_NODE:
+      case triton::ast::BVSGE_NODE: {
+        /* Signed order is the unsigned order with the sign bit flipped */
+        triton::uint512 sign = triton::uint512(1) << (small(op.extra[0]) - 1);
+        triton::uint512 sa = a ^ sign, sb = b ^ sign;
+        if (op.type == triton::ast::BVSLT_NODE) r = sa <  sb;
+        if (op.type == triton::ast::BVSLE_NODE) r = sa <= sb;
+        if (op.type == triton::ast::BVSGT_NODE) r = sa >  sb;
+        if (op.type == triton::ast::BVSGE_NODE) r = sa >= sb;
+        break;
+      }
+
+      case triton::ast::EQUAL_NODE:     r = a == b; break;
+      case triton::ast::DISTINCT_NODE:  r = a != b; break;
+      case triton::ast::ITE_NODE:       r = a != 0 ? b : out[op.operands[2]]; break;
+
+      case triton::ast::EXTRACT_NODE:   r = (a >> small(op.extra[1])) & m; break;
+      case triton::ast::ZX_NODE:        r = a; break;
+      case triton::ast::SX_NODE: {
+        triton::uint32 from = s - small(op.extra[0]);
+        r = negative(a, from) ? (a | (m & ~mask(from))) : a;
+        break;
+      }
+      case triton::ast::CONCAT_NODE:
+        for (size_t c = 0; c < op.operands.size(); ++c)
+          r = (r << small(op.extra[c])) | out[op.operands[c]];
+        break;
+
+      case triton::ast::LNOT_NODE:      r = a == 0; break;
+      case triton::ast::IFF_NODE:       r = (a != 0) == (b != 0); break;
+      case triton::ast::LAND_NODE:
+      case triton::ast::LOR_NODE:
+      case triton::ast::LXOR_NODE: {
+        uint32_t set = 0;
+        for (size_t operand : op.operands)
+          set += out[operand] != 0;
+        if (op.type == triton::ast::LAND_NODE) r = set == op.operands.size();
+        if (op.type == triton::ast::LOR_NODE)  r = set != 0;
+        if (op.type == triton::ast::LXOR_NODE) r = set & 1;
+        break;
+      }
+
+      default:
+        break;
+    }
+
+    out[i] = r;
+  }
+
+  return out.empty() ? 0 : out.back();
+}
+
+
+bool SolverCache::load(const std::string& path) {
+  std::ifstream file(path);
+  std::string line;
+
+  if (!file)
+    return true;
+
+  std::lock_guard<std::mutex> guard(this->lock);
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    std::string key, status, value;
+    if (line.empty() || line[0] == '#' || !(fields >> key >> status))
+      continue;
+
+    Entry entry;
+    entry.sat = status == "sat";
+    try {
+      while (fields >> value)
+        entry.values.push_back(triton::uint512(value));
+    }
+    catch (const std::exception&) {
+      return false;
+    }
+    this->entries[key] = entry;
+  }
+
+  return !file.bad();
+}
+
+
+bool SolverCache::save(const std::string& path) {
+  std::map<std::string, Entry> added;
+
+  {
+    std::lock_guard<std::mutex> guard(this->lock);
+    for (const std::string& key : this->added)
+      added[key] = this->entries[key];
+  }
+  if (path.empty() || added.empty())
+    return true;
+
+  /* Other runs may have added entries since it was loaded: the runs sharing
+   * the file take a lock on <file>.lock to reload, merge and replace it, each
+   * one through a temporary file of its own. Same as vmp_solver.py. */
+  int held = open((path + ".lock").c_str(), O_RDWR | O_CREAT, 0644);
+  if (held < 0)
+    return false;
+  while (flock(held, LOCK_EX) != 0) {
+    if (errno != EINTR) {
+      close(held);
+      return false;
+    }
+  }
+
+  bool ok = this->replace(path, added);
+  close(held);
+  if (ok) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    for (const auto& item : added)
+      this->added.erase(item.first);
+  }
+  return ok;
+}
+
+
+/* Called with the lock file held */
+bool SolverCache::replace(const std::string& path, const std::map<std::string, Entry>& added) {
+  if (!this->load(path))
+    return false;
+
+  std::ostringstream text;
+  {
+    std::lock_guard<std::mutex> guard(this->lock);
+    for (const auto& item : added)
+      this->entries[item.first] = item.second;
+
+    text << "# vmp solver cache" << std::endl;
+    for (const auto& item : this->entries) {
+      text << item.first << (item.second.sat ? " sat" : " unsat");
+      for (const triton::uint512& value : item.second.values)
+        text << " 0x" << std::hex << value << std::dec;
+      text << std::endl;
+    }
+  }
+
+  std::string tmp = path + ".XXXXXX";
+  int fd = mkstemp(&tmp[0]);
+  if (fd < 0)
+    return false;
+
+  const std::string data = text.str();
+  bool ok = fchmod(fd, 0644) == 0;
+  for (size_t done = 0; ok && done < data.size(); ) {
+    ssize_t n = write(fd, data.data() + done, data.size() - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    ok = n > 0;
+    done += ok ? n : 0;
+  }
+  ok = close(fd) == 0 && ok;
+
+  if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+
+bool SolverCache::find(const std::string& key, Entry* entry) {
+  std::lock_guard<std::mutex> guard(this->lock);
+  auto it = this->entries.find(key);
+  if (it == this->entries.end())
+    return false;
+  *entry = it->second;
+  return true;
+}
+
+
+void SolverCache::insert(const std::string& key, const Entry& entry) {
+  std::lock_guard<std::mutex> guard(this->lock);
+  this->entries[key] = entry;
+  this->added.insert(key);
+}
+
+
+SolverPortfolio::SolverPortfolio(const std::vector<triton::engines::solver::solver_e>& backends, uint32_t timeout, size_t raceSize)
+  : backends(backends), timeout(timeout), raceSize(raceSize), shared(std::make_shared<Shared>()) {
+  this->shared->running = 0;
+}
+
+
+SolverPortfolio::~SolverPortfolio() {
+  std::list<Worker> workers;
+  {
+    std::lock_guard<std::mutex> guard(this->shared->lock);
+    workers.swap(this->shared->workers);
+  }
+  for (Worker& worker : workers)
+    worker.thread.join();
+}
+
+
+triton::engines::solver::solver_e SolverPortfolio::backend(const std::string& name) {
+#ifdef TRITON_Z3_INTERFACE
+  if (name == "z3")
+    return triton::engines::solver::SOLVER_Z3;
+#endif
+#ifdef TRITON_BITWUZLA_INTERFACE
+  if (name == "bitwuzla")
+    return triton::engines::solver::SOLVER_BITWUZLA;
+#endif
+  return triton::engines::solver::SOLVER_INVALID;
+}
+
+
+const char* SolverPortfolio::name(triton::engines::solver::solver_e backend) {
+  switch (backend) {
+    case triton::engines::solver::SOLVER_Z3:       return "z3";
+    case triton::engines::solver::SOLVER_BITWUZLA: return "bitwuzla";
+    default:                                       return "custom";
+  }
+}
+
+
+/* A solver of its own for each query, so that the backends can run in
+ * parallel */
+static std::unordered_map<triton::usize, triton::engines::solver::SolverModel> solve(triton::engines::solver::solver_e backend, const triton::ast::SharedAbstractNode& node, triton::engines::solver::status_e* status, uint32_t timeout) {
+  *status = triton::engines::solver::UNKNOWN;
+  switch (backend) {
+#ifdef TRITON_Z3_INTERFACE
+    case triton::engines::solver::SOLVER_Z3:
+      return triton::engines::solver::Z3Solver().getModel(node, status, timeout);
+#endif
+#ifdef TRITON_BITWUZLA_INTERFACE
+    case triton::engines::solver::SOLVER_BITWUZLA:
+      return triton::engines::solver::BitwuzlaSolver().getModel(node, status, timeout);
+#endif
+    default:
+      return {};
+  }
+}
+
+
+static bool answered(triton::engines::solver::status_e status) {
+  return status == triton::engines::solver::SAT || status == triton::engines::solver::UNSAT;
+}
+
+
+void SolverPortfolio::account(Shared& shared, triton::engines::solver::solver_e backend, triton::engines::solver::status_e status, double elapsed, bool taken) {
+  std::lock_guard<std::mutex> guard(shared.lock);
+  Stats& stats = shared.stats[backend];
+
+  stats.queries++;
+  stats.first   += taken;
+  stats.unknown += !answered(status);
+  stats.time    += elapsed;
+  stats.max      = std::max(stats.max, elapsed);
+}
+
+
+/* Copy of a query for one backend. The context of the replay keeps changing
+ * while the backends run, they only see nodes of their own context. */
+struct Query {
+  triton::Context                                                             ctx;
+  triton::ast::SharedAbstractNode                                             node;
+  std::map<triton::usize, triton::engines::symbolic::SharedSymbolicVariable>  variables; /* Of the replay, by id in ctx */
+
+  Query() : ctx(triton::arch::ARCH_X86_64) {}
+};
+
+
+/* Variables are matched by alias, like for the merge */
+static std::shared_ptr<Query> copy_query(triton::Context& ctx, const triton::ast::SharedAbstractNode& node) {
+  auto query = std::make_shared<Query>();
+  AstImporter importer(query->ctx);
+
+  for (const auto& item : ctx.getSymbolicVariables()) {
+    const triton::engines::symbolic::SharedSymbolicVariable& var = item.second;
+    triton::engines::symbolic::SharedSymbolicVariable copy = query->ctx.newSymbolicVariable(var->getSize(), var->getAlias());
+    importer.mapVariable(var->getAlias(), copy);
+    query->variables[copy->getId()] = var;
+  }
+  query->node = importer.import(node);
+  return query;
+}
+
+
+/* One query raced on the backends, until the first answer */
+struct Race {
+  std::mutex                                                              lock;
+  std::condition_variable                                                 done;
+  size_t                                                                  pending;
+  bool                                                                    answered;
+  bool                                                                    timeout;
+  triton::engines::solver::status_e                                       status;
+  std::unordered_map<triton::usize, triton::engines::solver::SolverModel> model;
+};
+
+
+std::unordered_map<triton::usize, triton::engines::solver::SolverModel> SolverPortfolio::getModel(triton::Context& ctx, const triton::ast::SharedAbstractNode& node, triton::engines::solver::status_e* status, size_t size) {
+  auto start = std::chrono::steady_clock::now();
+
+  if (this->backends.size() < 2 || (size && size < this->raceSize)) {
+    triton::engines::solver::solver_e backend = this->backends.empty() ? ctx.getSolver() : this->backends[0];
+    auto model = this->backends.empty() ? ctx.getModel(node, status, this->timeout) : solve(backend, node, status, this->timeout);
+    account(*this->shared, backend, *status, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), answered(*status));
+    return model;
+  }
+
+  auto race = std::make_shared<Race>();
+  race->pending  = this->backends.size();
+  race->answered = false;
+  race->timeout  = false;
+  race->status   = triton::engines::solver::UNKNOWN;
+
+  std::vector<std::shared_ptr<Query>> queries;
+  for (size_t i = 0; i < this->backends.size(); ++i)
+    queries.push_back(copy_query(ctx, node));
+
+  std::list<Worker> over;
+  {
+    std::lock_guard<std::mutex> guard(this->shared->lock);
+    this->shared->running += this->backends.size();
+
+    /* Threads of the previous races */
+    for (auto it = this->shared->workers.begin(); it != this->shared->workers.end(); ) {
+      auto next = std::next(it);
+      if (it->finished)
+        over.splice(over.end(), this->shared->workers, it);
+      it = next;
+    }
+
+    /* Started under the lock, a thread only marks itself finished once it
+     * is in the list */
+    for (size_t i = 0; i < this->backends.size(); ++i) {
+      this->shared->workers.emplace_back();
+      Worker* worker = &this->shared->workers.back();
+      worker->finished = false;
+      worker->thread = std::thread([race, shared = this->shared, worker, query = std::move(queries[i]), backend = this->backends[i], timeout = this->timeout, start]() {
+        triton::engines::solver::status_e status = triton::engines::solver::UNKNOWN;
+        std::unordered_map<triton::usize, triton::engines::solver::SolverModel> model;
+        bool taken = false;
+
+        try {
+          for (const auto& item : solve(backend, query->node, &status, timeout)) {
+            const triton::engines::symbolic::SharedSymbolicVariable& var = query->variables.at(item.first);
+            model.emplace(var->getId(), triton::engines::solver::SolverModel(var, item.second.getValue()));
+          }
+        }
+        catch (const std::exception&) {
+          status = triton::engines::solver::UNKNOWN;
+          model.clear();
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        {
+          std::lock_guard<std::mutex> guard(race->lock);
+          race->pending--;
+          race->timeout |= status == triton::engines::solver::TIMEOUT;
+          if (!race->answered && answered(status)) {
+            race->answered = taken = true;
+            race->status   = status;
+            race->model    = std::move(model);
+          }
+        }
+        race->done.notify_all();
+
+        account(*shared, backend, status, elapsed, taken);
+        {
+          std::lock_guard<std::mutex> guard(shared->lock);
+          shared->running--;
+          worker->finished = true;
+        }
+        shared->done.notify_all();
+      });
+    }
+  }
+
+  for (Worker& worker : over)
+    worker.thread.join();
+
+  /* A backend may overrun its timeout, it is not waited for much longer */
+  std::unique_lock<std::mutex> guard(race->lock);
+  auto ready = [&]() { return race->answered || race->pending == 0; };
+  if (this->timeout)
+    race->done.wait_for(guard, std::chrono::milliseconds(this->timeout) + std::chrono::seconds(1), ready);
+  else
+    race->done.wait(guard, ready);
+
+  if (race->answered) {
+    *status = race->status;
+    return race->model;
+  }
+  *status = race->timeout || !ready() ? triton::engines::solver::TIMEOUT : triton::engines::solver::UNKNOWN;
+  return {};
+}
+
+
+void SolverPortfolio::summary(std::ostream& out) {
+  std::unique_lock<std::mutex> guard(this->shared->lock);
+
+  if (this->timeout)
+    this->shared->done.wait_for(guard, std::chrono::milliseconds(this->timeout) + std::chrono::seconds(1), [&]() { return this->shared->running == 0; });
+
+  for (const auto& item : this->shared->stats) {
+    const Stats& s = item.second;
+    out << "[+] Solver " << name(item.first) << ": " << s.queries << " queries, " << s.first << " answers taken, " << s.unknown
+        << " unknown - " << std::fixed << std::setprecision(3) << s.time / s.queries * 1000 << " ms average, "
+        << s.max * 1000 << " ms max" << std::defaultfloat << std::endl;
+  }
+  if (this->shared->running)
+    out << "[!] Solver backends still running: " << this->shared->running << std::endl;
+}
+
+
+SolverQueries::SolverQueries(triton::Context& ctx, SolverCache* cache, SolverPortfolio* solvers, uint32_t samples) : ctx(ctx), cache(cache), solvers(solvers), samples(samples) {
+  for (int i = 0; i < OUTCOMES; ++i) {
+    this->counts[i] = 0;
+    this->times[i]  = 0;
+  }
+}
+
+
+/* Combinations of the boundary values of the variables for half the batch,
+ * then random values. The current values are already known not to satisfy
+ * the query. */
+static std::vector<std::map<triton::usize, triton::uint512>> make_samples(const AstProgram& program, const std::map<triton::usize, triton::uint512>& current, uint32_t count) {
+  std::vector<std::map<triton::usize, triton::uint512>> result;
+  std::vector<std::pair<triton::usize, std::vector<triton::uint512>>> edges;
+  std::mt19937_64 rnd(0);
+
+  for (const auto& item : program.variables()) {
+    triton::uint32 bits = item.second->getSize();
+    triton::uint512 m = mask(bits), v = current.at(item.first);
+    std::vector<triton::uint512> values;
+    for (const triton::uint512& e : {v, triton::uint512(0), triton::uint512(1), m, triton::uint512(1) << (bits - 1), m >> 1, (v + 1) & m, (v - 1) & m}) {
+      if (std::find(values.begin(), values.end(), e) == values.end())
+        values.push_back(e);
+    }
+    edges.push_back({item.first, values});
+  }
+
+  std::vector<size_t> digits(edges.size(), 0);
+  bool more = true;
+  while (more && result.size() < count / 2) {
+    std::map<triton::usize, triton::uint512> values;
+    for (size_t i = 0; i < edges.size(); ++i)
+      values[edges[i].first] = edges[i].second[digits[i]];
+    if (values != current)
+      result.push_back(values);
+
+    more = false;
+    for (size_t i = edges.size(); i-- > 0 && !more; ) {
+      if (++digits[i] < edges[i].second.size())
+        more = true;
+      else
+        digits[i] = 0;
+    }
+  }
+
+  while (result.size() < count) {
+    std::map<triton::usize, triton::uint512> values;
+    for (const auto& item : program.variables()) {
+      triton::uint512 v = 0;
+      for (triton::uint32 bits = 0; bits < item.second->getSize(); bits += 64)
+        v = (v << 64) | rnd();
+      values[item.first] = v & mask(item.second->getSize());
+    }
+    result.push_back(values);
+  }
+
+  return result;
+}
+
+
+std::unordered_map<triton::usize, triton::engines::solver::SolverModel> SolverQueries::getModel(const triton::ast::SharedAbstractNode& node, triton::engines::solver::status_e* status, const std::string& label) {
+  std::unordered_map<triton::usize, triton::engines::solver::SolverModel> model;
+  auto start = std::chrono::steady_clock::now();
+  auto elapsed = [&]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+  AstProgram program;
+  std::vector<triton::usize> order;
+  std::map<triton::usize, triton::uint512> current;
+  std::string key;
+  bool compiled = program.compile(node);
+
+  if (compiled) {
+    if (program.variables().empty()) {
+      *status = program.run({}) != 0 ? triton::engines::solver::SAT : triton::engines::solver::UNSAT;
+      this->record(label, CONSTANT, elapsed());
+      return model;
+    }
+
+    for (const auto& item : program.variables())
+      current[item.first] = this->ctx.getConcreteVariableValue(item.second);
+
+    for (const auto& values : make_samples(program, current, this->samples)) {
+      if (program.run(values) == 0)
+        continue;
+      for (const auto& item : program.variables())
+        model.emplace(item.first, triton::engines::solver::SolverModel(item.second, values.at(item.first)));
+      *status = triton::engines::solver::SAT;
+      this->record(label, SAMPLED, elapsed());
+      return model;
+    }
+  }
+
+  /* A cached model is checked, it costs one more evaluation */
+  if (compiled && this->cache) {
+    SolverCache::Entry entry;
+    key = program.key(&order);
+    if (this->cache->find(key, &entry) && (!entry.sat || entry.values.size() == order.size())) {
+      std::map<triton::usize, triton::uint512> values;
+      for (size_t i = 0; i < entry.values.size(); ++i)
+        values[order[i]] = entry.values[i];
+
+      if (!entry.sat || program.run(values) != 0) {
+        for (const auto& item : values)
+          model.emplace(item.first, triton::engines::solver::SolverModel(program.variables().at(item.first), item.second));
+        *status = entry.sat ? triton::engines::solver::SAT : triton::engines::solver::UNSAT;
+        this->record(label, CACHED, elapsed());
+        return model;
+      }
+    }
+  }
+
+  model = this->solvers ? this->solvers->getModel(this->ctx, node, status, compiled ? program.size() : 0) : this->ctx.getModel(node, status);
+  if (!key.empty() && (*status == triton::engines::solver::SAT || *status == triton::engines::solver::UNSAT)) {
+    SolverCache::Entry entry;
+    entry.sat = *status == triton::engines::solver::SAT;
+    for (triton::usize id : order)
+      entry.values.push_back(model.count(id) ? model.at(id).getValue() : current.at(id));
+    this->cache->insert(key, entry);
+  }
+  this->record(label, *status == triton::engines::solver::SAT ? SAT : *status == triton::engines::solver::UNSAT ? UNSAT : UNKNOWN, elapsed());
+  return model;
+}
+
+
+void SolverQueries::record(const std::string& label, Outcome outcome, double elapsed) {
+  static const char* names[OUTCOMES] = {"constant", "sampled", "cached", "sat", "unsat", "unknown"};
+  std::ostringstream line;
+
+  this->counts[outcome]++;
+  this->times[outcome] += elapsed;
+  line << label << "\t" << names[outcome] << "\t" << std::fixed << std::setprecision(3) << elapsed * 1000 << " ms";
+  this->lines.push_back(line.str());
+}
+
+
+uint64_t SolverQueries::total(void) const {
+  uint64_t total = 0;
+  for (int i = 0; i < OUTCOMES; ++i)
+    total += this->counts[i];
+  return total;
+}
+
+
+void SolverQueries::summary(std::ostream& out) const {
+  const uint64_t* c = this->counts;
+  double spent = this->times[SAT] + this->times[UNSAT] + this->times[UNKNOWN];
+
+  out << "[+] Solver queries: " << this->total() << " - answered by evaluation: " << c[SAMPLED] + c[CONSTANT]
+      << " (" << c[CONSTANT] << " constant), from the cache: " << c[CACHED] << ", by the solver: " << c[SAT] + c[UNSAT] + c[UNKNOWN]
+      << " (" << c[SAT] << " sat, " << c[UNSAT] << " unsat, " << c[UNKNOWN] << " unknown) in "
+      << std::fixed << std::setprecision(3) << spent << "s" << std::defaultfloat << std::endl;
+}
+
+
+void SolverQueries::write(std::ostream& out) const {
+  for (const std::string& line : this->lines)
+    out << line << std::endl;
+}
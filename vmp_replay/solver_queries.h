@@ -0,0 +1,185 @@
+/*
+** Solver queries of the replayer, answered like in vmp_solver.py: a query is
+** first evaluated on a batch of boundary and random values of its variables,
+** the solver is only asked when none of them satisfies it. Every query and
+** how it was answered is logged.
+**
+** Solver results are kept in a SolverCache, by a canonical hash of the query
+** with its variables numbered in order of appearance. The cache file is the
+** one of vmp_solver.py, so the scripts and the replayer share their results.
+**
+** The queries left to the solver can be raced on several backends of Triton
+** (SolverPortfolio), with a timeout, so that one slow query does not stall
+** the replay.
+*/
+
+#ifndef SOLVER_QUERIES_H
+#define SOLVER_QUERIES_H
+
+#include <triton/ast.hpp>
+#include <triton/context.hpp>
+
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+/* Flat post-order program of an unrolled AST, evaluated with other values of
+ * its variables */
+class AstProgram {
+  public:
+    /* False if the node has a type which can not be evaluated */
+    bool compile(const triton::ast::SharedAbstractNode& node);
+
+    triton::uint512 run(const std::map<triton::usize, triton::uint512>& values);
+
+    /* Variables of the node, by id */
+    const std::map<triton::usize, triton::engines::symbolic::SharedSymbolicVariable>& variables(void) const { return this->vars; }
+
+    /* FNV-1a (128 bits) of the program, the same as canonical_key() of
+     * vmp_solver.py. `order` gets the ids of the variables in order of
+     * appearance. */
+    std::string key(std::vector<triton::usize>* order) const;
+
+    /* Distinct operations */
+    size_t size(void) const { return this->program.size(); }
+
+  private:
+    struct Op {
+      triton::ast::ast_e           type;
+      triton::uint32               size;
+      std::vector<size_t>          operands;  /* Earlier entries */
+      std::vector<triton::uint512> extra;     /* Integer operands, sizes of the children or constant */
+    };
+
+    std::vector<Op>              program;
+    std::vector<triton::uint512> values;
+    std::map<triton::usize, triton::engines::symbolic::SharedSymbolicVariable> vars;
+};
+
+
+/* Solver results by canonical query, shared by the threads. One line per
+ * entry in the file: `<key> sat <values>` or `<key> unsat`. */
+class SolverCache {
+  public:
+    struct Entry {
+      bool                         sat;
+      std::vector<triton::uint512> values;   /* Variables in order of appearance */
+    };
+
+    /* A missing file is an empty cache */
+    bool load(const std::string& path);
+
+    /* Entries added by other runs since the load are kept, the runs which
+     * share the file are serialized by a lock on <path>.lock */
+    bool save(const std::string& path);
+
+    bool find(const std::string& key, Entry* entry);
+    void insert(const std::string& key, const Entry& entry);
+
+  private:
+    std::mutex                   lock;
+    std::map<std::string, Entry> entries;
+    std::set<std::string>        added;
+
+    bool replace(const std::string& path, const std::map<std::string, Entry>& added);
+};
+
+
+/* Backends raced on each query, each one in its own thread with the timeout
+ * (in ms, 0 for none, only with a single backend). Each thread solves its own
+ * copy of the query, imported in a private context. The first sat or unsat
+ * answer is taken; a backend still running goes on in the background until
+ * its own timeout and only counts in the statistics. Without backends, the
+ * solver of the context is used with the timeout.
+ *
+ * The copies cost more than a small query, queries of less than `raceSize`
+ * operations only go to the first backend. */
+class SolverPortfolio {
+  public:
+    SolverPortfolio(const std::vector<triton::engines::solver::solver_e>& backends, uint32_t timeout, size_t raceSize = 256);
+
+    /* Joins the backends still running */
+    ~SolverPortfolio();
+
+    /* "z3" or "bitwuzla", SOLVER_INVALID if Triton is built without it */
+    static triton::engines::solver::solver_e backend(const std::string& name);
+    static const char* name(triton::engines::solver::solver_e backend);
+
+    /* Same as Context::getModel(), TIMEOUT if no backend answered in time.
+     * `size` is AstProgram::size() of the query, 0 if unknown. */
+    std::unordered_map<triton::usize, triton::engines::solver::SolverModel> getModel(triton::Context& ctx, const triton::ast::SharedAbstractNode& node, triton::engines::solver::status_e* status, size_t size = 0);
+
+    /* Latency of each backend. Waits for the backends still running when
+     * they have a timeout. */
+    void summary(std::ostream& out);
+
+  private:
+    struct Stats {
+      uint64_t queries;
+      uint64_t first;    /* Answers taken */
+      uint64_t unknown;  /* Timeouts included */
+      double   time;
+      double   max;
+    };
+
+    struct Worker {
+      std::thread thread;
+      bool        finished;
+    };
+
+    /* Shared with the threads, which may outlive the query */
+    struct Shared {
+      std::mutex                                           lock;
+      std::condition_variable                              done;
+      std::map<triton::engines::solver::solver_e, Stats>  stats;
+      uint32_t                                             running;
+      std::list<Worker>                                    workers; /* Joined once finished */
+    };
+
+    std::vector<triton::engines::solver::solver_e> backends;
+    uint32_t                                       timeout;
+    size_t                                         raceSize;
+    std::shared_ptr<Shared>                        shared;
+
+    static void account(Shared& shared, triton::engines::solver::solver_e backend, triton::engines::solver::status_e status, double elapsed, bool taken);
+};
+
+
+class SolverQueries {
+  public:
+    enum Outcome { CONSTANT, SAMPLED, CACHED, SAT, UNSAT, UNKNOWN, OUTCOMES };
+
+    SolverQueries(triton::Context& ctx, SolverCache* cache = nullptr, SolverPortfolio* solvers = nullptr, uint32_t samples = 32);
+
+    /* Same as Context::getModel(), the label names the query in the log */
+    std::unordered_map<triton::usize, triton::engines::solver::SolverModel> getModel(const triton::ast::SharedAbstractNode& node, triton::engines::solver::status_e* status, const std::string& label);
+
+    uint64_t total(void) const;
+    void summary(std::ostream& out) const;
+
+    /* One line per query: label, outcome and time */
+    void write(std::ostream& out) const;
+
+  private:
+    triton::Context&         ctx;
+    SolverCache*             cache;
+    SolverPortfolio*         solvers;
+    uint32_t                 samples;
+    uint64_t                 counts[OUTCOMES];
+    double                   times[OUTCOMES];
+    std::vector<std::string> lines;
+
+    void record(const std::string& label, Outcome outcome, double elapsed);
+};
+
+#endif /* SOLVER_QUERIES_H */
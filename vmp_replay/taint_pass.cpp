@@ -0,0 +1,117 @@
+#include "taint_pass.h"
+
+
+TaintPass::TaintPass() {
+  this->regs    = 0;
+  this->count   = 0;
+  this->missing = 0;
+}
+
+
+bool TaintPass::run(const std::string& path, uint32_t seeds) {
+  TraceReader reader;
+  uint32_t    reads      = 0;      /* Memory reads of the next instruction */
+  bool        readTaint  = false;
+  bool        taint      = false;  /* Taint of the last instruction, for its writes */
+  bool        needWrites = false;
+  bool        sawWrites  = false;
+  std::vector<uint64_t> flagWriters;  /* Skipped instructions the current flags come from */
+
+  this->regs = seeds;
+  this->memory.clear();
+  this->marks.clear();
+  this->count   = 0;
+  this->missing = 0;
+
+  if (!reader.open(path)) {
+    this->message = reader.error();
+    return false;
+  }
+
+  for (const TraceRecord& rec : reader) {
+    switch (rec.kind) {
+      case RECORD_MEMREAD:
+        reads++;
+        if (this->memory.any(rec.addr, rec.size))
+          readTaint = true;
+        break;
+
+      case RECORD_REGS:
+        break;
+
+      case RECORD_INST: {
+        if (!rec.uses) {
+          this->message = path + ": no register uses in the trace, record it with -uses";
+          return false;
+        }
+
+        uint32_t read    = rec.uses->read;
+        uint32_t written = rec.uses->written & ~VMPT_USE_MEMORY;
+
+        taint = readTaint || (read & this->regs);
+
+        /* The value read is not in the trace, it may be tainted */
+        if ((read & VMPT_USE_MEMORY) && !reads && !taint) {
+          taint = true;
+          this->missing++;
+        }
+
+        if (rec.uses->written & VMPT_USE_MEMORY)
+          needWrites = true;
+
+        /* The other registers share one bit, it is never cleared */
+        if (taint)
+          this->regs |= written;
+        else
+          this->regs &= ~(written & ~VMPT_USE_OTHER);
+
+        /* They are not synchronized with the trace either, the symbolic
+         * engine has to process every instruction which uses them */
+        bool process = taint || ((read | rec.uses->written) & VMPT_USE_OTHER);
+
+        /* The flags are not in the `r:` records: an instruction processed by
+         * the symbolic engine which reads them needs the skipped instructions
+         * which wrote them, they are recomputed from synchronized registers */
+        if (process && (read & VMPT_USE_FLAGS)) {
+          for (uint64_t writer : flagWriters) {
+            if (!this->marks[writer]) {
+              this->marks[writer] = true;
+              this->count++;
+            }
+          }
+          flagWriters.clear();
+        }
+        if (rec.uses->written & VMPT_USE_FLAGS) {
+          if (!(read & VMPT_USE_FLAGS))
+            flagWriters.clear();
+          if (!process)
+            flagWriters.push_back(this->marks.size());
+        }
+
+        this->marks.push_back(process);
+        this->count += process;
+
+        reads     = 0;
+        readTaint = false;
+        break;
+      }
+
+      case RECORD_MEMWRITE:
+        sawWrites = true;
+        this->memory.set(rec.addr, rec.size, taint);
+        break;
+    }
+  }
+
+  if (!reader.error().empty()) {
+    this->message = reader.error();
+    return false;
+  }
+
+  if (needWrites && !sawWrites) {
+    this->message = path + ": no memory writes in the trace, record it with -mw";
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,58 @@
+/*
+** Forward taint analysis of a VMP trace, to find the instructions which
+** depend on the inputs before giving the trace to a symbolic engine.
+**
+** The registers are a bitset (VMPT_USES layout) and the memory a shadow of
+** one bit per byte. The taint flows through the register uses recorded with
+** -uses and through the addresses of the `mr:` and `mw:` records, so the
+** trace has to be recorded with `-uses -mw`, and without `-dedup 1` to be
+** precise: an instruction whose memory read was deduplicated is considered
+** tainted. The flags are not synchronized from the trace, so the untainted
+** instructions which wrote the flags read by a tainted one are kept too.
+**
+**   TaintPass taint;
+**   if (!taint.run(path, (1 << 4) | (1 << 5)))   // rdi, rsi
+**     ... taint.error()
+**   if (taint.tainted(n)) ...                     // n-th instruction
+*/
+
+#ifndef TAINT_PASS_H
+#define TAINT_PASS_H
+
+#include "shadow_bits.h"
+#include "trace_reader.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+class TaintPass {
+  public:
+    TaintPass();
+
+    /* seeds is the mask of the registers tainted before the first instruction */
+    bool run(const std::string& path, uint32_t seeds);
+
+    /* Instructions the symbolic engine has to process: the ones which depend
+     * on the inputs and the ones which use untracked registers (SIMD, x87) */
+    bool tainted(uint64_t inst) const { return inst < this->marks.size() && this->marks[inst]; }
+
+    uint64_t numInstructions(void) const { return this->marks.size(); }
+    uint64_t numTainted(void) const { return this->count; }
+
+    /* Instructions considered tainted because their memory reads are missing */
+    uint64_t numMissingReads(void) const { return this->missing; }
+
+    const std::string& error(void) const { return this->message; }
+
+  private:
+    uint32_t          regs;     /* Tainted registers */
+    ShadowBits        memory;   /* Tainted bytes */
+    std::vector<bool> marks;
+    uint64_t          count;
+    uint64_t          missing;
+    std::string       message;
+};
+
+#endif /* TAINT_PASS_H */
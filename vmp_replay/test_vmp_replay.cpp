@@ -0,0 +1,230 @@
+/*
+** Checks of the native replayer which do not need a trace, run by
+** tests/test_vmp.py when Triton is installed:
+**
+**   $ make TRITON_DIR=/opt/triton test_vmp_replay && ./test_vmp_replay
+**
+** AstProgram must give the values of the SMT-LIB semantics on the corner
+** cases of the operations, the same as evaluate() (and as vmp_solver.run()).
+**
+** Paths are built in their own contexts, as they are replayed, and merged by
+** merge_paths(): with the inputs of a path, the merged expression must
+** evaluate to the return value of that path.
+*/
+
+#include "ast_merge.h"
+#include "solver_queries.h"
+
+#include <triton/ast.hpp>
+#include <triton/context.hpp>
+
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+/* 8-bit inputs x and y, the conditions of the virtual branches a path took
+ * and its return value */
+struct TestPath {
+  triton::Context                              ctx;
+  triton::ast::SharedAstContext                ast;
+  triton::ast::SharedAbstractNode              x;
+  triton::ast::SharedAbstractNode              y;
+  std::vector<triton::ast::SharedAbstractNode> branches;
+  triton::ast::SharedAbstractNode              ret;
+  triton::uint512                              inputs[2];
+
+  TestPath(triton::uint512 vx, triton::uint512 vy) : ctx(triton::arch::ARCH_X86_64) {
+    triton::engines::symbolic::SharedSymbolicVariable varx = this->ctx.newSymbolicVariable(8, "x");
+    triton::engines::symbolic::SharedSymbolicVariable vary = this->ctx.newSymbolicVariable(8, "y");
+
+    this->ctx.setConcreteVariableValue(varx, vx);
+    this->ctx.setConcreteVariableValue(vary, vy);
+    this->ast       = this->ctx.getAstContext();
+    this->x         = this->ast->variable(varx);
+    this->y         = this->ast->variable(vary);
+    this->inputs[0] = vx;
+    this->inputs[1] = vy;
+  }
+
+  /* The path took the branch where `flag` (a 1-bit node) is `value` */
+  void branch(const triton::ast::SharedAbstractNode& flag, triton::uint512 value) {
+    this->branches.push_back(this->ast->equal(flag, this->ast->bv(value, 1)));
+  }
+
+  /* Flags of the virtual branches of the checks */
+  triton::ast::SharedAbstractNode isZero(void) {
+    return this->ast->ite(this->ast->equal(this->x, this->ast->bv(0, 8)), this->ast->bv(1, 1), this->ast->bv(0, 1));
+  }
+
+  triton::ast::SharedAbstractNode isSmall(void) {
+    return this->ast->ite(this->ast->bvult(this->y, this->ast->bv(16, 8)), this->ast->bv(1, 1), this->ast->bv(0, 1));
+  }
+};
+
+
+static int failures = 0;
+
+
+static void check(const std::string& name, const triton::uint512& got, const triton::uint512& expected) {
+  if (got == expected)
+    return;
+  std::cout << "[-] " << name << ": 0x" << std::hex << got << ", expected 0x" << expected << std::dec << std::endl;
+  failures++;
+}
+
+
+typedef triton::ast::SharedAstContext   Ast;
+typedef triton::ast::SharedAbstractNode Node;
+
+
+/* Expression of the 8-bit x and y, x, y and value, as defined by SMT-LIB.
+ * The same as EVALUATIONS in tests/test_vmp.py. */
+struct Evaluation {
+  const char*                                               text;
+  std::function<Node(const Ast&, const Node&, const Node&)> expr;
+  uint64_t                                                  x;
+  uint64_t                                                  y;
+  uint64_t                                                  value;
+};
+
+
+static const Evaluation cases[] = {
+  {"bvudiv 5 0", [](const Ast& a, const Node& x, const Node& y) { return a->bvudiv(x, y); }, 0x05, 0x00, 0xff},
+  {"bvurem 5 0", [](const Ast& a, const Node& x, const Node& y) { return a->bvurem(x, y); }, 0x05, 0x00, 0x05},
+  {"bvsdiv -5 0", [](const Ast& a, const Node& x, const Node& y) { return a->bvsdiv(x, y); }, 0xfb, 0x00, 0x01},
+  {"bvsdiv 5 0", [](const Ast& a, const Node& x, const Node& y) { return a->bvsdiv(x, y); }, 0x05, 0x00, 0xff},
+  {"bvsdiv -128 -1", [](const Ast& a, const Node& x, const Node& y) { return a->bvsdiv(x, y); }, 0x80, 0xff, 0x80},
+  {"bvsrem -5 0", [](const Ast& a, const Node& x, const Node& y) { return a->bvsrem(x, y); }, 0xfb, 0x00, 0xfb},
+  {"bvsrem -5 3", [](const Ast& a, const Node& x, const Node& y) { return a->bvsrem(x, y); }, 0xfb, 0x03, 0xfe},
+  {"bvsmod -5 0", [](const Ast& a, const Node& x, const Node& y) { return a->bvsmod(x, y); }, 0xfb, 0x00, 0xfb},
+  {"bvsmod -5 3", [](const Ast& a, const Node& x, const Node& y) { return a->bvsmod(x, y); }, 0xfb, 0x03, 0x01},
+  {"bvsmod 5 -3", [](const Ast& a, const Node& x, const Node& y) { return a->bvsmod(x, y); }, 0x05, 0xfd, 0xff},
+  {"bvashr -128 1", [](const Ast& a, const Node& x, const Node& y) { return a->bvashr(x, y); }, 0x80, 0x01, 0xc0},
+  {"bvashr -128 8", [](const Ast& a, const Node& x, const Node& y) { return a->bvashr(x, y); }, 0x80, 0x08, 0xff},
+  {"bvashr -128 200", [](const Ast& a, const Node& x, const Node& y) { return a->bvashr(x, y); }, 0x80, 0xc8, 0xff},
+  {"bvashr 64 9", [](const Ast& a, const Node& x, const Node& y) { return a->bvashr(x, y); }, 0x40, 0x09, 0x00},
+  {"bvshl 1 8", [](const Ast& a, const Node& x, const Node& y) { return a->bvshl(x, y); }, 0x01, 0x08, 0x00},
+  {"bvlshr 128 8", [](const Ast& a, const Node& x, const Node& y) { return a->bvlshr(x, y); }, 0x80, 0x08, 0x00},
+  {"bvrol 0x81 1", [](const Ast& a, const Node& x, const Node& y) { return a->bvrol(x, 1); }, 0x81, 0x00, 0x03},
+  {"bvrol 0x81 9", [](const Ast& a, const Node& x, const Node& y) { return a->bvrol(x, 9); }, 0x81, 0x00, 0x03},
+  {"bvror 0x81 1", [](const Ast& a, const Node& x, const Node& y) { return a->bvror(x, 1); }, 0x81, 0x00, 0xc0},
+  {"bvror 0x81 0", [](const Ast& a, const Node& x, const Node& y) { return a->bvror(x, 0); }, 0x81, 0x00, 0x81},
+  {"extract 7 4 0xab", [](const Ast& a, const Node& x, const Node& y) { return a->extract(7, 4, x); }, 0xab, 0x00, 0x0a},
+  {"extract 0 0 0xab", [](const Ast& a, const Node& x, const Node& y) { return a->extract(0, 0, x); }, 0xab, 0x00, 0x01},
+  {"sx 8 0x80", [](const Ast& a, const Node& x, const Node& y) { return a->sx(8, x); }, 0x80, 0x00, 0xff80},
+  {"sx 8 0x7f", [](const Ast& a, const Node& x, const Node& y) { return a->sx(8, x); }, 0x7f, 0x00, 0x007f},
+  {"zx 8 0x80", [](const Ast& a, const Node& x, const Node& y) { return a->zx(8, x); }, 0x80, 0x00, 0x0080},
+  {"sx 4 (extract 3 0 0x0c)", [](const Ast& a, const Node& x, const Node& y) { return a->sx(4, a->extract(3, 0, x)); }, 0x0c, 0x00, 0xfc},
+};
+
+
+static void evaluations(void) {
+  triton::Context ctx(triton::arch::ARCH_X86_64);
+  triton::ast::SharedAstContext ast = ctx.getAstContext();
+  triton::engines::symbolic::SharedSymbolicVariable x = ctx.newSymbolicVariable(8, "x");
+  triton::engines::symbolic::SharedSymbolicVariable y = ctx.newSymbolicVariable(8, "y");
+
+  for (const Evaluation& e : cases) {
+    triton::ast::SharedAbstractNode node = e.expr(ast, ast->variable(x), ast->variable(y));
+    AstProgram program;
+
+    if (!program.compile(node)) {
+      std::cout << "[-] AstProgram: " << e.text << " is not compiled" << std::endl;
+      failures++;
+      continue;
+    }
+
+    ctx.setConcreteVariableValue(x, e.x);
+    ctx.setConcreteVariableValue(y, e.y);
+    check(std::string("AstProgram: ") + e.text, program.run({{x->getId(), e.x}, {y->getId(), e.y}}), e.value);
+    check(std::string("evaluate(): ") + e.text, node->evaluate(), e.value);
+  }
+}
+
+
+/* Merges the paths as vmp_replay does and evaluates the result with the
+ * inputs of every path */
+static void check_merge(const std::string& name, const std::vector<std::unique_ptr<TestPath>>& paths) {
+  triton::Context ctx(triton::arch::ARCH_X86_64);
+  AstImporter     importer(ctx);
+  triton::engines::symbolic::SharedSymbolicVariable x = ctx.newSymbolicVariable(8, "x");
+  triton::engines::symbolic::SharedSymbolicVariable y = ctx.newSymbolicVariable(8, "y");
+
+  importer.mapVariable("x", x);
+  importer.mapVariable("y", y);
+
+  std::vector<MergedPath> merged(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    merged[i].ret = importer.import(paths[i]->ret);
+    for (const auto& branch : paths[i]->branches)
+      merged[i].constraints.push_back(importer.import(branch));
+  }
+
+  triton::ast::SharedAbstractNode node = merge_paths(ctx.getAstContext(), merged);
+  for (size_t i = 0; i < paths.size(); ++i) {
+    ctx.setConcreteVariableValue(x, paths[i]->inputs[0]);
+    ctx.setConcreteVariableValue(y, paths[i]->inputs[1]);
+    check(name + ", path " + std::to_string(i + 1), node->evaluate(), paths[i]->ret->evaluate());
+  }
+}
+
+
+static void merges(void) {
+  std::vector<std::unique_ptr<TestPath>> two;
+  std::vector<std::unique_ptr<TestPath>> three;
+  std::vector<std::unique_ptr<TestPath>> prefix;
+  TestPath* p;
+
+  /* if (x == 0) x + y else x - y */
+  two.emplace_back(p = new TestPath(0, 5));
+  p->branch(p->isZero(), 1);
+  p->ret = p->ast->bvadd(p->x, p->y);
+  two.emplace_back(p = new TestPath(3, 1));
+  p->branch(p->isZero(), 0);
+  p->ret = p->ast->bvsub(p->x, p->y);
+  check_merge("two paths", two);
+
+  /* if (x == 0) y else if (y < 16) x * y else x ^ y */
+  three.emplace_back(p = new TestPath(0, 7));
+  p->branch(p->isZero(), 1);
+  p->ret = p->y;
+  three.emplace_back(p = new TestPath(3, 4));
+  p->branch(p->isZero(), 0);
+  p->branch(p->isSmall(), 1);
+  p->ret = p->ast->bvmul(p->x, p->y);
+  three.emplace_back(p = new TestPath(3, 0x20));
+  p->branch(p->isZero(), 0);
+  p->branch(p->isSmall(), 0);
+  p->ret = p->ast->bvxor(p->x, p->y);
+  check_merge("three paths", three);
+
+  /* The same, the last path has no branch after x != 0 */
+  prefix.emplace_back(p = new TestPath(0, 7));
+  p->branch(p->isZero(), 1);
+  p->ret = p->y;
+  prefix.emplace_back(p = new TestPath(3, 4));
+  p->branch(p->isZero(), 0);
+  p->branch(p->isSmall(), 1);
+  p->ret = p->ast->bvmul(p->x, p->y);
+  prefix.emplace_back(p = new TestPath(3, 0x20));
+  p->branch(p->isZero(), 0);
+  p->ret = p->ast->bvxor(p->x, p->y);
+  check_merge("three paths, one of them shorter", prefix);
+}
+
+
+int main(int argc, char* argv[]) {
+  evaluations();
+  merges();
+
+  if (failures) {
+    std::cout << "[-] " << failures << " checks failed" << std::endl;
+    return -1;
+  }
+  std::cout << "[+] All checks passed" << std::endl;
+  return 0;
+}
@@ -0,0 +1,60 @@
+/*
+** Parses traces with the native trace reader and reports its throughput.
+**
+**   $ ./trace_bench ../vmp_traces/sample3.vmp.trace ...
+*/
+
+#include "trace_reader.h"
+
+#include <chrono>
+#include <iostream>
+
+
+int main(int argc, char* argv[]) {
+  uint64_t total = 0;
+  double   time  = 0;
+
+  if (argc < 2) {
+    std::cout << "[!] Syntax: " << argv[0] << " <trace> [<trace> ...]" << std::endl;
+    return -1;
+  }
+
+  for (int i = 1; i < argc; ++i) {
+    TraceReader reader;
+    uint64_t count[RECORD_MEMWRITE + 1] = {0};
+    uint64_t checksum = 0;
+
+    if (!reader.open(argv[i])) {
+      std::cout << "[-] " << reader.error() << std::endl;
+      return -1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (const TraceRecord& rec : reader) {
+      count[rec.kind]++;
+      /* Keeps the decoding from being optimized out. Only the fields of
+       * the kind are set, the others are left over from previous records. */
+      switch (rec.kind) {
+        case RECORD_MEMREAD:
+        case RECORD_MEMWRITE: checksum += rec.addr + rec.value; break;
+        case RECORD_REGS:     checksum += rec.regs[0]; break;
+        case RECORD_INST:     checksum += rec.addr; break;
+      }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (!reader.error().empty()) {
+      std::cout << "[-] " << reader.error() << std::endl;
+      return -1;
+    }
+
+    std::cout << "[+] " << argv[i] << ": " << count[RECORD_INST] << " inst, " << count[RECORD_REGS] << " regs, "
+              << count[RECORD_MEMREAD] << " mr, " << count[RECORD_MEMWRITE] << " mw, "
+              << (reader.size() / elapsed / (1 << 20)) << " MiB/s (checksum " << std::hex << checksum << std::dec << ")" << std::endl;
+    total += reader.size();
+    time  += elapsed;
+  }
+
+  std::cout << "[+] Total: " << (total >> 20) << " MiB in " << time << " s, " << (total / time / (1 << 20)) << " MiB/s" << std::endl;
+  return 0;
+}
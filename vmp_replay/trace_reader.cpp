@@ -0,0 +1,350 @@
+#include "trace_reader.h"
+#include "simd_scan.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+static const char lz4_magic[] = "\x04\x22\x4d\x18";
+
+
+TraceReader::TraceReader() {
+  this->base      = nullptr;
+  this->cur       = nullptr;
+  this->limit     = nullptr;
+  this->length    = 0;
+  this->binary    = false;
+  this->regsValid = false;
+  this->pending   = false;
+  std::memset(this->regs, 0, sizeof(this->regs));
+  std::memset(this->prevField, 0, sizeof(this->prevField));
+  std::memset(this->prevSize, 0, sizeof(this->prevSize));
+}
+
+
+TraceReader::~TraceReader() {
+  this->close();
+}
+
+
+void TraceReader::close(void) {
+  if (this->base)
+    munmap(const_cast<char*>(this->base), this->length);
+  this->base = nullptr;
+}
+
+
+bool TraceReader::fail(const std::string& message) {
+  this->message = this->path + ": " + message;
+  this->cur = this->limit;
+  return false;
+}
+
+
+bool TraceReader::open(const std::string& path) {
+  struct stat st;
+
+  this->close();
+  this->path = path;
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return this->fail("can not open the trace");
+
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    ::close(fd);
+    return this->fail("empty trace");
+  }
+
+  void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED)
+    return this->fail("can not map the trace");
+
+  this->base   = static_cast<const char*>(map);
+  this->length = st.st_size;
+  this->cur    = this->base;
+  this->limit  = this->base + this->length;
+  madvise(map, this->length, MADV_SEQUENTIAL);
+  madvise(map, this->length, MADV_WILLNEED);
+
+  if (this->length >= 4 && !std::memcmp(this->base, lz4_magic, 4))
+    return this->fail("compressed trace, decompress it first (lz4 -d)");
+  if (this->length >= 4 && !std::memcmp(this->base, VMPC_MAGIC, 4))
+    return this->fail("columnar trace, convert it first (vmp_trace.py --to-binary)");
+
+  this->binary = (this->length >= sizeof(VMPT_HEADER) && !std::memcmp(this->base, VMPT_MAGIC, 4));
+  if (!this->binary)
+    return true;
+
+  VMPT_HEADER header;
+  std::memcpy(&header, this->base, sizeof(header));
+  if (header.version > VMPT_VERSION)
+    return this->fail("unsupported trace version " + std::to_string(header.version));
+  this->cur += sizeof(header);
+  return true;
+}
+
+
+void TraceReader::setUses(TraceRecord* rec) {
+  if (this->pending) {
+    if (rec->id >= this->uses.size()) {
+      this->uses.resize(rec->id + 1024);
+      this->usesKnown.resize(rec->id + 1024, false);
+    }
+    this->uses[rec->id]      = this->pendingUses;
+    this->usesKnown[rec->id] = true;
+    this->pending = false;
+  }
+
+  rec->uses = (rec->id < this->uses.size() && this->usesKnown[rec->id]) ? &this->uses[rec->id] : nullptr;
+}
+
+
+bool TraceReader::next(TraceRecord* rec) {
+  if (this->binary)
+    return this->nextBinary(rec);
+  return this->nextText(rec);
+}
+
+
+bool TraceReader::nextBinary(TraceRecord* rec) {
+  while (this->cur < this->limit) {
+    const char* p    = this->cur;
+    uint8_t     kind = *p++;
+
+    rec->raw = this->cur;
+
+    switch (kind) {
+      case VMPT_REC_MEMREAD:
+      case VMPT_REC_MEMWRITE: {
+        VMPT_MEMREAD mem;
+        if (this->limit - p < static_cast<ptrdiff_t>(sizeof(mem)))
+          return this->fail("truncated trace");
+        std::memcpy(&mem, p, sizeof(mem));
+        this->cur    = p + sizeof(mem);
+        rec->kind    = (kind == VMPT_REC_MEMREAD) ? RECORD_MEMREAD : RECORD_MEMWRITE;
+        rec->rawSize = this->cur - rec->raw;
+        rec->addr    = mem.addr;
+        rec->size    = mem.size;
+        rec->value   = mem.value;
+        return true;
+      }
+
+      case VMPT_REC_REGS:
+      case VMPT_REC_REGS_DELTA: {
+        uint16_t mask = 0xffff;
+        if (kind == VMPT_REC_REGS_DELTA) {
+          if (this->limit - p < static_cast<ptrdiff_t>(sizeof(VMPT_REGS_DELTA)))
+            return this->fail("truncated trace");
+          std::memcpy(&mask, p, sizeof(mask));
+          p += sizeof(VMPT_REGS_DELTA);
+        }
+        if (this->limit - p < static_cast<ptrdiff_t>(__builtin_popcount(mask) * sizeof(uint64_t)))
+          return this->fail("truncated trace");
+
+        rec->kind = RECORD_REGS;
+        rec->mask = 0;
+        for (uint32_t i = 0; i < VMPT_NUM_REGS; ++i) {
+          if (!(mask & (1 << i)))
+            continue;
+          uint64_t value;
+          std::memcpy(&value, p, sizeof(value));
+          p += sizeof(value);
+          if (!this->regsValid || value != this->regs[i])
+            rec->mask |= (1 << i);
+          this->regs[i] = value;
+        }
+        this->regsValid = true;
+        this->cur    = p;
+        rec->rawSize = this->cur - rec->raw;
+        rec->regs    = this->regs;
+        return true;
+      }
+
+      case VMPT_REC_CODE: {
+        if (this->limit - p < static_cast<ptrdiff_t>(sizeof(VMPT_CODE)))
+          return this->fail("truncated trace");
+        const VMPT_CODE* code = reinterpret_cast<const VMPT_CODE*>(p);
+        if (code->size > VMPT_MAX_INST_SIZE)
+          return this->fail("bad instruction in the code dictionary");
+        uint32_t id;
+        std::memcpy(&id, &code->id, sizeof(id));
+        if (id >= this->codes.size())
+          this->codes.resize(id + 1024, nullptr);
+        this->codes[id] = code;
+        this->cur = p + sizeof(VMPT_CODE);
+        continue;
+      }
+
+      case VMPT_REC_USES: {
+        if (this->limit - p < static_cast<ptrdiff_t>(sizeof(VMPT_USES)))
+          return this->fail("truncated trace");
+        std::memcpy(&this->pendingUses, p, sizeof(VMPT_USES));
+        this->pending = true;
+        this->cur = p + sizeof(VMPT_USES);
+        continue;
+      }
+
+      case VMPT_REC_EXEC: {
+        uint32_t id;
+        if (this->limit - p < static_cast<ptrdiff_t>(sizeof(VMPT_EXEC)))
+          return this->fail("truncated trace");
+        std::memcpy(&id, p, sizeof(id));
+        if (id >= this->codes.size() || !this->codes[id])
+          return this->fail("unknown code id " + std::to_string(id));
+        const VMPT_CODE* code = this->codes[id];
+        this->cur    = p + sizeof(VMPT_EXEC);
+        rec->kind    = RECORD_INST;
+        rec->rawSize = this->cur - rec->raw;
+        rec->id      = id;
+        std::memcpy(&rec->addr, &code->addr, sizeof(rec->addr));
+        rec->size    = code->size;
+        rec->bytes   = code->bytes;
+        this->setUses(rec);
+        return true;
+      }
+
+      /* Traces older than version 3 carry the opcode on every execution */
+      case VMPT_REC_INST: {
+        if (this->limit - p < static_cast<ptrdiff_t>(sizeof(VMPT_INST)))
+          return this->fail("truncated trace");
+        const VMPT_INST* inst = reinterpret_cast<const VMPT_INST*>(p);
+        if (inst->size > VMPT_MAX_INST_SIZE)
+          return this->fail("bad instruction");
+        std::string_view key(p, sizeof(inst->addr) + sizeof(inst->size) + inst->size);
+        auto it = this->ids.find(key);
+        if (it == this->ids.end())
+          it = this->ids.emplace(key, this->ids.size()).first;
+        this->cur    = p + sizeof(VMPT_INST);
+        rec->kind    = RECORD_INST;
+        rec->rawSize = this->cur - rec->raw;
+        rec->id      = it->second;
+        std::memcpy(&rec->addr, &inst->addr, sizeof(rec->addr));
+        rec->size    = inst->size;
+        rec->bytes   = inst->bytes;
+        rec->uses    = nullptr;
+        return true;
+      }
+
+      default:
+        return this->fail("unknown record kind " + std::to_string(kind));
+    }
+  }
+
+  return false;
+}
+
+
+static uint32_t parse_dec(const char* p, const char* end) {
+  uint32_t value = 0;
+  for (; p < end; ++p)
+    value = value * 10 + (*p - '0');
+  return value;
+}
+
+
+/* Hexadecimal field, with or without 0x */
+static inline uint64_t parse_hex(const char* p, const char* end, const char* base) {
+  if (end - p >= 2 && p[0] == '0' && (p[1] | 0x20) == 'x')
+    p += 2;
+  return hex_decode(p, end, base);
+}
+
+
+bool TraceReader::nextText(TraceRecord* rec) {
+  while (this->cur < this->limit) {
+    const char* line = this->cur;
+    const char* eol  = scan_byte(line, this->limit, '\n');
+
+    this->cur    = (eol < this->limit) ? eol + 1 : eol;
+    rec->raw     = line;
+    rec->rawSize = eol - line;
+
+    if (eol - line >= 3 && line[0] == 'm' && (line[1] == 'r' || line[1] == 'w') && line[2] == ':') {
+      const char* f1 = line + 3;
+      const char* e1 = scan_byte(f1, eol, ':');
+      const char* e2 = scan_byte(e1 + 1, eol, ':');
+      if (e2 >= eol)
+        return this->fail("bad memory record: " + std::string(line, eol));
+      rec->kind  = (line[1] == 'r') ? RECORD_MEMREAD : RECORD_MEMWRITE;
+      rec->addr  = parse_hex(f1, e1, this->base);
+      rec->size  = parse_dec(e1 + 1, e2);
+      rec->value = parse_hex(e2 + 1, eol, this->base);
+      return true;
+    }
+
+    if (eol - line >= 2 && line[0] == 'r' && line[1] == ':') {
+      const char* field = line + 2;
+      rec->kind = RECORD_REGS;
+      rec->mask = 0;
+      for (uint32_t i = 0; i < VMPT_NUM_REGS; ++i) {
+        if (field > eol)
+          return this->fail("bad register record: " + std::string(line, eol));
+        const char* end = scan_byte(field, eol, ':');
+        size_t size = end - field;
+
+        /* Only decode the registers whose text changed */
+        if (!this->regsValid || size != this->prevSize[i] || std::memcmp(field, this->prevField[i], size)) {
+          uint64_t value = parse_hex(field, end, this->base);
+          if (!this->regsValid || value != this->regs[i])
+            rec->mask |= (1 << i);
+          this->regs[i] = value;
+        }
+        this->prevField[i] = field;
+        this->prevSize[i]  = size;
+        field = end + 1;
+      }
+      this->regsValid = true;
+      rec->regs = this->regs;
+      return true;
+    }
+
+    if (eol - line >= 2 && line[0] == 'i' && line[1] == ':') {
+      /* Only decode the first execution of an instruction */
+      std::string_view key(line + 2, eol - line - 2);
+      auto it = this->ids.find(key);
+      if (it == this->ids.end()) {
+        const char* e1 = scan_byte(line + 2, eol, ':');
+        const char* e2 = scan_byte(e1 + 1, eol, ':');
+        VMPT_CODE code;
+        std::memset(&code, 0, sizeof(code));
+        code.id   = this->decoded.size();
+        code.addr = parse_hex(line + 2, e1, this->base);
+        code.size = parse_dec(e1 + 1, e2);
+        if (e2 >= eol || code.size > VMPT_MAX_INST_SIZE || eol - e2 - 1 < static_cast<ptrdiff_t>(2 * code.size))
+          return this->fail("bad instruction: " + std::string(line, eol));
+        for (uint32_t i = 0; i < code.size; ++i)
+          code.bytes[i] = hex_scalar(e2 + 1 + 2 * i, e2 + 3 + 2 * i);
+        this->decoded.push_back(code);
+        it = this->ids.emplace(key, code.id).first;
+      }
+
+      const VMPT_CODE& code = this->decoded[it->second];
+      rec->kind  = RECORD_INST;
+      rec->id    = code.id;
+      rec->addr  = code.addr;
+      rec->size  = code.size;
+      rec->bytes = code.bytes;
+      this->setUses(rec);
+      return true;
+    }
+
+    if (eol - line >= 2 && line[0] == 'u' && line[1] == ':') {
+      const char* e1 = scan_byte(line + 2, eol, ':');
+      if (e1 >= eol)
+        return this->fail("bad register uses: " + std::string(line, eol));
+      this->pendingUses.read    = parse_hex(line + 2, e1, this->base);
+      this->pendingUses.written = parse_hex(e1 + 1, eol, this->base);
+      this->pending = true;
+      continue;
+    }
+
+    /* Empty lines and anything else are ignored, like vmp_trace.py */
+  }
+
+  return false;
+}
@@ -0,0 +1,140 @@
+/*
+** Reader of the VMP traces generated by the VMP_Trace Pintool, for native
+** tools. It reads the text format and the (uncompressed) binary format
+** described in vmp_trace_format.h, the same records as `vmp_trace.py`.
+**
+** The trace is memory mapped and records are decoded in place: lines are
+** split with vectorized byte scans, hexadecimal fields are decoded with SIMD
+** and only the registers whose text changed since the previous `r:` line are
+** decoded. Records point into the mapping (or into the reader) instead of
+** copying, they are valid until the next record.
+**
+**   TraceReader reader;
+**   if (!reader.open(path)) ...
+**   for (const TraceRecord& rec : reader) ...
+**   if (!reader.error().empty()) ...
+*/
+
+#ifndef TRACE_READER_H
+#define TRACE_READER_H
+
+#include "vmp_trace_format.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+
+enum TraceRecordKind {
+  RECORD_MEMREAD,
+  RECORD_REGS,
+  RECORD_INST,
+  RECORD_MEMWRITE,
+};
+
+
+struct TraceRecord {
+  TraceRecordKind kind;
+
+  /* The record as stored in the trace (a line without its newline for text traces) */
+  const char*     raw;
+  size_t          rawSize;
+
+  /* RECORD_MEMREAD, RECORD_MEMWRITE */
+  uint64_t        addr;
+  uint32_t        size;
+  uint64_t        value;
+
+  /* RECORD_REGS: the full register file, mask gives the registers which
+   * changed since the previous RECORD_REGS */
+  uint16_t        mask;
+  const uint64_t* regs;
+
+  /* RECORD_INST (addr and size are set too). id is unique to the
+   * (address, opcode) pair. uses is null if the trace was recorded
+   * without -uses. */
+  uint32_t        id;
+  const uint8_t*  bytes;
+  const VMPT_USES* uses;
+};
+
+
+class TraceReader {
+  public:
+    class iterator {
+      public:
+        iterator(TraceReader* reader) : reader(reader) { this->advance(); }
+
+        const TraceRecord& operator*() const { return this->rec; }
+        const TraceRecord* operator->() const { return &this->rec; }
+        iterator& operator++() { this->advance(); return *this; }
+        bool operator!=(const iterator& other) const { return this->reader != other.reader; }
+
+      private:
+        TraceReader* reader;    /* nullptr at the end */
+        TraceRecord  rec;
+
+        void advance(void) {
+          if (this->reader && !this->reader->next(&this->rec))
+            this->reader = nullptr;
+        }
+    };
+
+    TraceReader();
+    ~TraceReader();
+
+    /* Returns false if the trace can not be read, see error() */
+    bool open(const std::string& path);
+
+    /* Returns false at the end of the trace or on error */
+    bool next(TraceRecord* rec);
+
+    iterator begin(void) { return iterator(this); }
+    iterator end(void) { return iterator(nullptr); }
+
+    const std::string& error(void) const { return this->message; }
+
+    /* Size of the mapped trace */
+    size_t size(void) const { return this->length; }
+
+  private:
+    std::string   path;
+    std::string   message;
+    const char*   base;
+    const char*   cur;
+    const char*   limit;
+    size_t        length;
+    bool          binary;
+    uint64_t      regs[VMPT_NUM_REGS];
+    bool          regsValid;
+
+    /* Text: fields of the previous `r:` line */
+    const char*   prevField[VMPT_NUM_REGS];
+    size_t        prevSize[VMPT_NUM_REGS];
+
+    /* Binary: code dictionary, in the mapping */
+    std::vector<const VMPT_CODE*> codes;
+
+    /* Text and legacy binary: ids and opcodes of the instructions, keyed by
+     * their text after `i:` (or address and opcode) in the mapping */
+    std::unordered_map<std::string_view, uint32_t> ids;
+    std::vector<VMPT_CODE>                         decoded;
+
+    /* Register uses by code id, the last `u:` record is given to the next
+     * instruction */
+    std::vector<VMPT_USES> uses;
+    std::vector<bool>      usesKnown;
+    VMPT_USES              pendingUses;
+    bool                   pending;
+
+    bool nextBinary(TraceRecord* rec);
+    bool nextText(TraceRecord* rec);
+    void setUses(TraceRecord* rec);
+    bool fail(const std::string& message);
+    void close(void);
+};
+
+#endif /* TRACE_READER_H */
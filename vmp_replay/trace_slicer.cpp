@@ -0,0 +1,124 @@
+#include "trace_slicer.h"
+
+
+TraceSlicer::TraceSlicer() {
+  this->count = 0;
+}
+
+
+bool TraceSlicer::log(const std::string& path, const Criterion& criterion) {
+  TraceReader reader;
+  uint16_t    reads      = 0;     /* Memory reads of the next instruction */
+  bool        needWrites = false;
+  bool        sawWrites  = false;
+
+  if (!reader.open(path)) {
+    this->message = reader.error();
+    return false;
+  }
+
+  for (const TraceRecord& rec : reader) {
+    switch (rec.kind) {
+      case RECORD_MEMREAD:
+        this->accesses.push_back({rec.addr, rec.size});
+        reads++;
+        break;
+
+      case RECORD_REGS:
+        break;
+
+      case RECORD_INST: {
+        if (!rec.uses) {
+          this->message = path + ": no register uses in the trace, record it with -uses";
+          return false;
+        }
+
+        Step step;
+        step.read      = rec.uses->read;
+        step.written   = rec.uses->written;
+        step.reads     = reads;
+        step.writes    = 0;
+        step.criterion = criterion(rec);
+        this->steps.push_back(step);
+
+        if (step.written & VMPT_USE_MEMORY)
+          needWrites = true;
+        reads = 0;
+        break;
+      }
+
+      case RECORD_MEMWRITE:
+        sawWrites = true;
+        if (this->steps.empty())
+          break;
+        this->accesses.push_back({rec.addr, rec.size});
+        this->steps.back().writes++;
+        break;
+    }
+  }
+
+  if (!reader.error().empty()) {
+    this->message = reader.error();
+    return false;
+  }
+
+  if (needWrites && !sawWrites) {
+    this->message = path + ": no memory writes in the trace, record it with -mw";
+    return false;
+  }
+
+  /* Reads after the last instruction */
+  this->accesses.resize(this->accesses.size() - reads);
+  return true;
+}
+
+
+bool TraceSlicer::run(const std::string& path, uint32_t live, const Criterion& criterion) {
+  ShadowBits memory;    /* Live bytes */
+  uint32_t   regs = live;
+
+  this->steps.clear();
+  this->accesses.clear();
+  this->marks.clear();
+  this->count = 0;
+
+  if (!this->log(path, criterion))
+    return false;
+
+  this->marks.resize(this->steps.size(), false);
+
+  size_t pos = this->accesses.size();
+  for (size_t i = this->steps.size(); i-- > 0; ) {
+    const Step& step    = this->steps[i];
+    size_t      writes  = pos - step.writes;
+    size_t      reads   = writes - step.reads;
+
+    bool needed = step.criterion || (step.written & regs) || ((step.read | step.written) & VMPT_USE_OTHER);
+    for (size_t j = writes; j < pos && !needed; ++j)
+      needed = memory.any(this->accesses[j].addr, this->accesses[j].size);
+
+    if (needed) {
+      if ((step.read & VMPT_USE_MEMORY) && !step.reads) {
+        this->message = path + ": instruction " + std::to_string(i) + " of the slice reads memory which is not in the trace, record it without -dedup 1";
+        return false;
+      }
+
+      /* Its outputs are defined here, its inputs are live before */
+      regs = (regs & ~step.written) | (step.read & ~VMPT_USE_MEMORY);
+      for (size_t j = writes; j < pos; ++j)
+        memory.set(this->accesses[j].addr, this->accesses[j].size, false);
+      for (size_t j = reads; j < writes; ++j)
+        memory.set(this->accesses[j].addr, this->accesses[j].size, true);
+
+      this->marks[i] = true;
+      this->count++;
+    }
+
+    pos = reads;
+  }
+
+  /* Only the marks are needed by the replayer */
+  std::vector<Step>().swap(this->steps);
+  std::vector<Access>().swap(this->accesses);
+  return true;
+}
@@ -0,0 +1,73 @@
+/*
+** Backward dynamic slice of a VMP trace: the instructions whose results flow
+** into the registers live at the end of the trace (rax for the return value)
+** or into the instructions chosen by a criterion (virtual branches).
+**
+** The trace is read once to log the register uses (-uses) and the memory
+** accesses of every instruction, the log is then walked backward with the
+** live registers as a bitset and the live memory as a shadow. Like the taint
+** pass, the trace has to be recorded with `-uses -mw` and without `-dedup 1`,
+** a memory read of the slice which is not in the trace is an error.
+**
+**   TraceSlicer slicer;
+**   if (!slicer.run(path, 1 << 0, [](const TraceRecord& rec) { return false; }))
+**     ... slicer.error()
+**   if (slicer.inSlice(n)) ...                    // n-th instruction
+*/
+
+#ifndef TRACE_SLICER_H
+#define TRACE_SLICER_H
+
+#include "shadow_bits.h"
+#include "trace_reader.h"
+
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+class TraceSlicer {
+  public:
+    /* Instructions whose inputs must be computed, whatever they write */
+    typedef std::function<bool(const TraceRecord&)> Criterion;
+
+    TraceSlicer();
+
+    /* live is the mask (VMPT_USES layout) of the registers used after the
+     * last instruction */
+    bool run(const std::string& path, uint32_t live, const Criterion& criterion);
+
+    /* Instructions using untracked registers (SIMD, x87) are always in the slice */
+    bool inSlice(uint64_t inst) const { return inst < this->marks.size() && this->marks[inst]; }
+
+    uint64_t numInstructions(void) const { return this->marks.size(); }
+    uint64_t numSliced(void) const { return this->count; }
+
+    const std::string& error(void) const { return this->message; }
+
+  private:
+    /* One per instruction of the trace */
+    struct Step {
+      uint32_t read;
+      uint32_t written;
+      uint16_t reads;       /* mr records before the instruction */
+      uint16_t writes;      /* mw records after it */
+      bool     criterion;
+    };
+
+    struct Access {
+      uint64_t addr;
+      uint32_t size;
+    };
+
+    std::vector<Step>   steps;
+    std::vector<Access> accesses;  /* In trace order */
+    std::vector<bool>   marks;
+    uint64_t            count;
+    std::string         message;
+
+    bool log(const std::string& path, const Criterion& criterion);
+};
+
+#endif /* TRACE_SLICER_H */
@@ -0,0 +1,690 @@
+/*
+** Native replayer of VMP traces, built on the C++ API of Triton.
+**
+** Same analysis and same command line as `attack_vmp.py`: the inputs are
+** symbolized on the first instruction of the trace, registers and memory are
+** synchronized with the trace, virtual jumps are detected, traces can be
+** merged on a virtual branch and the return value is synthesized and lifted
+** to LLVM IR.
+**
+**   $ ./vmp_replay --trace1 ../vmp_traces/sample2.vmp.trace --symsize 4
+**
+** More than two traces can be merged (--trace, repeated): every trace is
+** replayed in its own Triton context by a pool of --jobs threads, then their
+** return values are merged into a decision tree over the virtual branches
+** they took (see ast_merge.h).
+**
+** With --taint, a forward taint pass over the trace first finds the
+** instructions which depend on the inputs (see taint_pass.h), only these are
+** processed by Triton. With --slice, only the backward slice of rax and of
+** the virtual branches is (see trace_slicer.h). Both can be combined, the
+** trace must be recorded with -uses -mw, without -dedup 1.
+*/
+
+#include "ast_merge.h"
+#include "solver_queries.h"
+#include "taint_pass.h"
+#include "trace_reader.h"
+#include "trace_slicer.h"
+
+#include <triton/ast.hpp>
+#include <triton/context.hpp>
+#include <triton/exceptions.hpp>
+#include <triton/x86Specifications.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+struct Options {
+  std::string trace1;
+  std::string trace2;
+  std::vector<std::string> traces;  /* Merged after trace2 */
+  uint32_t    jobs;
+  std::string solverLog;
+  std::string solverCache;
+  std::vector<triton::engines::solver::solver_e> solvers;  /* Raced on each query */
+  uint32_t    solverTimeout;                               /* ms */
+  uint32_t    symsize;
+  uint64_t    vbraddr;
+  std::string vbrflag;
+  uint32_t    check;
+  bool        taint;
+  bool        slice;
+};
+
+
+/* A trace replayed in its own context */
+struct Path {
+  int                                          execid;
+  std::string                                  trace;
+  triton::Context                              ctx;
+  SolverQueries                                queries; /* Of detecting_vjmp() */
+  triton::ast::SharedAbstractNode              ret;
+  std::vector<triton::ast::SharedAbstractNode> v_jmp;   /* Virtual branches taken */
+  std::ostringstream                           buffer;
+  std::ostream*                                out;     /* std::cout, or buffer for the worker threads */
+
+  Path(int execid, const std::string& trace, SolverCache* cache, SolverPortfolio* solvers)
+    : execid(execid), trace(trace), ctx(triton::arch::ARCH_X86_64), queries(ctx, cache, solvers), out(&this->buffer) {}
+};
+
+/* Same order as the registers of a VMP trace */
+static const triton::arch::register_e trace_regs[VMPT_NUM_REGS] = {
+  triton::arch::ID_REG_X86_RAX, triton::arch::ID_REG_X86_RBX, triton::arch::ID_REG_X86_RCX, triton::arch::ID_REG_X86_RDX,
+  triton::arch::ID_REG_X86_RDI, triton::arch::ID_REG_X86_RSI, triton::arch::ID_REG_X86_RBP, triton::arch::ID_REG_X86_RSP,
+  triton::arch::ID_REG_X86_R8,  triton::arch::ID_REG_X86_R9,  triton::arch::ID_REG_X86_R10, triton::arch::ID_REG_X86_R11,
+  triton::arch::ID_REG_X86_R12, triton::arch::ID_REG_X86_R13, triton::arch::ID_REG_X86_R14, triton::arch::ID_REG_X86_R15,
+};
+
+
+/* Index of a GPR in the trace, -1 for the other registers */
+static int gpr_index(triton::arch::register_e id) {
+  for (int i = 0; i < VMPT_NUM_REGS; ++i) {
+    if (trace_regs[i] == id)
+      return i;
+  }
+  return -1;
+}
+
+
+/* Only registers changed by Pin or written by Triton since the last
+ * synchronization may differ, the others are already in sync. */
+static void sync_reg(triton::Context& ctx, const uint64_t* pin_regs, uint32_t* dirty) {
+  for (uint32_t i = 0; i < VMPT_NUM_REGS; ++i) {
+    if (!(*dirty & (1 << i)))
+      continue;
+    const triton::arch::Register& reg = ctx.getRegister(trace_regs[i]);
+    if (ctx.getConcreteRegisterValue(reg) != pin_regs[i])
+      ctx.setConcreteRegisterValue(reg, pin_regs[i]);
+  }
+  *dirty = 0;
+}
+
+
+/* Mask of the GPRs written by the instruction */
+static uint32_t written_gpr(triton::Context& ctx, triton::arch::Instruction& inst) {
+  uint32_t dirty = 0;
+
+  for (const auto& written : inst.getWrittenRegisters()) {
+    int i = gpr_index(ctx.getParentRegister(written.first).getId());
+    if (i >= 0)
+      dirty |= (1 << i);
+  }
+  return dirty;
+}
+
+
+/* Flags of VMPT_USE_FLAGS, DF included */
+static const triton::arch::register_e trace_flags[] = {
+  triton::arch::ID_REG_X86_CF, triton::arch::ID_REG_X86_PF, triton::arch::ID_REG_X86_AF, triton::arch::ID_REG_X86_ZF,
+  triton::arch::ID_REG_X86_SF, triton::arch::ID_REG_X86_DF, triton::arch::ID_REG_X86_OF,
+};
+
+
+/* An instruction skipped by the taint pass does not depend on the inputs, one
+ * out of the slice does not matter. The next `r:` and `mr:` records give the
+ * concrete values it wrote to the registers and the memory, but the
+ * expressions of the previous writers have to be dropped. The flags are not
+ * in the trace: their concrete values are stale until the next processed
+ * writer, so the taint pass and the slicer keep the writers of the flags
+ * read by a processed instruction. */
+static void skip_inst(triton::Context& ctx, const VMPT_USES* uses) {
+  for (uint32_t i = 0; i < VMPT_NUM_REGS; ++i) {
+    if (uses->written & (1 << i))
+      ctx.concretizeRegister(ctx.getRegister(trace_regs[i]));
+  }
+
+  if (uses->written & VMPT_USE_FLAGS) {
+    for (triton::arch::register_e flag : trace_flags)
+      ctx.concretizeRegister(ctx.getRegister(flag));
+  }
+}
+
+
+/* Memory written by a skipped instruction */
+static void skip_write(triton::Context& ctx, const TraceRecord& rec) {
+  triton::arch::MemoryAccess memory(rec.addr, rec.size);
+  ctx.concretizeMemory(memory);
+  ctx.setConcreteMemoryValue(memory, rec.value);
+}
+
+
+static void sync_memory(triton::Context& ctx, const TraceRecord& rec) {
+  triton::arch::MemoryAccess memory(rec.addr, rec.size);
+  if (ctx.getConcreteMemoryValue(memory) != rec.value)
+    ctx.setConcreteMemoryValue(memory, rec.value);
+}
+
+
+/* A write replayed by Triton must give the value seen by Pin */
+static bool check_memory(triton::Context& ctx, const TraceRecord& rec) {
+  triton::arch::MemoryAccess memory(rec.addr, rec.size);
+  if (ctx.getConcreteMemoryValue(memory) == rec.value)
+    return true;
+  ctx.setConcreteMemoryValue(memory, rec.value);
+  return false;
+}
+
+
+static size_t num_variables(const triton::ast::SharedAbstractNode& node) {
+  return triton::ast::search(node, triton::ast::VARIABLE_NODE).size();
+}
+
+
+/* Same output as printing the model dict in python */
+static std::string format_model(const std::unordered_map<triton::usize, triton::engines::solver::SolverModel>& model) {
+  std::ostringstream out;
+  bool first = true;
+
+  out << "{";
+  for (const auto& item : model) {
+    out << (first ? "" : ", ") << item.first << ": " << item.second;
+    first = false;
+  }
+  out << "}";
+  return out.str();
+}
+
+
+/* Looks for a flag which can take another value with other inputs */
+static void flip_flag(Path& path, triton::arch::Instruction& inst, triton::arch::register_e id, const char* message) {
+  triton::Context& ctx = path.ctx;
+  triton::ast::SharedAstContext ast = ctx.getAstContext();
+  triton::ast::SharedAbstractNode flag = ctx.getRegisterAst(ctx.getRegister(id));
+
+  if (num_variables(flag) != 2)
+    return;
+
+  triton::engines::solver::status_e status;
+  std::ostringstream label;
+  label << "0x" << std::hex << inst.getAddress() << " " << ctx.getRegister(id).getName();
+  auto model = path.queries.getModel(ast->distinct(flag, ast->bv(flag->evaluate(), flag->getBitvectorSize())), &status, label.str());
+  if (status == triton::engines::solver::SAT)
+    *path.out << "[+] A potential symbolic jump found " << message << ": " << inst << " - Model: " << format_model(model) << std::endl;
+  else if (status != triton::engines::solver::UNSAT)
+    *path.out << "[!] No answer from the solver " << message << ": " << inst << (status == triton::engines::solver::TIMEOUT ? " (timeout)" : " (unknown)") << std::endl;
+}
+
+
+/* Instructions detecting_vjmp() looks at in the first trace: popfq and
+ * cmp between two registers */
+static bool vjmp_marker(const uint8_t* bytes, uint32_t size) {
+  uint32_t i = 0;
+
+  /* Legacy prefixes and REX */
+  while (i < size && (bytes[i] == 0x66 || bytes[i] == 0x67 || bytes[i] == 0xf0 || bytes[i] == 0xf2 || bytes[i] == 0xf3 ||
+                      bytes[i] == 0x2e || bytes[i] == 0x36 || bytes[i] == 0x3e || bytes[i] == 0x26 || bytes[i] == 0x64 ||
+                      bytes[i] == 0x65 || (bytes[i] & 0xf0) == 0x40))
+    i++;
+
+  if (i < size && bytes[i] == 0x9d)
+    return true;
+  return i + 1 < size && bytes[i] >= 0x38 && bytes[i] <= 0x3b && (bytes[i + 1] & 0xc0) == 0xc0;
+}
+
+
+/* Every trace keeps the constraints of its virtual branches, for the merge */
+static void detecting_vjmp(Path& path, triton::arch::Instruction& inst, const Options& opts) {
+  triton::Context& ctx = path.ctx;
+  triton::ast::SharedAstContext ast = ctx.getAstContext();
+
+  if (opts.vbraddr && !opts.vbrflag.empty()) {
+    if (inst.isSymbolized() && inst.getAddress() == opts.vbraddr) {
+      triton::ast::SharedAbstractNode flag = ctx.getRegisterAst(ctx.getRegister(opts.vbrflag));
+      if (num_variables(flag) == 2)
+        path.v_jmp.push_back(ast->equal(flag, ast->bv(flag->evaluate(), flag->getBitvectorSize())));
+    }
+  }
+
+  if (path.execid == 1) {
+    /* Virtual jmp marker 1 */
+    if (inst.isSymbolized() && inst.getType() == triton::arch::x86::ID_INS_POPFQ)
+      flip_flag(path, inst, triton::arch::ID_REG_X86_CF, "on CF flag");
+
+    /* Virtual jmp marker 2 */
+    if (inst.isSymbolized() && inst.getType() == triton::arch::x86::ID_INS_CMP) {
+      if (inst.operands[0].getType() == triton::arch::OP_REG && inst.operands[1].getType() == triton::arch::OP_REG)
+        flip_flag(path, inst, triton::arch::ID_REG_X86_AF, "of AF flag");
+    }
+  }
+}
+
+
+static void symbolize_inputs(triton::Context& ctx, uint32_t symsize, std::ostream& out) {
+  triton::arch::register_e x, y;
+
+  out << "[+] Symbolize inputs" << std::endl;
+
+  switch (symsize) {
+    case 1:  x = triton::arch::ID_REG_X86_DIL; y = triton::arch::ID_REG_X86_SIL; break;
+    case 2:  x = triton::arch::ID_REG_X86_DI;  y = triton::arch::ID_REG_X86_SI;  break;
+    case 4:  x = triton::arch::ID_REG_X86_EDI; y = triton::arch::ID_REG_X86_ESI; break;
+    default: x = triton::arch::ID_REG_X86_RDI; y = triton::arch::ID_REG_X86_RSI; break;
+  }
+
+  ctx.symbolizeRegister(ctx.getRegister(x), "x");
+  ctx.symbolizeRegister(ctx.getRegister(y), "y");
+}
+
+
+static bool emulate(Path& path, const Options& opts) {
+  triton::Context& ctx = path.ctx;
+  std::ostream&    out = *path.out;
+  TraceReader reader;
+  uint64_t    count    = 0;
+  uint64_t    writes   = 0;
+  uint64_t    mismatch = 0;
+  uint64_t    skipped  = 0;
+  bool        fuse     = true;
+  bool        skip     = false;
+  uint32_t    dirty    = 0;
+  TaintPass   taint;
+  TraceSlicer slicer;
+
+  if (opts.taint) {
+    /* rdi and rsi */
+    if (!taint.run(path.trace, (1 << 4) | (1 << 5))) {
+      out << "[-] " << taint.error() << std::endl;
+      return false;
+    }
+    out << "[+] Tainted instructions: " << taint.numTainted() << "/" << taint.numInstructions() << std::endl;
+    if (taint.numMissingReads())
+      out << "[!] Memory reads missing from the trace (recorded with -dedup 1): " << taint.numMissingReads() << std::endl;
+  }
+
+  if (opts.slice) {
+    auto criterion = [&](const TraceRecord& rec) {
+      if (path.execid == 2)
+        return opts.vbraddr && !opts.vbrflag.empty() && rec.addr == opts.vbraddr;
+      return vjmp_marker(rec.bytes, rec.size) || (opts.vbraddr && !opts.vbrflag.empty() && rec.addr == opts.vbraddr);
+    };
+
+    /* rax */
+    if (!slicer.run(path.trace, 1 << 0, criterion)) {
+      out << "[-] " << slicer.error() << std::endl;
+      return false;
+    }
+    out << "[+] Slice: " << slicer.numSliced() << "/" << slicer.numInstructions() << " instructions" << std::endl;
+  }
+
+  if (!reader.open(path.trace)) {
+    out << "[-] " << reader.error() << std::endl;
+    return false;
+  }
+
+  for (const TraceRecord& rec : reader) {
+    switch (rec.kind) {
+      /* Synch memory read */
+      case RECORD_MEMREAD:
+        sync_memory(ctx, rec);
+        break;
+
+      /* Synch registers */
+      case RECORD_REGS:
+        dirty |= rec.mask;
+        sync_reg(ctx, rec.regs, &dirty);
+        break;
+
+      /* Execute instruction. The fuse is burned after the first instruction. */
+      case RECORD_INST: {
+        if (fuse)
+          symbolize_inputs(ctx, opts.symsize, out);
+        fuse = false;
+
+        skip = (opts.taint && !taint.tainted(count)) || (opts.slice && !slicer.inSlice(count));
+        count++;
+        if (skip) {
+          skip_inst(ctx, rec.uses);
+          dirty = 0;
+          skipped++;
+          break;
+        }
+
+        triton::arch::Instruction inst(rec.addr, rec.bytes, rec.size);
+        ctx.processing(inst);
+        detecting_vjmp(path, inst, opts);
+        dirty = written_gpr(ctx, inst);
+        break;
+      }
+
+      /* Check the memory model against the writes seen by Pin (-mw traces) */
+      case RECORD_MEMWRITE:
+        if (skip)
+          skip_write(ctx, rec);
+        else if (opts.check && ++writes % opts.check == 0 && !check_memory(ctx, rec))
+          mismatch++;
+        break;
+    }
+  }
+
+  if (!reader.error().empty()) {
+    out << "[-] " << reader.error() << std::endl;
+    return false;
+  }
+
+  out << "[+] Instruction executed: " << count << std::endl;
+  if (opts.taint || opts.slice)
+    out << "[+] Instructions skipped: " << skipped << std::endl;
+  if (mismatch)
+    out << "[!] Memory writes which differ from the trace: " << mismatch << std::endl;
+  if (path.queries.total())
+    path.queries.summary(out);
+  return true;
+}
+
+
+static void set_mode(triton::Context& ctx) {
+  ctx.setMode(triton::modes::ALIGNED_MEMORY, true);
+  ctx.setMode(triton::modes::AST_OPTIMIZATIONS, true);
+  ctx.setMode(triton::modes::CONSTANT_FOLDING, true);
+}
+
+
+static bool one_path(Path& path, const Options& opts) {
+  std::ostream& out = *path.out;
+
+  try {
+    set_mode(path.ctx);
+    out << "[+] Replaying the VMP trace" << std::endl;
+    if (!emulate(path, opts))
+      return false;
+    out << "[+] Emulation done" << std::endl;
+    path.ret = path.ctx.getRegisterAst(path.ctx.getRegister(triton::arch::ID_REG_X86_EAX));
+    return true;
+  }
+  catch (const triton::exceptions::Exception& e) {
+    out << "[-] " << e.what() << std::endl;
+    return false;
+  }
+}
+
+
+/* Every path in its own context, on a pool of threads */
+static void replay_all(std::vector<std::unique_ptr<Path>>& paths, const Options& opts) {
+  std::atomic<size_t>      next(0);
+  std::vector<std::thread> workers;
+  size_t jobs = opts.jobs ? opts.jobs : std::max(1u, std::thread::hardware_concurrency());
+
+  for (size_t i = 0; i < std::min(jobs, paths.size()); ++i) {
+    workers.emplace_back([&]() {
+      for (size_t p = next++; p < paths.size(); p = next++)
+        one_path(*paths[p], opts);
+    });
+  }
+  for (std::thread& worker : workers)
+    worker.join();
+}
+
+
+static std::string truncate(const std::string& expr, const std::string& full) {
+  if (expr.size() < 100)
+    return expr;
+  return "In: " + full.substr(0, 100) + " ...";
+}
+
+
+static int result(triton::Context& ctx, const triton::ast::SharedAbstractNode& ret_expr) {
+  std::ostringstream unro, synth, ret;
+
+  triton::ast::SharedAbstractNode node = ret_expr;
+  triton::engines::synthesis::SynthesisResult res = ctx.synthesize(ret_expr);
+  if (res.successful())
+    node = res.getOutput();
+
+  unro << triton::ast::unroll(ret_expr);
+  if (res.successful())
+    synth << res.getOutput();
+  else
+    synth << "None";
+
+  ret << std::hex << ret_expr->evaluate();
+
+  std::cout << "[+] Return value: 0x" << ret.str() << std::endl;
+  std::cout << "[+] Devirt expr: " << truncate(unro.str(), unro.str()) << std::endl;
+  std::cout << "[+] Synth expr: " << truncate(synth.str(), unro.str()) << std::endl << std::endl;
+  std::cout << "[+] LLVM IR ==============================" << std::endl << std::endl;
+  ctx.liftToLLVM(std::cout, node);
+  std::cout << std::endl << "[+] EOF LLVM IR ============================== " << std::endl;
+  return 0;
+}
+
+
+/* The merge happens in a new context, whose inputs take the values of the
+ * last trace (as when the traces were replayed one after the other) */
+static int merge(std::vector<std::unique_ptr<Path>>& paths) {
+  triton::Context ctx(triton::arch::ARCH_X86_64);
+  AstImporter     importer(ctx);
+  set_mode(ctx);
+
+  const Path& last = *paths.back();
+  for (const auto& item : last.ctx.getSymbolicVariables()) {
+    const triton::engines::symbolic::SharedSymbolicVariable& var = item.second;
+    triton::engines::symbolic::SharedSymbolicVariable input = ctx.newSymbolicVariable(var->getSize(), var->getAlias());
+    ctx.setConcreteVariableValue(input, last.ctx.getConcreteVariableValue(var));
+    importer.mapVariable(var->getAlias(), input);
+  }
+
+  std::vector<MergedPath> merged(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    merged[i].ret = importer.import(paths[i]->ret);
+    for (const auto& constraint : paths[i]->v_jmp)
+      merged[i].constraints.push_back(importer.import(constraint));
+  }
+
+  std::cout << "[+] Merging expressions from " << paths.size() << " traces (" << importer.numNodes() << " distinct nodes)" << std::endl;
+  return result(ctx, merge_paths(ctx.getAstContext(), merged));
+}
+
+
+/* --solver-log, the queries of every path in order */
+static void write_queries(const Options& opts, const std::vector<const Path*>& paths) {
+  if (opts.solverLog.empty())
+    return;
+
+  std::ofstream log(opts.solverLog);
+  log << "# query\toutcome\ttime" << std::endl;
+  for (const Path* path : paths)
+    path->queries.write(log);
+  if (!log)
+    std::cout << "[-] Can not write " << opts.solverLog << std::endl;
+}
+
+
+/* --solver-cache, shared by the paths */
+static void save_cache(const Options& opts, SolverCache& cache) {
+  if (!cache.save(opts.solverCache))
+    std::cout << "[-] Can not write " << opts.solverCache << std::endl;
+}
+
+
+static int analysis(const Options& opts) {
+  SolverCache cache;
+  SolverPortfolio solvers(opts.solvers, opts.solverTimeout);
+  if (!cache.load(opts.solverCache))
+    std::cout << "[-] Can not read " << opts.solverCache << ", starting with an empty cache" << std::endl;
+
+  if (opts.trace2.empty()) {
+    Path path(1, opts.trace1, &cache, &solvers);
+    path.out = &std::cout;
+    bool ok = one_path(path, opts);
+    solvers.summary(std::cout);
+    write_queries(opts, {&path});
+    save_cache(opts, cache);
+    if (!ok)
+      return -1;
+    return result(path.ctx, path.ret);
+  }
+
+  std::vector<std::unique_ptr<Path>> paths;
+  paths.emplace_back(new Path(1, opts.trace1, &cache, &solvers));
+  paths.emplace_back(new Path(2, opts.trace2, &cache, &solvers));
+  for (const std::string& trace : opts.traces)
+    paths.emplace_back(new Path(2, trace, &cache, &solvers));
+
+  std::cout << "[+] Replaying " << paths.size() << " traces" << std::endl;
+  replay_all(paths, opts);
+
+  bool ok = true;
+  std::vector<const Path*> logs;
+  for (const auto& path : paths) {
+    std::cout << "[+] " << path->trace << std::endl << path->buffer.str();
+    ok = ok && path->ret;
+    logs.push_back(path.get());
+  }
+  solvers.summary(std::cout);
+  write_queries(opts, logs);
+  save_cache(opts, cache);
+  if (!ok)
+    return -1;
+
+  for (size_t i = 1; i < paths.size(); ++i) {
+    if (paths[i]->v_jmp.empty()) {
+      std::cout << "[-] The virtual branch has not been reached by " << paths[i]->trace << std::endl;
+      return -1;
+    }
+  }
+
+  return merge(paths);
+}
+
+
+static void syntax(const char* argv0, bool merge) {
+  if (merge)
+    std::cout << "[!] Syntax: " << argv0 << " --trace1 <vmp trace> --trace2 <vmp trace> [--trace <vmp trace> ...] [--jobs <n>] --symsize <sym size> --vbraddr <vbraddr> --vbrflag <vbrflag> [--solver-log <file>] [--solver-cache <file>] [--solvers z3,bitwuzla] [--solver-timeout <ms>]" << std::endl;
+  else
+    std::cout << "[!] Syntax: " << argv0 << " --trace1 <vmp trace> --symsize <sym size> [--solver-log <file>] [--solver-cache <file>] [--solvers z3,bitwuzla] [--solver-timeout <ms>]" << std::endl;
+}
+
+
+/* Same options as attack_vmp.py, as `--name value` or `--name=value` */
+static bool parse_args(int argc, char* argv[], Options* opts) {
+  for (int i = 1; i < argc; ++i) {
+    std::string name = argv[i];
+    std::string value;
+
+    if (name == "--taint") {
+      opts->taint = true;
+      continue;
+    }
+    if (name == "--slice") {
+      opts->slice = true;
+      continue;
+    }
+
+    size_t eq = name.find('=');
+    if (eq != std::string::npos) {
+      value = name.substr(eq + 1);
+      name  = name.substr(0, eq);
+    }
+    else if (i + 1 < argc)
+      value = argv[++i];
+    else {
+      std::cout << "[-] Missing value of " << name << std::endl;
+      return false;
+    }
+
+    if (name == "--trace1")
+      opts->trace1 = value;
+    else if (name == "--trace2")
+      opts->trace2 = value;
+    else if (name == "--trace")
+      opts->traces.push_back(value);
+    else if (name == "--jobs")
+      opts->jobs = strtoul(value.c_str(), nullptr, 10);
+    else if (name == "--symsize")
+      opts->symsize = strtoul(value.c_str(), nullptr, 10);
+    else if (name == "--vbraddr")
+      opts->vbraddr = strtoull(value.c_str(), nullptr, 0);
+    else if (name == "--vbrflag")
+      opts->vbrflag = value;
+    else if (name == "--solver-log")
+      opts->solverLog = value;
+    else if (name == "--solver-cache")
+      opts->solverCache = value;
+    else if (name == "--solvers") {
+      std::istringstream names(value);
+      std::string solver;
+      while (std::getline(names, solver, ',')) {
+        triton::engines::solver::solver_e backend = SolverPortfolio::backend(solver);
+        if (backend == triton::engines::solver::SOLVER_INVALID) {
+          std::cout << "[-] Unknown solver, or Triton is built without it: " << solver << std::endl;
+          return false;
+        }
+        opts->solvers.push_back(backend);
+      }
+    }
+    else if (name == "--solver-timeout")
+      opts->solverTimeout = strtoul(value.c_str(), nullptr, 10);
+    else if (name == "--check-writes")
+      opts->check = strtoul(value.c_str(), nullptr, 10);
+    else {
+      std::cout << "[-] Unknown option " << name << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+
+int main(int argc, char* argv[]) {
+  Options opts;
+  opts.symsize = 0;
+  opts.vbraddr = 0;
+  opts.check   = 0;
+  opts.jobs    = 0;
+  opts.solverTimeout = 0;
+  opts.taint   = false;
+  opts.slice   = false;
+
+  if (!parse_args(argc, argv, &opts))
+    return -1;
+
+  if (opts.trace1.empty()) {
+    std::cout << "[-] You must define a VMP trace" << std::endl;
+    syntax(argv[0], false);
+    return -1;
+  }
+
+  if (opts.symsize != 1 && opts.symsize != 2 && opts.symsize != 4 && opts.symsize != 8) {
+    std::cout << "[-] Size of symbolic variables must be equal to: 1, 2, 4, or 8 bytes" << std::endl;
+    syntax(argv[0], false);
+    return -1;
+  }
+
+  /* --trace alone: the first one is the second trace */
+  if (opts.trace2.empty() && !opts.traces.empty()) {
+    opts.trace2 = opts.traces.front();
+    opts.traces.erase(opts.traces.begin());
+  }
+
+  if (!opts.trace2.empty() && opts.vbrflag.empty()) {
+    std::cout << "[-] If you define a second trace, you have to define the virtual branch flag (e.g: cf, af, zf etc." << std::endl;
+    syntax(argv[0], true);
+    return -1;
+  }
+
+  /* The losers of a race go on until their timeout */
+  if (opts.solvers.size() > 1 && opts.solverTimeout == 0) {
+    std::cout << "[-] Several solvers are raced with a timeout, define --solver-timeout" << std::endl;
+    syntax(argv[0], !opts.trace2.empty());
+    return -1;
+  }
+
+  try {
+    return analysis(opts);
+  }
+  catch (const triton::exceptions::Exception& e) {
+    std::cout << "[-] " << e.what() << std::endl;
+    return -1;
+  }
+}
@@ -0,0 +1,435 @@
+## -*- coding: utf-8 -*-
+##
+## Working with Triton from commit 05b05cfbe8697a4a93d6ba674062f97465270412
+##
+## Solver queries of the replay scripts. A query is first evaluated on a batch
+## of boundary and random values of its variables, the solver is only asked
+## when none of them satisfies it: most flags of the VM handlers flip for one
+## of them, and an SMT query costs much more than evaluating the expression.
+## Every query and how it was answered is logged.
+##
+## Solver results are cached by a canonical hash of the query, the variables
+## being numbered in order of appearance, so that a query asked again (by
+## another handler, another trace or another run with --solver-cache) is not
+## solved again. The cache file is shared with vmp_replay --solver-cache.
+##
+
+import fcntl
+import itertools
+import os
+import random
+import tempfile
+import time
+
+from triton import *
+
+
+
+class Unsupported(Exception):
+    pass
+
+
+class Value(object):
+    # Model entry found by evaluation, same interface and output as a
+    # SolverModel of Triton
+
+    def __init__(self, var, value):
+        self.var   = var
+        self.value = value
+
+    def getId(self):
+        return self.var.getId()
+
+    def getValue(self):
+        return self.value
+
+    def getVariable(self):
+        return self.var
+
+    def __repr__(self):
+        return f'{self.var} = {hex(self.value)}'
+
+
+class QueryLog(object):
+    # Queries of a run and how they were answered: 'constant' (no variable),
+    # 'sampled' (a sample satisfies it), 'cached', or the status of the solver
+
+    OUTCOMES = ('constant', 'sampled', 'cached', 'sat', 'unsat', 'unknown')
+
+    def __init__(self):
+        self.counts = dict.fromkeys(self.OUTCOMES, 0)
+        self.times  = dict.fromkeys(self.OUTCOMES, 0.0)
+        self.lines  = list()
+
+    def record(self, label, outcome, elapsed):
+        self.counts[outcome] += 1
+        self.times[outcome]  += elapsed
+        self.lines.append(f'{label}\t{outcome}\t{elapsed * 1000:.3f} ms')
+        return
+
+    def update(self, other):
+        # Queries of another process
+        for outcome in self.OUTCOMES:
+            self.counts[outcome] += other.counts[outcome]
+            self.times[outcome]  += other.times[outcome]
+        self.lines.extend(other.lines)
+        return
+
+    def total(self):
+        return sum(self.counts.values())
+
+    def summary(self):
+        c = self.counts
+        solver = c['sat'] + c['unsat'] + c['unknown']
+        spent  = self.times['sat'] + self.times['unsat'] + self.times['unknown']
+        print(f'[+] Solver queries: {self.total()} - answered by evaluation: {c["sampled"] + c["constant"]} '
+              f'({c["constant"]} constant), from the cache: {c["cached"]}, '
+              f'by the solver: {solver} ({c["sat"]} sat, {c["unsat"]} unsat, {c["unknown"]} unknown) in {spent:.3f}s')
+        return
+
+    def write(self, path):
+        with open(path, 'w') as fd:
+            fd.write('# query\toutcome\ttime\n')
+            for line in self.lines:
+                fd.write(line + '\n')
+        return
+
+
+class SolverCache(object):
+    # Solver results by canonical query: key -> (sat, values of the variables
+    # in order of appearance). One line per entry in the file:
+    # '<key> sat <values>' or '<key> unsat'.
+
+    def __init__(self, path=None):
+        self.path    = path
+        self.entries = dict()
+        self.added   = dict()   # Entries which are not in the file
+        if path and os.path.exists(path):
+            self.load(path)
+
+    def load(self, path):
+        with open(path) as fd:
+            for line in fd:
+                fields = line.split()
+                if len(fields) < 2 or line.startswith('#'):
+                    continue
+                self.entries[fields[0]] = (fields[1] == 'sat', [int(v, 16) for v in fields[2:]])
+        return
+
+    def get(self, key):
+        return self.entries.get(key)
+
+    def put(self, key, sat, values):
+        self.entries[key] = (sat, values)
+        self.added[key]   = (sat, values)
+        return
+
+    def update(self, entries):
+        # Entries added by another process
+        for key, (sat, values) in entries.items():
+            self.put(key, sat, values)
+        return
+
+    def save(self):
+        # Other runs may have added entries since it was loaded: the runs
+        # sharing the file take a lock on '<file>.lock' to reload, merge and
+        # replace it, each one through a temporary file of its own. Same as
+        # SolverCache::save() of vmp_replay.
+        if not self.path or not self.added:
+            return
+        with open(self.path + '.lock', 'a') as lock:
+            fcntl.flock(lock, fcntl.LOCK_EX)
+            if os.path.exists(self.path):
+                self.load(self.path)
+            self.entries.update(self.added)
+            with tempfile.NamedTemporaryFile('w', dir=os.path.dirname(os.path.abspath(self.path)),
+                                             prefix=os.path.basename(self.path) + '.', delete=False) as fd:
+                fd.write('# vmp solver cache\n')
+                for key, (sat, values) in self.entries.items():
+                    fd.write(' '.join([key, 'sat' if sat else 'unsat'] + [hex(v) for v in values]) + '\n')
+            os.chmod(fd.name, 0o644)
+            os.replace(fd.name, self.path)
+        self.added = dict()
+        return
+
+
+FNV_OFFSET = 0x6c62272e07bb014262b821756295c58d
+FNV_PRIME  = 0x0000000001000000000000000000013b
+
+
+def canonical_key(program):
+    # FNV-1a (128 bits) of the program, variables numbered in order of
+    # appearance. Returns the key and the ids of the variables in that order.
+    order = list()
+    text  = list()
+    for kind, size, operands, extra in program:
+        if kind == AST_NODE.VARIABLE:
+            if extra[0] not in order:
+                order.append(extra[0])
+            extra = [order.index(extra[0])]
+        text.append(f'{int(kind)} {size} {",".join(map(str, operands))}|{",".join(map(str, extra))}\n')
+
+    h, m = FNV_OFFSET, mask(128)
+    for byte in ''.join(text).encode():
+        h = ((h ^ byte) * FNV_PRIME) & m
+    return f'{h:032x}', order
+
+
+def mask(size):
+    return (1 << size) - 1
+
+
+def signed(value, size):
+    return value - (1 << size) if value >> (size - 1) else value
+
+
+def bvsdiv(a, b, size):
+    sa, sb = signed(a, size), signed(b, size)
+    if b == 0:
+        return 1 if sa < 0 else mask(size)
+    q = abs(sa) // abs(sb)
+    return (-q if (sa < 0) != (sb < 0) else q) & mask(size)
+
+
+def bvsrem(a, b, size):
+    sa, sb = signed(a, size), signed(b, size)
+    if b == 0:
+        return a
+    r = abs(sa) % abs(sb)
+    return (-r if sa < 0 else r) & mask(size)
+
+
+def bvsmod(a, b, size):
+    # The sign of the divisor, like the % of python
+    if b == 0:
+        return a
+    return (signed(a, size) % signed(b, size)) & mask(size)
+
+
+def rotate(a, r, size):
+    r %= size
+    return ((a << r) | (a >> (size - r))) & mask(size)
+
+
+def bswap(a, size):
+    return int.from_bytes(a.to_bytes(size // 8, 'little'), 'big')
+
+
+def concat(values, sizes):
+    result = 0
+    for v, s in zip(values, sizes):
+        result = (result << s) | v
+    return result
+
+
+# Operations by node type: (size of the node, values of the children,
+# integer operands or sizes of the children)
+OPERATIONS = {
+    AST_NODE.BVADD:    lambda s, v, e: (v[0] + v[1]) & mask(s),
+    AST_NODE.BVSUB:    lambda s, v, e: (v[0] - v[1]) & mask(s),
+    AST_NODE.BVMUL:    lambda s, v, e: (v[0] * v[1]) & mask(s),
+    AST_NODE.BVAND:    lambda s, v, e: v[0] & v[1],
+    AST_NODE.BVOR:     lambda s, v, e: v[0] | v[1],
+    AST_NODE.BVXOR:    lambda s, v, e: v[0] ^ v[1],
+    AST_NODE.BVNAND:   lambda s, v, e: ~(v[0] & v[1]) & mask(s),
+    AST_NODE.BVNOR:    lambda s, v, e: ~(v[0] | v[1]) & mask(s),
+    AST_NODE.BVXNOR:   lambda s, v, e: ~(v[0] ^ v[1]) & mask(s),
+    AST_NODE.BVNOT:    lambda s, v, e: ~v[0] & mask(s),
+    AST_NODE.BVNEG:    lambda s, v, e: -v[0] & mask(s),
+    AST_NODE.BVSHL:    lambda s, v, e: (v[0] << v[1]) & mask(s) if v[1] < s else 0,
+    AST_NODE.BVLSHR:   lambda s, v, e: v[0] >> v[1] if v[1] < s else 0,
+    AST_NODE.BVASHR:   lambda s, v, e: (signed(v[0], s) >> min(v[1], s)) & mask(s),
+    AST_NODE.BVUDIV:   lambda s, v, e: v[0] // v[1] if v[1] else mask(s),
+    AST_NODE.BVUREM:   lambda s, v, e: v[0] % v[1] if v[1] else v[0],
+    AST_NODE.BVSDIV:   lambda s, v, e: bvsdiv(v[0], v[1], s),
+    AST_NODE.BVSREM:   lambda s, v, e: bvsrem(v[0], v[1], s),
+    AST_NODE.BVSMOD:   lambda s, v, e: bvsmod(v[0], v[1], s),
+    AST_NODE.BVROL:    lambda s, v, e: rotate(v[0], e[0] if e else v[1], s),
+    AST_NODE.BVROR:    lambda s, v, e: rotate(v[0], s - (e[0] if e else v[1]) % s, s),
+    AST_NODE.BSWAP:    lambda s, v, e: bswap(v[0], s),
+    AST_NODE.BVULT:    lambda s, v, e: int(v[0] < v[1]),
+    AST_NODE.BVULE:    lambda s, v, e: int(v[0] <= v[1]),
+    AST_NODE.BVUGT:    lambda s, v, e: int(v[0] > v[1]),
+    AST_NODE.BVUGE:    lambda s, v, e: int(v[0] >= v[1]),
+    AST_NODE.BVSLT:    lambda s, v, e: int(signed(v[0], e[0]) <  signed(v[1], e[0])),
+    AST_NODE.BVSLE:    lambda s, v, e: int(signed(v[0], e[0]) <= signed(v[1], e[0])),
+    AST_NODE.BVSGT:    lambda s, v, e: int(signed(v[0], e[0]) >  signed(v[1], e[0])),
+    AST_NODE.BVSGE:    lambda s, v, e: int(signed(v[0], e[0]) >= signed(v[1], e[0])),
+    AST_NODE.EQUAL:    lambda s, v, e: int(v[0] == v[1]),
+    AST_NODE.DISTINCT: lambda s, v, e: int(v[0] != v[1]),
+    AST_NODE.ITE:      lambda s, v, e: v[1] if v[0] else v[2],
+    AST_NODE.EXTRACT:  lambda s, v, e: (v[0] >> e[1]) & mask(s),
+    AST_NODE.CONCAT:   lambda s, v, e: concat(v, e),
+    AST_NODE.ZX:       lambda s, v, e: v[0],
+    AST_NODE.SX:       lambda s, v, e: signed(v[0], s - e[0]) & mask(s),
+    AST_NODE.LNOT:     lambda s, v, e: int(not v[0]),
+    AST_NODE.LAND:     lambda s, v, e: int(all(v)),
+    AST_NODE.LOR:      lambda s, v, e: int(any(v)),
+    AST_NODE.LXOR:     lambda s, v, e: sum(1 for x in v if x) & 1,
+    AST_NODE.IFF:      lambda s, v, e: int(bool(v[0]) == bool(v[1])),
+}
+
+
+def integer(node):
+    if node.getType() == AST_NODE.INTEGER:
+        return node.getInteger()
+    return node.evaluate()
+
+
+def compile_ast(node):
+    # Flat post-order program of the unrolled node, identical entries are
+    # computed once. Entries are (type, size, operands, extra) where operands
+    # are indexes of earlier entries, so an entry is its own structural key.
+    # The python nodes have no identity, the hash is not one either: only the
+    # references are remembered, by the id of their expression.
+    program    = list()
+    index      = dict()
+    variables  = dict()
+    references = dict()
+    result     = None
+    frames     = [[node, None, 0, list()]]
+
+    while frames:
+        frame = frames[-1]
+        n, nodes, pos, operands = frame
+        kind = n.getType()
+
+        if nodes is None:
+            if kind == AST_NODE.REFERENCE and n.getSymbolicExpression().getId() in references:
+                frames.pop()
+                result = references[n.getSymbolicExpression().getId()]
+                if frames:
+                    frames[-1][3].append(result)
+                continue
+            if kind == AST_NODE.REFERENCE:
+                children = [n.getSymbolicExpression().getAst()]
+            elif kind in (AST_NODE.BV, AST_NODE.VARIABLE):
+                children = list()
+            else:
+                children = list(n.getChildren())
+            frame[1] = nodes = [c for c in children if c.getType() != AST_NODE.INTEGER]
+
+        # Children first, left to right
+        if pos < len(nodes):
+            frame[2] += 1
+            frames.append([nodes[pos], None, 0, list()])
+            continue
+
+        size = n.getBitvectorSize()
+        if kind == AST_NODE.BV:
+            entry = (AST_NODE.BV, size, [], [n.evaluate()])
+        elif kind == AST_NODE.VARIABLE:
+            var = n.getSymbolicVariable()
+            variables[var.getId()] = var
+            entry = (AST_NODE.VARIABLE, size, [], [var.getId()])
+        elif kind == AST_NODE.REFERENCE:
+            entry = (AST_NODE.REFERENCE, size, operands, [])
+        elif kind in OPERATIONS:
+            if kind in (AST_NODE.CONCAT, AST_NODE.BVSLT, AST_NODE.BVSLE, AST_NODE.BVSGT, AST_NODE.BVSGE):
+                extra = [c.getBitvectorSize() for c in nodes]
+            else:
+                extra = [integer(c) for c in n.getChildren() if c.getType() == AST_NODE.INTEGER]
+            entry = (kind, size, operands, extra)
+        else:
+            raise Unsupported(kind)
+
+        k = (int(kind), size, tuple(operands), tuple(entry[3]))
+        if k not in index:
+            index[k] = len(program)
+            program.append(entry)
+        result = index[k]
+        if kind == AST_NODE.REFERENCE:
+            references[n.getSymbolicExpression().getId()] = result
+
+        frames.pop()
+        if frames:
+            frames[-1][3].append(result)
+
+    return program, variables
+
+
+def run(program, values):
+    out = [0] * len(program)
+    for i, (kind, size, operands, extra) in enumerate(program):
+        if kind == AST_NODE.BV:
+            out[i] = extra[0]
+        elif kind == AST_NODE.VARIABLE:
+            out[i] = values[extra[0]]
+        elif kind == AST_NODE.REFERENCE:
+            out[i] = out[operands[0]]
+        else:
+            out[i] = OPERATIONS[kind](size, [out[o] for o in operands], extra)
+    return out[-1]
+
+
+def samples(variables, current, count, seed=0):
+    # Combinations of the boundary values of the variables for half the batch,
+    # so that the random values are drawn even with several variables, then
+    # random values. The current values are already known not to satisfy the
+    # query.
+    rnd   = random.Random(seed)
+    ids   = sorted(variables)
+    edges = list()
+    for i in ids:
+        bits = variables[i].getBitSize()
+        m, v = mask(bits), current[i]
+        edges.append(list(dict.fromkeys([v, 0, 1, m, 1 << (bits - 1), m >> 1, (v + 1) & m, (v - 1) & m])))
+
+    n = 0
+    for combination in itertools.product(*edges):
+        if n == count // 2:
+            break
+        values = dict(zip(ids, combination))
+        if values != current:
+            n += 1
+            yield values
+
+    for _ in range(count - n):
+        yield {i: rnd.getrandbits(variables[i].getBitSize()) for i in ids}
+    return
+
+
+def get_model(ctx, node, log=None, label='', count=32, cache=None):
+    # Same as ctx.getModel(node, status=True) without the time, the values
+    # found by evaluation or in the cache are Value objects
+    start = time.time()
+    key   = None
+
+    try:
+        program, variables = compile_ast(node)
+    except Unsupported:
+        program = None
+
+    if program is not None and not variables:
+        status = SOLVER_STATE.SAT if run(program, {}) else SOLVER_STATE.UNSAT
+        if log:
+            log.record(label, 'constant', time.time() - start)
+        return dict(), status
+
+    if program is not None:
+        current = {i: ctx.getConcreteVariableValue(v) for i, v in variables.items()}
+        for values in samples(variables, current, count):
+            if run(program, values):
+                if log:
+                    log.record(label, 'sampled', time.time() - start)
+                return {i: Value(variables[i], v) for i, v in values.items()}, SOLVER_STATE.SAT
+
+    # A cached model is checked, it costs one more evaluation
+    if program is not None and cache is not None:
+        key, order = canonical_key(program)
+        entry = cache.get(key)
+        if entry and (not entry[0] or run(program, dict(zip(order, entry[1])))):
+            if log:
+                log.record(label, 'cached', time.time() - start)
+            if not entry[0]:
+                return dict(), SOLVER_STATE.UNSAT
+            return {i: Value(variables[i], v) for i, v in zip(order, entry[1])}, SOLVER_STATE.SAT
+
+    model, status, _ = ctx.getModel(node, status=True)
+    if key and status in (SOLVER_STATE.SAT, SOLVER_STATE.UNSAT):
+        values = [model[i].getValue() if i in model else current[i] for i in order]
+        cache.put(key, status == SOLVER_STATE.SAT, values)
+    if log:
+        outcome = {SOLVER_STATE.SAT: 'sat', SOLVER_STATE.UNSAT: 'unsat'}.get(status, 'unknown')
+        log.record(label, outcome, time.time() - start)
+    return model, status
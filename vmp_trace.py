@@ -0,0 +1,824 @@
+#!/usr/bin/env python
+## -*- coding: utf-8 -*-
+##
+## Reader for VMP traces generated by the VMP_Trace Pintool.
+##
+## Both trace formats are supported: the historical text format (`mr:`, `r:`,
+## `i:`, `u:` and `mw:` lines) and the binary format described in
+## pin/source/tools/VMP_Trace/vmp_trace_format.h. This script can also be used
+## to convert a trace from one format to the other:
+##
+##   $ ./vmp_trace.py --to-text ./trace.bin > ./trace.txt
+##   $ ./vmp_trace.py --to-binary ./trace.txt -o ./trace.bin
+##   $ ./vmp_trace.py --to-columnar ./trace.txt -o ./trace.col
+##
+## Columnar traces (-format columnar) store the instructions, registers and
+## memory accesses in separate compressed columns, so that queries like the
+## number of executions of an address only decode the blocks they need:
+##
+##   $ ./vmp_trace.py --histogram ./trace.col --addr 0x4011c0
+##
+## Traces compressed by the Pintool (-compress, LZ4 frame) are decompressed on
+## the fly, using the lz4 module if it is installed.
+##
+## When the trace has an index (-index, `<trace>.idx`), read_trace() can start
+## from a checkpoint instead of the first instruction:
+##
+##   $ ./vmp_trace.py --to-text ./trace.bin --start 1000000
+##
+
+import argparse
+import collections
+import io
+import os
+import struct
+import sys
+
+from array import array
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+
+VMPT_MAGIC          = b'VMPT'
+VMPT_VERSION        = 5
+
+VMPT_NUM_REGS       = 16
+VMPT_MAX_INST_SIZE  = 15
+
+VMPT_REC_REGS       = 0x01
+VMPT_REC_INST       = 0x02
+VMPT_REC_MEMREAD    = 0x03
+VMPT_REC_REGS_DELTA = 0x04
+VMPT_REC_CODE       = 0x05
+VMPT_REC_EXEC       = 0x06
+VMPT_REC_MEMWRITE   = 0x07
+VMPT_REC_USES       = 0x08
+
+VMPT_USE_FLAGS      = 1 << 16
+VMPT_USE_OTHER      = 1 << 17
+VMPT_USE_MEMORY     = 1 << 18
+
+HEADER  = struct.Struct('<4sI')
+REGS    = struct.Struct('<16Q')
+INST    = struct.Struct('<QB15s')
+MEMREAD = struct.Struct('<QBQ')
+MEMWRITE = MEMREAD
+MASK    = struct.Struct('<H')
+CODE    = struct.Struct('<IQB15s')
+EXEC    = struct.Struct('<I')
+USES    = struct.Struct('<II')
+
+PAYLOAD = {
+    VMPT_REC_REGS       : REGS,
+    VMPT_REC_INST       : INST,
+    VMPT_REC_MEMREAD    : MEMREAD,
+    VMPT_REC_REGS_DELTA : MASK,
+    VMPT_REC_CODE       : CODE,
+    VMPT_REC_EXEC       : EXEC,
+    VMPT_REC_MEMWRITE   : MEMWRITE,
+    VMPT_REC_USES       : USES,
+}
+
+VMPC_MAGIC          = b'VMPC'
+VMPC_VERSION        = 1
+VMPC_BLOCK_SIZE     = 64 << 10
+
+VMPC_COL_CODE       = 0x01
+VMPC_COL_EXEC       = 0x02
+VMPC_COL_REGS       = 0x03
+VMPC_COL_MEMREAD    = 0x04
+VMPC_COL_MEMWRITE   = 0x05
+
+BLOCK_HEADER = struct.Struct('<BIIQQQQ')
+ACCESS       = struct.Struct('<QQBQ')
+
+VMPT_INDEX_MAGIC    = b'VMPI'
+VMPT_INDEX_VERSION  = 1
+VMPT_PAGE_SIZE      = 4096
+
+VMPT_IDX_CODE       = 0x01
+VMPT_IDX_CHECKPOINT = 0x02
+VMPT_IDX_BLOCK      = 0x03
+
+INDEX_HEADER = struct.Struct('<4sII')
+CHECKPOINT   = struct.Struct('<QQ16QI')
+PAGE         = struct.Struct('<Q%ds%ds' %(VMPT_PAGE_SIZE // 8, VMPT_PAGE_SIZE))
+BLOCK        = struct.Struct('<QQ')
+
+LZ4F_MAGIC          = b'\x04\x22\x4d\x18'
+# Frame flags of the traces compressed by the Pintool
+LZ4F_FLAGS          = 0x60
+
+CHUNK_SIZE = 1 << 20
+
+DELTA = dict()
+
+
+def delta_layout(mask):
+    """ Returns the register indexes present in a delta mask and the struct of their values """
+    layout = DELTA.get(mask)
+    if layout is None:
+        indexes = [i for i in range(VMPT_NUM_REGS) if mask & (1 << i)]
+        layout  = (indexes, struct.Struct('<%dQ' %(len(indexes))))
+        DELTA[mask] = layout
+    return layout
+
+
+def lz4_block(src, dst):
+    """ Decompresses a LZ4 block at the end of dst (a bytearray) """
+    i = 0
+    n = len(src)
+    while i < n:
+        token = src[i]
+        i += 1
+
+        # Literals
+        length = token >> 4
+        if length == 15:
+            while True:
+                b = src[i]
+                i += 1
+                length += b
+                if b != 255:
+                    break
+        dst += src[i:i + length]
+        i += length
+
+        # The last sequence only has literals
+        if i >= n:
+            break
+
+        # Match
+        offset = src[i] | (src[i + 1] << 8)
+        i += 2
+        length = token & 15
+        if length == 15:
+            while True:
+                b = src[i]
+                i += 1
+                length += b
+                if b != 255:
+                    break
+        length += 4
+
+        start = len(dst) - offset
+        if length <= offset:
+            dst += dst[start:start + length]
+        else:
+            # Overlapping match, the pattern repeats itself
+            dst += (dst[start:] * (length // offset + 1))[:length]
+    return
+
+
+class LZ4FrameReader(io.RawIOBase):
+    """ Minimal LZ4 frame decoder, used when the lz4 module is not installed """
+
+    def __init__(self, fd, flags=None):
+        # flags is given when fd is positioned on a block rather than on a frame header
+        self.fd    = fd
+        self.data  = bytearray()
+        self.off   = 0
+        self.flags = flags
+
+    def readable(self):
+        return True
+
+    def next_block(self):
+        if self.flags is None:
+            header = self.fd.read(6)
+            if len(header) < 6:
+                return False
+            if header[:4] != LZ4F_MAGIC:
+                raise ValueError('not a LZ4 frame')
+            self.flags = header[4]
+            # Content size, dictionary id, header checksum
+            self.fd.read((8 if self.flags & 0x08 else 0) + (4 if self.flags & 0x01 else 0) + 1)
+
+        size, = struct.unpack('<I', self.fd.read(4))
+        if size == 0:
+            # End mark (and content checksum), a new frame may follow
+            if self.flags & 0x04:
+                self.fd.read(4)
+            self.flags = None
+            return self.next_block()
+
+        block = self.fd.read(size & 0x7fffffff)
+        if self.flags & 0x10:
+            self.fd.read(4)
+
+        self.data = self.data[self.off:]
+        self.off  = 0
+        if size & 0x80000000:
+            self.data += block
+        else:
+            lz4_block(block, self.data)
+        return True
+
+    def readinto(self, b):
+        while self.off >= len(self.data):
+            if not self.next_block():
+                return 0
+        n = min(len(b), len(self.data) - self.off)
+        b[:n] = self.data[self.off:self.off + n]
+        self.off += n
+        return n
+
+    def close(self):
+        self.fd.close()
+        super().close()
+
+
+def open_trace(path):
+    """ Opens a trace as a binary file object, decompressing it if needed """
+    fd = open(path, 'rb')
+    if fd.peek(len(LZ4F_MAGIC))[:len(LZ4F_MAGIC)] != LZ4F_MAGIC:
+        return fd
+    try:
+        import lz4.frame
+        return lz4.frame.LZ4FrameFile(fd)
+    except ImportError:
+        return io.BufferedReader(LZ4FrameReader(fd), CHUNK_SIZE)
+
+
+def is_binary(path):
+    with open_trace(path) as fd:
+        return fd.read(len(VMPT_MAGIC)) == VMPT_MAGIC
+
+
+def is_columnar(path):
+    with open(path, 'rb') as fd:
+        return fd.read(len(VMPC_MAGIC)) == VMPC_MAGIC
+
+
+def read_index(path):
+    """
+    Reads the index of a trace. Returns (interval, checkpoints, codes, blocks):
+    checkpoints are (icount, offset, regs, pages) tuples where pages maps the
+    address of the memory pages written with that checkpoint to the position
+    of their VMPT_PAGE record in the index (see known_memory()), codes are the 'i' records of the code
+    dictionary and blocks are the (offset, file offset) of the LZ4 blocks.
+    """
+    checkpoints = list()
+    codes       = dict()
+    blocks      = list()
+
+    with open(path, 'rb') as fd:
+        magic, version, interval = INDEX_HEADER.unpack(fd.read(INDEX_HEADER.size))
+        if magic != VMPT_INDEX_MAGIC:
+            raise ValueError(f'{path} is not a VMP trace index')
+        if version > VMPT_INDEX_VERSION:
+            raise ValueError(f'{path}: unsupported index version {version}')
+
+        while True:
+            kind = fd.read(1)
+            if not kind:
+                break
+            kind = kind[0]
+
+            if kind == VMPT_IDX_CODE:
+                code, addr, size, opcode = CODE.unpack(fd.read(CODE.size))
+                codes[code] = ('i', addr, size, opcode[:size], code)
+
+            elif kind == VMPT_IDX_CHECKPOINT:
+                fields = CHECKPOINT.unpack(fd.read(CHECKPOINT.size))
+                pages  = dict()
+                for _ in range(fields[-1]):
+                    position = fd.tell()
+                    addr, = struct.unpack('<Q', fd.read(8))
+                    pages[addr] = position
+                    fd.seek(PAGE.size - 8, io.SEEK_CUR)
+                checkpoints.append((fields[0], fields[1], list(fields[2:-1]), pages))
+
+            elif kind == VMPT_IDX_BLOCK:
+                blocks.append(BLOCK.unpack(fd.read(BLOCK.size)))
+
+            else:
+                raise ValueError(f'{path}: unknown index record kind {kind:#x}')
+
+    return interval, checkpoints, codes, blocks
+
+
+def known_memory(path, checkpoints, n):
+    """ Yields the bytes known at checkpoint n as 'mr' records """
+    # Pages are snapshots, the last one of a page is enough
+    pages = dict()
+    for checkpoint in checkpoints[:n + 1]:
+        pages.update(checkpoint[3])
+
+    with open(path, 'rb') as fd:
+        for position in sorted(pages.values()):
+            fd.seek(position)
+            addr, valid, data = PAGE.unpack(fd.read(PAGE.size))
+            known = lambda off: valid[off >> 3] & (1 << (off & 7))
+            off = 0
+            while off < VMPT_PAGE_SIZE:
+                if not known(off):
+                    off += 1
+                    continue
+                # Largest aligned chunk of known bytes
+                size = 8
+                while off % size or not all(known(off + i) for i in range(size)):
+                    size //= 2
+                yield ('mr', addr + off, size, int.from_bytes(data[off:off + size], 'little'))
+                off += size
+    return
+
+
+def open_at(path, offset, blocks):
+    """ Opens a trace as a binary file object positioned at an uncompressed offset """
+    fd = open(path, 'rb')
+    if not blocks:
+        fd.seek(offset)
+        return fd
+
+    # Decompress from the block holding the offset
+    start, position = [b for b in blocks if b[0] <= offset][-1]
+    fd.seek(position)
+    fd = io.BufferedReader(LZ4FrameReader(fd, LZ4F_FLAGS), CHUNK_SIZE)
+    fd.read(offset - start)
+    return fd
+
+
+def read_binary(path, fd=None, codes=None):
+    """
+    Yields ('mr', addr, size, value), ('r', delta), ('i', addr, size, opcode, code)
+    and ('mw', addr, size, value) records. A delta is a list of (register index,
+    value) which only contains the registers that changed since the previous
+    'r' record. `code` is an id
+    unique to the (addr, opcode) pair and all executions of the same code
+    yield the same 'i' tuple, so it can be used as a key to cache decoding.
+    Traces recorded with -uses also yield ('u', read, written) before the first
+    execution of an instruction (VMPT_USES masks).
+    fd and codes are given to start reading after the header (see read_trace()).
+    """
+    if codes is None:
+        codes = dict()
+
+    if fd is None:
+        fd = open_trace(path)
+        magic, version = HEADER.unpack(fd.read(HEADER.size))
+        if magic != VMPT_MAGIC:
+            raise ValueError(f'{path} is not a binary VMP trace')
+        if version > VMPT_VERSION:
+            raise ValueError(f'{path}: unsupported trace version {version}')
+
+    with fd:
+        data = b''
+        off  = 0
+        while True:
+            chunk = fd.read(CHUNK_SIZE)
+            if not chunk:
+                break
+            data = data[off:] + chunk
+            off  = 0
+            while off < len(data):
+                kind = data[off]
+                if kind not in PAYLOAD:
+                    raise ValueError(f'{path}: unknown record kind {kind:#x}')
+                payload = PAYLOAD[kind]
+                if off + 1 + payload.size > len(data):
+                    break
+                fields = payload.unpack_from(data, off + 1)
+
+                if kind == VMPT_REC_REGS_DELTA:
+                    indexes, values = delta_layout(fields[0])
+                    if off + 1 + payload.size + values.size > len(data):
+                        break
+                    delta = list(zip(indexes, values.unpack_from(data, off + 1 + payload.size)))
+                    off += 1 + payload.size + values.size
+                    yield ('r', delta)
+                    continue
+
+                off += 1 + payload.size
+
+                if kind == VMPT_REC_EXEC:
+                    yield codes[fields[0]]
+
+                elif kind == VMPT_REC_MEMREAD:
+                    yield ('mr', fields[0], fields[1], fields[2])
+
+                elif kind == VMPT_REC_MEMWRITE:
+                    yield ('mw', fields[0], fields[1], fields[2])
+
+                elif kind == VMPT_REC_USES:
+                    yield ('u', fields[0], fields[1])
+
+                elif kind == VMPT_REC_CODE:
+                    code, addr, size, opcode = fields
+                    codes[code] = ('i', addr, size, opcode[:size], code)
+
+                elif kind == VMPT_REC_REGS:
+                    yield ('r', list(enumerate(fields)))
+
+                elif kind == VMPT_REC_INST:
+                    # Traces older than version 3 carry the opcode on every execution
+                    addr, size, opcode = fields
+                    key = (addr, opcode[:size])
+                    if key not in codes:
+                        codes[key] = ('i', addr, size, opcode[:size], len(codes))
+                    yield codes[key]
+
+        if off != len(data):
+            raise ValueError(f'{path}: truncated trace')
+    return
+
+
+def read_text(path, fd=None):
+    """ Same records as read_binary() but from a text trace """
+    prev  = [None] * VMPT_NUM_REGS
+    codes = dict()
+    with io.TextIOWrapper(fd or open_trace(path)) as fd:
+        for line in fd:
+            args = line.rstrip('\n').split(':')
+            kind = args[0]
+
+            if kind == 'mr':
+                yield ('mr', int(args[1], 16), int(args[2]), int(args[3], 16))
+
+            elif kind == 'r':
+                # Only parse registers which differ from the previous line
+                regs = args[1:]
+                yield ('r', [(i, int(x, 16)) for i, (x, p) in enumerate(zip(regs, prev)) if x != p])
+                prev = regs
+
+            elif kind == 'i':
+                # Only decode the first execution of an instruction
+                key = line[2:]
+                record = codes.get(key)
+                if record is None:
+                    record = ('i', int(args[1], 16), int(args[2]), bytes.fromhex(args[3]), len(codes))
+                    codes[key] = record
+                yield record
+
+            elif kind == 'mw':
+                yield ('mw', int(args[1], 16), int(args[2]), int(args[3], 16))
+
+            elif kind == 'u':
+                yield ('u', int(args[1], 16), int(args[2], 16))
+    return
+
+
+def lz4_pack(data):
+    """ Encodes data as a LZ4 block of a frame (size with bit 31 set when stored) """
+    try:
+        import lz4.block
+        packed = lz4.block.compress(data, store_size=False)
+        if len(packed) < len(data):
+            return struct.pack('<I', len(packed)) + packed
+    except ImportError:
+        pass
+    return struct.pack('<I', len(data) | 0x80000000) + data
+
+
+def read_blocks(path):
+    """
+    Returns the blocks of a columnar trace as (column, count, size, first,
+    last, min_addr, max_addr, file offset) tuples, without decoding them.
+    """
+    blocks = list()
+    with open(path, 'rb') as fd:
+        magic, version = HEADER.unpack(fd.read(HEADER.size))
+        if magic != VMPC_MAGIC:
+            raise ValueError(f'{path} is not a columnar VMP trace')
+        if version > VMPC_VERSION:
+            raise ValueError(f'{path}: unsupported trace version {version}')
+
+        while True:
+            header = fd.read(BLOCK_HEADER.size)
+            if not header:
+                break
+            if len(header) < BLOCK_HEADER.size:
+                raise ValueError(f'{path}: truncated trace')
+            fields = BLOCK_HEADER.unpack(header)
+            size, = struct.unpack('<I', fd.read(4))
+            blocks.append(fields + (fd.tell() - 4,))
+            fd.seek(size & 0x7fffffff, io.SEEK_CUR)
+    return blocks
+
+
+def block_data(fd, block):
+    """ Decompresses a block of a columnar trace """
+    fd.seek(block[-1])
+    size, = struct.unpack('<I', fd.read(4))
+    data = fd.read(size & 0x7fffffff)
+    if size & 0x80000000:
+        return data
+    try:
+        import lz4.block
+        return lz4.block.decompress(data, uncompressed_size=block[2])
+    except ImportError:
+        out = bytearray()
+        lz4_block(data, out)
+        return bytes(out)
+
+
+def column_data(fd, blocks, column, addrs=None):
+    """ Yields the data of the blocks of a column, only those which may contain one of addrs if given """
+    for block in blocks:
+        if block[0] != column:
+            continue
+        if addrs is not None and not any(block[5] <= a <= block[6] for a in addrs):
+            continue
+        yield block_data(fd, block)
+    return
+
+
+def column_regs(fd, blocks):
+    """ Yields the register deltas of a columnar trace """
+    for data in column_data(fd, blocks, VMPC_COL_REGS):
+        off = 0
+        while off < len(data):
+            indexes, values = delta_layout(MASK.unpack_from(data, off)[0])
+            yield list(zip(indexes, values.unpack_from(data, off + MASK.size)))
+            off += MASK.size + values.size
+    return
+
+
+def column_codes(fd, blocks):
+    """ Returns the code dictionary of a columnar trace as 'i' records """
+    codes = dict()
+    for data in column_data(fd, blocks, VMPC_COL_CODE):
+        for code, addr, size, opcode in CODE.iter_unpack(data):
+            codes[code] = ('i', addr, size, opcode[:size], code)
+    return codes
+
+
+def read_columnar(path):
+    """ Same records as read_binary() but from a columnar trace """
+    blocks = read_blocks(path)
+
+    with open(path, 'rb') as fd:
+        codes  = column_codes(fd, blocks)
+        regs   = column_regs(fd, blocks)
+        reads  = (r for data in column_data(fd, blocks, VMPC_COL_MEMREAD) for r in ACCESS.iter_unpack(data))
+        writes = (w for data in column_data(fd, blocks, VMPC_COL_MEMWRITE) for w in ACCESS.iter_unpack(data))
+        read   = next(reads, None)
+        write  = next(writes, None)
+
+        # Merge the columns on the instruction number
+        inst = 0
+        for data in column_data(fd, blocks, VMPC_COL_EXEC):
+            for code, in EXEC.iter_unpack(data):
+                while read and read[0] == inst:
+                    yield ('mr', read[1], read[2], read[3])
+                    read = next(reads, None)
+                yield ('r', next(regs))
+                yield codes[code]
+                while write and write[0] == inst:
+                    yield ('mw', write[1], write[2], write[3])
+                    write = next(writes, None)
+                inst += 1
+    return
+
+
+def exec_counts(path, addrs=None):
+    """
+    Returns the number of executions of every instruction address of a
+    columnar trace, only of addrs if given. Only the instruction column is
+    decoded and blocks which can not contain addrs are skipped.
+    """
+    blocks = read_blocks(path)
+    counts = collections.Counter()
+
+    with open(path, 'rb') as fd:
+        codes = column_codes(fd, blocks)
+        for data in column_data(fd, blocks, VMPC_COL_EXEC, addrs):
+            if numpy is not None:
+                ids = numpy.bincount(numpy.frombuffer(data, dtype='<u4'))
+                counts.update({code: int(n) for code, n in enumerate(ids) if n})
+            else:
+                counts.update(array('I', data))
+
+    result = collections.Counter()
+    for code, n in counts.items():
+        addr = codes[code][1]
+        if addrs is None or addr in addrs:
+            result[addr] += n
+    return result
+
+
+class ColumnWriter(object):
+    """ Writes records to a columnar trace, the same way as the Pintool ('u' records have no column) """
+
+    def __init__(self, out):
+        self.out     = out
+        self.columns = dict()
+        self.emitted = set()
+        self.inst    = 0
+        self.regs    = [None] * VMPT_NUM_REGS
+        out.write(HEADER.pack(VMPC_MAGIC, VMPC_VERSION))
+
+    def put(self, column, data, inst, addr):
+        col = self.columns.setdefault(column, [bytearray(), 0, 0, 0, 0, 0])
+        if len(col[0]) + len(data) > VMPC_BLOCK_SIZE:
+            self.flush(column)
+            col = self.columns[column]
+        if not col[1]:
+            col[2], col[4], col[5] = inst, addr, addr
+        col[0] += data
+        col[1] += 1
+        col[3]  = inst
+        col[4]  = min(col[4], addr)
+        col[5]  = max(col[5], addr)
+
+    def flush(self, column):
+        data, count, first, last, low, high = self.columns[column]
+        self.out.write(BLOCK_HEADER.pack(column, count, len(data), first, last, low, high))
+        self.out.write(lz4_pack(bytes(data)))
+        self.columns[column] = [bytearray(), 0, 0, 0, 0, 0]
+
+    def write(self, record):
+        kind = record[0]
+
+        if kind == 'mr':
+            self.put(VMPC_COL_MEMREAD, ACCESS.pack(self.inst, *record[1:]), self.inst, record[1])
+
+        elif kind == 'mw':
+            self.put(VMPC_COL_MEMWRITE, ACCESS.pack(self.inst - 1, *record[1:]), self.inst - 1, record[1])
+
+        elif kind == 'r':
+            # Deltas are computed again, the record may carry unchanged registers
+            delta = [(i, v) for i, v in record[1] if self.regs[i] != v]
+            mask  = 0
+            for i, v in delta:
+                self.regs[i] = v
+                mask |= (1 << i)
+            self.put(VMPC_COL_REGS, MASK.pack(mask) + delta_layout(mask)[1].pack(*[v for _, v in sorted(delta)]), self.inst, 0)
+
+        elif kind == 'i':
+            _, addr, size, opcode, code = record
+            if code not in self.emitted:
+                self.emitted.add(code)
+                self.put(VMPC_COL_CODE, CODE.pack(code, addr, size, opcode), self.inst, addr)
+            self.put(VMPC_COL_EXEC, EXEC.pack(code), self.inst, addr)
+            self.inst += 1
+
+    def close(self):
+        for column in sorted(self.columns):
+            if self.columns[column][1]:
+                self.flush(column)
+
+
+def read_from(path, binary, index, start):
+    """ Reads a trace from the last checkpoint before instruction `start` """
+    _, checkpoints, codes, blocks = index
+    n = [i for i, c in enumerate(checkpoints) if c[0] <= start][-1]
+    icount, offset, regs, _ = checkpoints[n]
+
+    # What the replayer knows at the checkpoint, then the records after it
+    yield from known_memory(path + '.idx', checkpoints, n)
+    yield ('r', list(enumerate(regs)))
+
+    fd = open_at(path, offset, blocks)
+    if binary:
+        yield from read_binary(path, fd, codes)
+    else:
+        yield from read_text(path, fd)
+    return
+
+
+def read_trace(path, start=0):
+    """
+    start is the number of instructions to skip. The trace is read from the
+    last checkpoint before it, or from the beginning without an index.
+    """
+    if is_columnar(path):
+        return read_columnar(path)
+
+    binary = is_binary(path)
+
+    if start and os.path.exists(path + '.idx'):
+        index = read_index(path + '.idx')
+        if any(c[0] <= start for c in index[1]):
+            return read_from(path, binary, index, start)
+
+    if binary:
+        return read_binary(path)
+    return read_text(path)
+
+
+def format_record(record, regs):
+    """ regs is the full register file, updated with the deltas of 'r' records """
+    kind = record[0]
+
+    if kind in ('mr', 'mw'):
+        _, addr, size, value = record
+        return f'{kind}:{addr:#x}:{size}:{value:#x}'
+
+    if kind == 'r':
+        for index, value in record[1]:
+            regs[index] = value
+        return 'r:' + ':'.join(f'{x:#x}' for x in regs)
+
+    if kind == 'i':
+        _, addr, size, opcode, _ = record
+        return f'i:{addr:#x}:{size}:{opcode.hex().upper()}'
+
+    if kind == 'u':
+        return f'u:{record[1]:#x}:{record[2]:#x}'
+
+    raise ValueError(f'unknown record kind {kind}')
+
+
+def pack_record(record, emitted):
+    """ emitted is the set of code ids already packed """
+    kind = record[0]
+
+    if kind == 'mr':
+        _, addr, size, value = record
+        return bytes([VMPT_REC_MEMREAD]) + MEMREAD.pack(addr, size, value)
+
+    if kind == 'mw':
+        _, addr, size, value = record
+        return bytes([VMPT_REC_MEMWRITE]) + MEMWRITE.pack(addr, size, value)
+
+    if kind == 'u':
+        return bytes([VMPT_REC_USES]) + USES.pack(record[1], record[2])
+
+    if kind == 'r':
+        mask = 0
+        for index, _ in record[1]:
+            mask |= (1 << index)
+        return bytes([VMPT_REC_REGS_DELTA]) + MASK.pack(mask) + delta_layout(mask)[1].pack(*[v for _, v in sorted(record[1])])
+
+    if kind == 'i':
+        _, addr, size, opcode, code = record
+        data = bytes([VMPT_REC_EXEC]) + EXEC.pack(code)
+        if code not in emitted:
+            emitted.add(code)
+            data = bytes([VMPT_REC_CODE]) + CODE.pack(code, addr, size, opcode) + data
+        return data
+
+    raise ValueError(f'unknown record kind {kind}')
+
+
+def to_text(path, out, start=0):
+    regs = [0] * VMPT_NUM_REGS
+    for record in read_trace(path, start):
+        out.write(format_record(record, regs) + '\n')
+    return
+
+
+def to_binary(path, out):
+    emitted = set()
+    out.write(HEADER.pack(VMPT_MAGIC, VMPT_VERSION))
+    for record in read_trace(path):
+        out.write(pack_record(record, emitted))
+    return
+
+
+def to_columnar(path, out):
+    writer = ColumnWriter(out)
+    for record in read_trace(path):
+        writer.write(record)
+    writer.close()
+    return
+
+
+def main():
+    parser = argparse.ArgumentParser(formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--to-text",   type=str, metavar="<trace>",  help="Convert a trace to the text format")
+    parser.add_argument("--to-binary", type=str, metavar="<trace>",  help="Convert a trace to the binary format")
+    parser.add_argument("--to-columnar", type=str, metavar="<trace>", help="Convert a trace to the columnar format")
+    parser.add_argument("--histogram", type=str, metavar="<trace>",  help="Print the number of executions of every instruction of a columnar trace")
+    parser.add_argument("--addr",      type=lambda x: int(x, 0), action="append", metavar="<addr>", help="Only count this address (--histogram, may be repeated)")
+    parser.add_argument("-o",          type=str, metavar="<output>", help="Output file (default: stdout)")
+    parser.add_argument("--start",     type=int, default=0, metavar="<icount>", help="Start from the last checkpoint before this instruction (indexed traces)")
+    argv = parser.parse_args(sys.argv[1:])
+
+    if argv.to_text:
+        out = open(argv.o, 'w') if argv.o else sys.stdout
+        to_text(argv.to_text, out, argv.start)
+
+    elif argv.to_binary:
+        out = open(argv.o, 'wb') if argv.o else sys.stdout.buffer
+        to_binary(argv.to_binary, out)
+
+    elif argv.to_columnar:
+        out = open(argv.o, 'wb') if argv.o else sys.stdout.buffer
+        to_columnar(argv.to_columnar, out)
+
+    elif argv.histogram:
+        out = open(argv.o, 'w') if argv.o else sys.stdout
+        counts = exec_counts(argv.histogram, set(argv.addr) if argv.addr else None)
+        for addr, n in counts.most_common():
+            out.write(f'{addr:#x} {n}\n')
+
+    else:
+        print('[-] You must define a conversion')
+        print('[!] Syntax: %s --to-text <trace> [-o <output>]' %(sys.argv[0]))
+        print('[!] Syntax: %s --to-binary <trace> [-o <output>]' %(sys.argv[0]))
+        print('[!] Syntax: %s --to-columnar <trace> [-o <output>]' %(sys.argv[0]))
+        print('[!] Syntax: %s --histogram <trace> [--addr <addr> ...]' %(sys.argv[0]))
+        return -1
+
+    if argv.o:
+        out.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())